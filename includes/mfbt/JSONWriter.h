@@ -99,7 +99,7 @@
 #include "./Sprintf.h"
 #include "./UniquePtr.h"
 #include "./Vector.h"
-#include "double-conversion/double-conversion.h"
+#include "./double-conversion/double-conversion/double-conversion.h"
 
 #include <utility>
 
@@ -28,7 +28,7 @@
 #ifndef DOUBLE_CONVERSION_DOUBLE_TO_STRING_H_
 #define DOUBLE_CONVERSION_DOUBLE_TO_STRING_H_
 
-#include "./Types.h"
+#include "../../Types.h"
 #include "utils.h"
 
 namespace double_conversion {
@@ -31,7 +31,7 @@
 #include <cstdlib>
 #include <cstring>
 
-#include "./Assertions.h"
+#include "../../Assertions.h"
 #ifndef DOUBLE_CONVERSION_ASSERT
 #define DOUBLE_CONVERSION_ASSERT(condition) MOZ_ASSERT(condition)
 #endif
@@ -0,0 +1,8 @@
+# Regenerate the Unicode property tables in src/features from the installed ICU.
+# Run this after updating ICU, so that the tables match what ICU is tested against.
+set -e
+mkdir -p build/tools
+clang++ -std=c++2a -O2 tools/make-unicode-tables.cpp -o build/tools/make-unicode-tables \
+  $(pkg-config --cflags --libs icu-uc)
+./build/tools/make-unicode-tables src/features/utf8_grapheme_table.h \
+  src/features/utf8_case_fold_table.h
@@ -0,0 +1,126 @@
+#include "../test.h"
+#include "./icu_allocations.h"
+#include "unicode/dtptngen.h"
+#include "unicode/gregocal.h"
+#include "unicode/numberformatter.h"
+#include "unicode/smpdtfmt.h"
+#include "unicode/utypes.h"
+#include <memory>
+#include <string>
+#include <vector>
+
+/**
+ * What the common ICU operations cost, in time and in heap allocations, for a few
+ * locales with different scripts and numbering systems. Run with BENCH_JSON to
+ * keep the results, so that an ICU upgrade can be compared against them.
+ */
+namespace features {
+namespace icu_bench {
+
+using ::icu::DateTimePatternGenerator;
+using ::icu::GregorianCalendar;
+using ::icu::Locale;
+using ::icu::SimpleDateFormat;
+using ::icu::UnicodeString;
+using ::icu::number::LocalizedNumberFormatter;
+using ::icu::number::NumberFormatter;
+
+struct LocaleCase {
+  const char *name;
+  // A tag for the same locale that needs canonicalizing.
+  const char *tag;
+};
+
+const LocaleCase LOCALES[] = {
+    {"en", "en-us"}, {"es", "es-419"}, {"ar", "ar-eg"}, {"ja", "ja-jp"}, {"hi", "hi-in"},
+};
+
+const char16_t *DATE_SKELETON = u"yMMMMEEEEdjm";
+const char16_t *NUMBER_SKELETON = u"compact-short currency/USD .##";
+
+void run_tests() {
+  test::suite("features::icu_bench", []() {
+    test::describe("ICU operations per locale", []() {
+      UErrorCode status = U_ZERO_ERROR;
+      GregorianCalendar calendar(2020, 0, 21, 14, 5, status);
+      UDate date = calendar.getTime(status);
+      test::BenchmarkOptions options;
+      options.samples = 5;
+      options.allocations = IcuAllocationCounter::Count;
+
+      struct Row {
+        std::string operation;
+        std::vector<test::BenchmarkResult> results;
+      };
+      std::vector<Row> rows;
+      auto run = [&](size_t aRow, const char *aOperation, const LocaleCase &aLocale,
+                     auto aBody) {
+        if (rows.size() <= aRow) {
+          rows.push_back(Row{aOperation, {}});
+        }
+        rows[aRow].results.push_back(test::benchmark(
+            std::string(aOperation) + ", " + aLocale.name, aBody, options));
+      };
+
+      for (const LocaleCase &localeCase : LOCALES) {
+        Locale locale(localeCase.name);
+        std::unique_ptr<DateTimePatternGenerator> generator(
+            DateTimePatternGenerator::createInstance(locale, status));
+        UnicodeString pattern = generator->getBestPattern(DATE_SKELETON, status);
+        SimpleDateFormat formatter(pattern, locale, status);
+        LocalizedNumberFormatter numberFormatter =
+            NumberFormatter::forSkeleton(NUMBER_SKELETON, status).locale(locale);
+        size_t row = 0;
+
+        run(row++, "create a pattern generator", localeCase, [&]() {
+          std::unique_ptr<DateTimePatternGenerator> created(
+              DateTimePatternGenerator::createInstance(locale, status));
+          test::DoNotOptimize(created);
+        });
+        run(row++, "getBestPattern", localeCase, [&]() {
+          test::DoNotOptimize(generator->getBestPattern(DATE_SKELETON, status));
+        });
+        run(row++, "create a date formatter", localeCase, [&]() {
+          SimpleDateFormat created(pattern, locale, status);
+          test::DoNotOptimize(created);
+        });
+        run(row++, "format a date", localeCase, [&]() {
+          UnicodeString formatted;
+          formatter.format(date, formatted, status);
+          test::DoNotOptimize(formatted);
+        });
+        run(row++, "create a number formatter from a skeleton", localeCase, [&]() {
+          LocalizedNumberFormatter created =
+              NumberFormatter::forSkeleton(NUMBER_SKELETON, status).locale(locale);
+          test::DoNotOptimize(created);
+        });
+        run(row++, "format a number", localeCase, [&]() {
+          test::DoNotOptimize(numberFormatter.formatDouble(1234567.89, status)
+                                  .toString(status));
+        });
+        run(row++, "Locale::createCanonical", localeCase, [&]() {
+          Locale canonical = Locale::createCanonical(localeCase.tag);
+          test::DoNotOptimize(canonical);
+        });
+      }
+
+      printf("\n      %-42s", "ns/op and allocations/op");
+      for (const LocaleCase &localeCase : LOCALES) {
+        printf("%16s", localeCase.name);
+      }
+      printf("\n");
+      for (const Row &row : rows) {
+        printf("      %-42s", row.operation.c_str());
+        for (const test::BenchmarkResult &result : row.results) {
+          printf("%10.0f %5.0f", result.median, result.allocations.valueOr(0));
+        }
+        printf("\n");
+      }
+      printf("\n");
+      test::ok(U_SUCCESS(status), "Every operation succeeds");
+    });
+  });
+}
+
+} // namespace icu_bench
+} // namespace features
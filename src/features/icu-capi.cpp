@@ -1,4 +1,8 @@
 #include "../test.h"
+#include "./icu_allocations.h"
+#include "./parallel.h"
+#include "./utf8_simd.h"
+#include "mfbt/Span.h"
 #include "unicode/calendar.h"
 #include "unicode/dtptngen.h"
 #include "unicode/gregocal.h"
@@ -6,7 +10,11 @@
 #include "unicode/smpdtfmt.h"
 #include "unicode/udat.h"
 #include "unicode/utypes.h"
+#include <atomic>
 #include <codecvt>
+#include <cstring>
+#include <mutex>
+#include <string>
 
 namespace features {
 namespace icu_capi {
@@ -17,6 +25,202 @@ std::string toString(UChar *u16) {
   return std::wstring_convert<std::codecvt_utf8_utf16<UChar>, UChar>{}.to_bytes(u16);
 }
 
+/**
+ * A pool of UDateFormat handles that all share the same styles, locale, and time
+ * zone. Opening a UDateFormat loads the locale's data and builds a formatter, which
+ * is far slower than formatting with one, so the handles are opened once, by
+ * cloning the first one, and then checked out over and over.
+ *
+ * A handle can only be used by one thread at a time. Each thread has a preferred
+ * slot in the pool, which it checks out without taking a lock, so every thread
+ * ends up reusing its own handle. The lock is only taken when the preferred slot
+ * is busy or hasn't been filled yet.
+ */
+class DateFormatPool {
+  struct Slot {
+    UDateFormat *mFormat;
+    std::atomic<bool> mInUse{false};
+  };
+
+public:
+  // The handles that the pool keeps. Past this, checked out handles are closed
+  // when they are returned.
+  static constexpr size_t MAX_SLOTS = 64;
+
+  DateFormatPool(UDateFormatStyle aTimeStyle, UDateFormatStyle aDateStyle,
+                 const char *aLocale, const char16_t *aTimeZone, UErrorCode &aStatus)
+      : mPrototype(udat_open(aTimeStyle, aDateStyle, aLocale, aTimeZone,
+                             aTimeZone ? -1 : 0, nullptr, -1, &aStatus)) {}
+
+  DateFormatPool(const DateFormatPool &) = delete;
+  DateFormatPool &operator=(const DateFormatPool &) = delete;
+
+  // Every handle must have been returned by now.
+  ~DateFormatPool() {
+    for (auto &slot : mSlots) {
+      if (Slot *filled = slot.load(std::memory_order_relaxed)) {
+        udat_close(filled->mFormat);
+        delete filled;
+      }
+    }
+    if (mPrototype) {
+      udat_close(mPrototype);
+    }
+  }
+
+  /**
+   * A checked out UDateFormat, which goes back to the pool when this goes out of
+   * scope.
+   */
+  class Handle {
+  public:
+    Handle(Handle &&aOther)
+        : mSlot(std::exchange(aOther.mSlot, nullptr)),
+          mUnpooled(std::exchange(aOther.mUnpooled, nullptr)) {}
+    Handle(const Handle &) = delete;
+    Handle &operator=(const Handle &) = delete;
+    Handle &operator=(Handle &&) = delete;
+
+    ~Handle() {
+      if (mSlot) {
+        mSlot->mInUse.store(false, std::memory_order_release);
+      }
+      if (mUnpooled) {
+        udat_close(mUnpooled);
+      }
+    }
+
+    UDateFormat *Get() const { return mSlot ? mSlot->mFormat : mUnpooled; }
+    explicit operator bool() const { return Get(); }
+
+  private:
+    friend class DateFormatPool;
+    Handle(Slot *aSlot, UDateFormat *aUnpooled) : mSlot(aSlot), mUnpooled(aUnpooled) {}
+
+    Slot *mSlot;
+    UDateFormat *mUnpooled;
+  };
+
+  Handle Checkout(UErrorCode &aStatus) {
+    if (U_FAILURE(aStatus) || !mPrototype) {
+      return Handle(nullptr, nullptr);
+    }
+    // The slots of exited threads are reused, so the live threads stay spread out
+    // over the preferred slots.
+    size_t preferred = parallel::threadSlot() % MAX_SLOTS;
+    if (Slot *slot = TryAcquire(preferred)) {
+      return Handle(slot, nullptr);
+    }
+
+    std::lock_guard lock(mMutex);
+    // Fill the thread's own slot first, so that it's found without the lock next
+    // time, and then any other free or empty slot.
+    for (size_t i = 0; i < MAX_SLOTS; i++) {
+      size_t index = (preferred + i) % MAX_SLOTS;
+      if (Slot *slot = TryAcquire(index)) {
+        return Handle(slot, nullptr);
+      }
+      if (!mSlots[index].load(std::memory_order_relaxed)) {
+        auto *slot = new Slot{udat_clone(mPrototype, &aStatus)};
+        if (U_FAILURE(aStatus)) {
+          delete slot;
+          return Handle(nullptr, nullptr);
+        }
+        slot->mInUse.store(true, std::memory_order_relaxed);
+        mSlots[index].store(slot, std::memory_order_release);
+        return Handle(slot, nullptr);
+      }
+    }
+    return Handle(nullptr, udat_clone(mPrototype, &aStatus));
+  }
+
+  // How many handles the pool has opened.
+  size_t HandleCount() const {
+    size_t count = 0;
+    for (const auto &slot : mSlots) {
+      count += slot.load(std::memory_order_relaxed) ? 1 : 0;
+    }
+    return count;
+  }
+
+  /**
+   * Format the date as UTF-8 into the buffer, and return its length. When the
+   * buffer is too small, this sets U_BUFFER_OVERFLOW_ERROR and returns the length
+   * that is needed, like udat_format does. The result is not null terminated.
+   *
+   * The UTF-16 is formatted into a buffer on the stack, and only formats again
+   * into a larger buffer when that overflows, so nothing is allocated for dates
+   * that fit.
+   */
+  int32_t FormatUtf8(UDate aDate, mozilla::Span<char> aBuffer, UErrorCode &aStatus) {
+    Handle handle = Checkout(aStatus);
+    if (!handle) {
+      return 0;
+    }
+    char16_t stackText[STACK_LENGTH];
+    std::u16string longText;
+    mozilla::Span<const char16_t> text;
+    int32_t length =
+        udat_format(handle.Get(), aDate, stackText, STACK_LENGTH, nullptr, &aStatus);
+    if (aStatus == U_BUFFER_OVERFLOW_ERROR) {
+      aStatus = U_ZERO_ERROR;
+      longText.resize(length);
+      udat_format(handle.Get(), aDate, longText.data(), length, nullptr, &aStatus);
+      text = mozilla::Span(longText.data(), length);
+    } else {
+      text = mozilla::Span(stackText, length);
+    }
+    if (aStatus == U_STRING_NOT_TERMINATED_WARNING) {
+      aStatus = U_ZERO_ERROR;
+    }
+    if (U_FAILURE(aStatus)) {
+      return 0;
+    }
+
+    // The encoder needs room for the longest possible UTF-8, so use the caller's
+    // buffer when it has that room, and otherwise go through the stack.
+    auto dest = mozilla::Span(reinterpret_cast<uint8_t *>(aBuffer.data()),
+                              aBuffer.Length());
+    if (dest.Length() >= text.Length() * 3) {
+      return int32_t(features::utf8::simd::Utf16ToUtf8(text, dest));
+    }
+    uint8_t stackBytes[STACK_LENGTH * 3];
+    std::string longBytes;
+    mozilla::Span<uint8_t> bytes(stackBytes, sizeof(stackBytes));
+    if (text.Length() > STACK_LENGTH) {
+      longBytes.resize(text.Length() * 3);
+      bytes = mozilla::Span(reinterpret_cast<uint8_t *>(longBytes.data()),
+                            longBytes.size());
+    }
+    size_t utf8Length = features::utf8::simd::Utf16ToUtf8(text, bytes);
+    if (utf8Length > aBuffer.Length()) {
+      aStatus = U_BUFFER_OVERFLOW_ERROR;
+    } else {
+      memcpy(aBuffer.data(), bytes.data(), utf8Length);
+    }
+    return int32_t(utf8Length);
+  }
+
+private:
+  // Long enough for every style in every locale, except the longest full styles.
+  static constexpr int32_t STACK_LENGTH = 64;
+
+  Slot *TryAcquire(size_t aIndex) {
+    Slot *slot = mSlots[aIndex].load(std::memory_order_acquire);
+    bool expected = false;
+    if (slot && slot->mInUse.compare_exchange_strong(expected, true,
+                                                     std::memory_order_acquire)) {
+      return slot;
+    }
+    return nullptr;
+  }
+
+  // Never formatted with, only cloned.
+  UDateFormat *mPrototype;
+  std::atomic<Slot *> mSlots[MAX_SLOTS] = {};
+  std::mutex mMutex;
+};
+
 void run_tests() {
   test::suite("features::icu_capi", []() {
     test::describe("udat_format with the C api", []() {
@@ -120,6 +324,146 @@ void run_tests() {
 
       udat_close(dateFormat);
     });
+
+    // Format directly with a newly opened UDateFormat, to compare against.
+    auto formatDirectly = [](UDateFormatStyle aTimeStyle, UDateFormatStyle aDateStyle,
+                             const char *aLocale, const char16_t *aTimeZone,
+                             UDate aDate) {
+      UErrorCode status = U_ZERO_ERROR;
+      UDateFormat *format = udat_open(aTimeStyle, aDateStyle, aLocale, aTimeZone,
+                                      aTimeZone ? -1 : 0, nullptr, -1, &status);
+      std::u16string formatted(256, u'\0');
+      int32_t length = udat_format(format, aDate, formatted.data(),
+                                   int32_t(formatted.size()), nullptr, &status);
+      udat_close(format);
+      formatted.resize(U_SUCCESS(status) ? length : 0);
+      return toString(formatted.data());
+    };
+
+    test::describe("pooled date formats", [&]() {
+      UErrorCode status = U_ZERO_ERROR;
+      UDate date = 1618431049000.0;
+      const char *locales[] = {"en", "de", "ja", "ar", "hi"};
+      const char16_t *timeZones[] = {u"UTC", u"America/New_York", u"Asia/Kolkata"};
+      const UDateFormatStyle styles[] = {UDAT_SHORT, UDAT_MEDIUM, UDAT_LONG};
+
+      bool allEqual = true;
+      for (const char *locale : locales) {
+        for (const char16_t *timeZone : timeZones) {
+          for (UDateFormatStyle style : styles) {
+            DateFormatPool pool(style, style, locale, timeZone, status);
+            char buffer[256];
+            int32_t length = pool.FormatUtf8(date, buffer, status);
+            allEqual &= std::string(buffer, U_SUCCESS(status) ? length : 0) ==
+                        formatDirectly(style, style, locale, timeZone, date);
+          }
+        }
+      }
+      test::ok(U_SUCCESS(status), "The pools can format");
+      test::ok(allEqual, "The pools format like newly opened formats");
+
+      DateFormatPool full(UDAT_FULL, UDAT_FULL, "en", u"UTC", status);
+      std::string expected = formatDirectly(UDAT_FULL, UDAT_FULL, "en", u"UTC", date);
+      char buffer[256];
+      int32_t length = full.FormatUtf8(date, buffer, status);
+      test::equal(std::string(buffer, length), expected,
+                  "Dates that are too long for the stack buffer are formatted");
+
+      char small[8];
+      length = full.FormatUtf8(date, small, status);
+      test::equal(status, U_BUFFER_OVERFLOW_ERROR, "A small buffer overflows");
+      test::equal(length, int32_t(expected.size()), "And reports the length needed");
+      status = U_ZERO_ERROR;
+
+      DateFormatPool pool(UDAT_SHORT, UDAT_NONE, "en", nullptr, status);
+      UDateFormat *first;
+      {
+        DateFormatPool::Handle a = pool.Checkout(status);
+        DateFormatPool::Handle b = pool.Checkout(status);
+        test::ok(a.Get() != b.Get(), "Two checkouts get different handles");
+        first = a.Get();
+      }
+      test::equal(pool.Checkout(status).Get(), first, "A returned handle is reused");
+      test::equal(pool.HandleCount(), size_t(2), "Only the handles needed are opened");
+
+      parallel::ThreadPool threads(4);
+      std::string expectedShort =
+          formatDirectly(UDAT_SHORT, UDAT_SHORT, "ja", u"UTC", date);
+      DateFormatPool shared(UDAT_SHORT, UDAT_SHORT, "ja", u"UTC", status);
+      std::atomic<size_t> mismatches = 0;
+      auto formatTask = [&](size_t) {
+        UErrorCode status = U_ZERO_ERROR;
+        char buffer[64];
+        int32_t length = shared.FormatUtf8(date, buffer, status);
+        if (U_FAILURE(status) || std::string(buffer, length) != expectedShort) {
+          mismatches++;
+        }
+      };
+      threads.run(200, formatTask);
+      test::equal(mismatches.load(), size_t(0),
+                  "Threads can format from the same pool at once");
+      test::ok(shared.HandleCount() <= DateFormatPool::MAX_SLOTS,
+               "The pool stays bounded");
+
+      // ICU clones its calendar inside of every udat_format, so compare against
+      // formatting with a single handle into a buffer, after opening everything.
+      UDateFormat *bare =
+          udat_open(UDAT_SHORT, UDAT_SHORT, "ja", u"UTC", -1, nullptr, -1, &status);
+      auto countAllocations = [&](auto aFormat) {
+        aFormat(date);
+        size_t before = IcuAllocationCounter::Count();
+        for (int i = 0; i < 1000; i++) {
+          aFormat(date + i * 60000.0);
+        }
+        return IcuAllocationCounter::Count() - before;
+      };
+      size_t icuAllocations = countAllocations([&](UDate aDate) {
+        UChar formatted[64];
+        udat_format(bare, aDate, formatted, 64, nullptr, &status);
+      });
+      size_t poolAllocations = countAllocations(
+          [&](UDate aDate) { shared.FormatUtf8(aDate, buffer, status); });
+      udat_close(bare);
+      printf("      allocations per 1000 dates: %zu for ICU, %zu from the pool\n",
+             icuAllocations, poolAllocations);
+      test::ok(poolAllocations <= icuAllocations,
+               "Formatting from a pool doesn't allocate beyond ICU itself");
+      test::ok(U_SUCCESS(status), "Formatting succeeds");
+    });
+
+    test::describe("pooled date formats benchmark", []() {
+      UErrorCode status = U_ZERO_ERROR;
+      UDate date = 1618431049000.0;
+      test::BenchmarkOptions options;
+      options.samples = 5;
+
+      auto perCall = test::benchmark(
+          "open a format and allocate a buffer for every date",
+          [&]() {
+            UDateFormat *format = udat_open(UDAT_MEDIUM, UDAT_MEDIUM, "en", nullptr, -1,
+                                            nullptr, -1, &status);
+            int32_t length = udat_format(format, date, nullptr, 0, nullptr, &status);
+            status = U_ZERO_ERROR;
+            auto *formatted = (UChar *)malloc(sizeof(UChar) * (length + 1));
+            udat_format(format, date, formatted, length + 1, nullptr, &status);
+            test::DoNotOptimize(toString(formatted));
+            free(formatted);
+            udat_close(format);
+          },
+          options);
+      DateFormatPool pool(UDAT_MEDIUM, UDAT_MEDIUM, "en", nullptr, status);
+      auto pooled = test::benchmark(
+          "format from a pool into a buffer",
+          [&]() {
+            char buffer[64];
+            int32_t length = pool.FormatUtf8(date, buffer, status);
+            test::DoNotOptimize(buffer);
+            test::DoNotOptimize(length);
+          },
+          options);
+      printf("      speedup %.2fx\n", perCall.median / pooled.median);
+      test::ok(U_SUCCESS(status), "Formatting succeeds");
+    });
   });
 }
 
@@ -1,43 +1,1556 @@
 #include "../test.h"
+#include "./icu_allocations.h"
+#include "./parallel.h"
+#include "./utf8_simd.h"
+#include "mfbt/HashTable.h"
+#include "mfbt/Span.h"
+#include "unicode/basictz.h"
 #include "unicode/calendar.h"
 #include "unicode/dtptngen.h"
+#include "unicode/fpositer.h"
 #include "unicode/gregocal.h"
 #include "unicode/numberformatter.h"
+#include "unicode/numsys.h"
 #include "unicode/smpdtfmt.h"
+#include "unicode/timezone.h"
 #include "unicode/unum.h"
+#include "unicode/unumberformatter.h"
+#include "unicode/ustring.h"
 #include "unicode/utypes.h"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstring>
+#include <functional>
+#include <limits>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
 namespace features {
 namespace icu {
 
+using ::icu::BasicTimeZone;
 using ::icu::Calendar;
 using ::icu::CurrencyUnit;
 using ::icu::DateTimePatternGenerator;
 using ::icu::GregorianCalendar;
 using ::icu::Locale;
 using ::icu::SimpleDateFormat;
+using ::icu::TimeZone;
 using ::icu::UnicodeString;
+using ::icu::number::LocalizedNumberFormatter;
 using ::icu::number::Notation;
 using ::icu::number::NumberFormatter;
 using ::icu::number::Precision;
 
-std::string toString(UnicodeString &unicodeString) {
+mozilla::Span<const char16_t> utf16Of(const UnicodeString &aString) {
+  return mozilla::Span(aString.getBuffer(), aString.isBogus() ? 0 : aString.length());
+}
+
+// Strings up to this long are encoded on the stack, and then copied out at their
+// final size. Longer strings are encoded in place into their destination.
+constexpr size_t SHORT_UTF16_LENGTH = 64;
+
+/**
+ * Append the UTF-8 of a UnicodeString. The destination is sized for the longest
+ * possible UTF-8 up front, which is 3 bytes per code unit, and then cut back to
+ * what was written, rather than growing it as the string is converted like
+ * UnicodeString::toUTF8String does. Unpaired surrogates become U+FFFD, the same
+ * as with toUTF8String.
+ */
+void appendUtf8(const UnicodeString &aString, std::string &aAppendTo) {
+  auto utf16 = utf16Of(aString);
+  size_t start = aAppendTo.size();
+  if (utf16.Length() <= SHORT_UTF16_LENGTH) {
+    uint8_t buffer[SHORT_UTF16_LENGTH * 3];
+    size_t length = utf8::simd::Utf16ToUtf8(utf16, buffer);
+    aAppendTo.append(reinterpret_cast<const char *>(buffer), length);
+    return;
+  }
+  aAppendTo.resize(start + utf16.Length() * 3);
+  size_t length = utf8::simd::Utf16ToUtf8(
+      utf16, mozilla::Span(reinterpret_cast<uint8_t *>(aAppendTo.data() + start),
+                           utf16.Length() * 3));
+  aAppendTo.resize(start + length);
+}
+
+std::string toString(const UnicodeString &unicodeString) {
   std::string stdString;
-  unicodeString.toUTF8String(stdString);
+  appendUtf8(unicodeString, stdString);
   return stdString;
 }
 
+/**
+ * Write the UTF-8 of a UnicodeString into the buffer, and return its length. When
+ * the buffer is too small this sets U_BUFFER_OVERFLOW_ERROR and returns the length
+ * that is needed, like ICU does. The result is not null terminated.
+ *
+ * When the buffer can't hold the longest possible UTF-8, the string is encoded in
+ * pieces on the stack and copied in, so nothing is ever allocated.
+ */
+int32_t toUtf8(const UnicodeString &aString, mozilla::Span<char> aBuffer,
+               UErrorCode &aStatus) {
+  if (U_FAILURE(aStatus)) {
+    return 0;
+  }
+  auto utf16 = utf16Of(aString);
+  auto dest =
+      mozilla::Span(reinterpret_cast<uint8_t *>(aBuffer.data()), aBuffer.Length());
+  if (dest.Length() >= utf16.Length() * 3) {
+    return int32_t(utf8::simd::Utf16ToUtf8(utf16, dest));
+  }
+  size_t written = 0;
+  while (!utf16.IsEmpty()) {
+    size_t pieceLength = std::min(utf16.Length(), SHORT_UTF16_LENGTH);
+    // Keep surrogate pairs together.
+    if (pieceLength < utf16.Length() && U16_IS_LEAD(utf16[pieceLength - 1])) {
+      pieceLength--;
+    }
+    uint8_t piece[SHORT_UTF16_LENGTH * 3];
+    size_t length = utf8::simd::Utf16ToUtf8(utf16.To(pieceLength), piece);
+    if (written + length <= dest.Length()) {
+      memcpy(dest.data() + written, piece, length);
+    }
+    written += length;
+    utf16 = utf16.From(pieceLength);
+  }
+  if (written > dest.Length()) {
+    aStatus = U_BUFFER_OVERFLOW_ERROR;
+  }
+  return int32_t(written);
+}
+
+/**
+ * Keeps UTF-8 strings back to back in large blocks, so that many strings can be
+ * kept without an allocation for each one. The views that are returned stay valid
+ * until the arena is cleared or destroyed. Clearing keeps the blocks to be reused.
+ */
+class Utf8Arena {
+public:
+  explicit Utf8Arena(size_t aBlockSize = 4096) : mBlockSize(aBlockSize) {}
+  Utf8Arena(const Utf8Arena &) = delete;
+  Utf8Arena &operator=(const Utf8Arena &) = delete;
+  Utf8Arena(Utf8Arena &&) = default;
+  Utf8Arena &operator=(Utf8Arena &&) = default;
+
+  std::string_view Append(const UnicodeString &aString) {
+    auto utf16 = utf16Of(aString);
+    char *start = Reserve(utf16.Length() * 3);
+    size_t length = utf8::simd::Utf16ToUtf8(
+        utf16,
+        mozilla::Span(reinterpret_cast<uint8_t *>(start), utf16.Length() * 3));
+    return Commit(start, length);
+  }
+
+  std::string_view Append(std::string_view aText) {
+    char *start = Reserve(aText.size());
+    memcpy(start, aText.data(), aText.size());
+    return Commit(start, aText.size());
+  }
+
+  /**
+   * Make room for at least this many bytes in a single block, and return where
+   * they start. Appending that many bytes afterwards, counting the longest possible
+   * UTF-8 of each string, doesn't allocate.
+   */
+  char *Reserve(size_t aBytes) {
+    if (!mBlocks.empty() && mBlocks[mCurrent].mCapacity - mUsed >= aBytes) {
+      return mBlocks[mCurrent].mData.get() + mUsed;
+    }
+    // Use the next block that is big enough, which may be one that was kept from
+    // before the arena was cleared, and keep the ones it skips for later.
+    size_t next = mBlocks.empty() || mUsed == 0 ? mCurrent : mCurrent + 1;
+    auto found =
+        std::find_if(mBlocks.begin() + next, mBlocks.end(),
+                     [&](const Block &aBlock) { return aBlock.mCapacity >= aBytes; });
+    if (found == mBlocks.end()) {
+      size_t capacity = std::max(mBlockSize, aBytes);
+      mBlocks.insert(mBlocks.begin() + next,
+                     Block{std::unique_ptr<char[]>(new char[capacity]), capacity});
+    } else {
+      std::rotate(mBlocks.begin() + next, found, found + 1);
+    }
+    mCurrent = next;
+    mUsed = 0;
+    return mBlocks[mCurrent].mData.get();
+  }
+
+  void Clear() {
+    mCurrent = 0;
+    mUsed = 0;
+    mSize = 0;
+  }
+
+  // How many bytes of text have been appended since the arena was last cleared.
+  size_t Size() const { return mSize; }
+  size_t BlockCount() const { return mBlocks.size(); }
+
+private:
+  struct Block {
+    std::unique_ptr<char[]> mData;
+    size_t mCapacity;
+  };
+
+  std::string_view Commit(char *aStart, size_t aLength) {
+    mUsed += aLength;
+    mSize += aLength;
+    return std::string_view(aStart, aLength);
+  }
+
+  size_t mBlockSize;
+  std::vector<Block> mBlocks;
+  size_t mCurrent = 0;
+  // The bytes used in the current block.
+  size_t mUsed = 0;
+  size_t mSize = 0;
+};
+
 void icu_tests() {}
 
+/**
+ * The DateTimePatternGenerator for each locale, built the first time the locale is
+ * asked for and then kept for the life of the registry. Creating a generator loads
+ * and parses the locale's CLDR data, which takes hundreds of microseconds, while
+ * cloning one only copies what was already parsed.
+ *
+ * A generator can't be used by two threads at once, so the registry hands out
+ * clones, either owned by the caller or kept per thread. Once a locale is in the
+ * registry it's found without taking a lock: the entries are published in a fixed
+ * size open addressing table of atomic pointers, and they are never removed or
+ * replaced. Only the first lookup for a locale takes the lock to build its entry.
+ */
+class PatternGeneratorRegistry {
+public:
+  PatternGeneratorRegistry() = default;
+  PatternGeneratorRegistry(const PatternGeneratorRegistry &) = delete;
+  PatternGeneratorRegistry &operator=(const PatternGeneratorRegistry &) = delete;
+
+  // This thread's generator for the locale, which must not be passed to another
+  // thread. It's kept with the locale's entry, so it stays valid for the life of
+  // the registry.
+  DateTimePatternGenerator *ThreadGenerator(const Locale &aLocale,
+                                            UErrorCode &aStatus) {
+    const Entry *entry = Find(aLocale, aStatus);
+    if (!entry) {
+      return nullptr;
+    }
+    if (DateTimePatternGenerator *clone = entry->mClones.Get()) {
+      return clone;
+    }
+    return entry->mClones.Set(
+        std::unique_ptr<DateTimePatternGenerator>(entry->mPrototype->clone()));
+  }
+
+  // A new generator for the locale that is owned by the caller.
+  std::unique_ptr<DateTimePatternGenerator> Clone(const Locale &aLocale,
+                                                  UErrorCode &aStatus) {
+    const Entry *entry = Find(aLocale, aStatus);
+    if (!entry) {
+      return nullptr;
+    }
+    return std::unique_ptr<DateTimePatternGenerator>(entry->mPrototype->clone());
+  }
+
+  // How many generators have been created from the locale data.
+  size_t BuildCount() {
+    std::lock_guard lock(mMutex);
+    return mEntries.size();
+  }
+
+  // The registry that is shared by the whole program.
+  static PatternGeneratorRegistry &Shared() {
+    static PatternGeneratorRegistry sRegistry;
+    return sRegistry;
+  }
+
+private:
+  // This is more than the number of locales that ICU has data for. Any locales
+  // beyond it are still kept, but are looked up with the lock.
+  static constexpr size_t SLOT_COUNT = 1024;
+
+  struct Entry {
+    std::string mName;
+    // Never used directly, only cloned, which only reads it.
+    std::unique_ptr<DateTimePatternGenerator> mPrototype;
+    mutable parallel::PerThread<DateTimePatternGenerator> mClones;
+  };
+
+  const Entry *Find(const Locale &aLocale, UErrorCode &aStatus) {
+    if (U_FAILURE(aStatus)) {
+      return nullptr;
+    }
+    std::string_view name = aLocale.getName();
+    size_t hash = std::hash<std::string_view>{}(name);
+    // The slots only ever go from null to an entry, so if the entry is in the
+    // table, it comes before the first empty slot.
+    for (size_t probe = 0; probe < SLOT_COUNT; probe++) {
+      const Entry *entry =
+          mSlots[(hash + probe) % SLOT_COUNT].load(std::memory_order_acquire);
+      if (!entry) {
+        break;
+      }
+      if (entry->mName == name) {
+        return entry;
+      }
+    }
+
+    std::lock_guard lock(mMutex);
+    auto [found, isNew] = mEntries.try_emplace(std::string(name));
+    if (!isNew) {
+      return found->second.get();
+    }
+    std::unique_ptr<DateTimePatternGenerator> generator(
+        DateTimePatternGenerator::createInstance(aLocale, aStatus));
+    if (U_FAILURE(aStatus)) {
+      mEntries.erase(found);
+      return nullptr;
+    }
+    found->second.reset(new Entry{found->first, std::move(generator)});
+    for (size_t probe = 0; probe < SLOT_COUNT; probe++) {
+      std::atomic<const Entry *> &slot = mSlots[(hash + probe) % SLOT_COUNT];
+      if (!slot.load(std::memory_order_relaxed)) {
+        slot.store(found->second.get(), std::memory_order_release);
+        break;
+      }
+    }
+    return found->second.get();
+  }
+
+  std::atomic<const Entry *> mSlots[SLOT_COUNT] = {};
+  // Owns the entries, and is only used when a locale isn't in the table yet.
+  std::mutex mMutex;
+  std::unordered_map<std::string, std::unique_ptr<Entry>> mEntries;
+};
+
+/**
+ * A cache of date formatters, keyed by the locale, the skeleton, and the time
+ * zone. Building the pattern for a skeleton and then constructing a
+ * SimpleDateFormat for it is much slower than formatting a date, so this only
+ * does that once for every key.
+ *
+ * The cache can be used from any number of threads. The keys are spread over
+ * shards, each with its own lock and its own least recently used list, so threads
+ * looking up different keys rarely wait on each other. ICU formatters can't be
+ * used by two threads at once, so the cached formatter is only ever cloned, and
+ * each thread formats with its own clone, which is kept with the cached formatter.
+ */
+class DateFormatCache {
+public:
+  explicit DateFormatCache(size_t aCapacity = 256)
+      : mShardCapacity(std::max<size_t>(1, aCapacity / SHARD_COUNT)) {}
+
+  DateFormatCache(const DateFormatCache &) = delete;
+  DateFormatCache &operator=(const DateFormatCache &) = delete;
+
+  // The pattern that the skeleton resolves to for the locale.
+  UnicodeString GetBestPattern(const Locale &aLocale, const UnicodeString &aSkeleton,
+                               UErrorCode &aStatus) {
+    std::shared_ptr<const Entry> entry = Lookup(aLocale, aSkeleton, {}, aStatus);
+    return entry ? entry->mPattern : UnicodeString();
+  }
+
+  // Format the date with the skeleton in the time zone, or the default time zone
+  // when it's empty, and append it to aAppendTo.
+  UnicodeString &Format(const Locale &aLocale, const UnicodeString &aSkeleton,
+                        const UnicodeString &aTimeZone, UDate aDate,
+                        UnicodeString &aAppendTo, UErrorCode &aStatus) {
+    std::shared_ptr<const Entry> entry = Lookup(aLocale, aSkeleton, aTimeZone, aStatus);
+    if (!entry) {
+      return aAppendTo;
+    }
+    return ThreadFormatter(*entry).format(aDate, aAppendTo, nullptr, aStatus);
+  }
+
+  UnicodeString &Format(const Locale &aLocale, const UnicodeString &aSkeleton,
+                        UDate aDate, UnicodeString &aAppendTo, UErrorCode &aStatus) {
+    return Format(aLocale, aSkeleton, {}, aDate, aAppendTo, aStatus);
+  }
+
+  // The number of formatters in the cache.
+  size_t Size() {
+    size_t size = 0;
+    for (Shard &shard : mShards) {
+      std::lock_guard lock(shard.mMutex);
+      size += shard.mMap.size();
+    }
+    return size;
+  }
+
+  // How many lookups had to build a formatter.
+  size_t MissCount() const { return mMisses.load(std::memory_order_relaxed); }
+
+  // The cache that is shared by the whole program.
+  static DateFormatCache &Shared() {
+    static DateFormatCache sCache;
+    return sCache;
+  }
+
+private:
+  static constexpr size_t SHARD_COUNT = 16;
+
+  struct Entry {
+    UnicodeString mPattern;
+    // Never formatted with, only cloned.
+    std::unique_ptr<SimpleDateFormat> mPrototype;
+    // The clones are kept with the entry, so they go away once it's evicted and
+    // the last thread formatting with it is done.
+    mutable parallel::PerThread<SimpleDateFormat> mClones;
+  };
+
+  struct Shard {
+    std::mutex mMutex;
+    // The most recently used entries are at the front.
+    std::list<std::pair<std::string, std::shared_ptr<const Entry>>> mLru;
+    std::unordered_map<std::string, decltype(mLru)::iterator> mMap;
+  };
+
+  static std::string MakeKey(const Locale &aLocale, const UnicodeString &aSkeleton,
+                             const UnicodeString &aTimeZone) {
+    // The parts are separated by a character that can't be in a locale's name.
+    std::string key = aLocale.getName();
+    key += '\n';
+    aSkeleton.toUTF8String(key);
+    key += '\n';
+    aTimeZone.toUTF8String(key);
+    return key;
+  }
+
+  std::shared_ptr<const Entry> Lookup(const Locale &aLocale,
+                                      const UnicodeString &aSkeleton,
+                                      const UnicodeString &aTimeZone,
+                                      UErrorCode &aStatus) {
+    if (U_FAILURE(aStatus)) {
+      return nullptr;
+    }
+    std::string key = MakeKey(aLocale, aSkeleton, aTimeZone);
+    Shard &shard = mShards[std::hash<std::string>{}(key) % SHARD_COUNT];
+    {
+      std::lock_guard lock(shard.mMutex);
+      auto found = shard.mMap.find(key);
+      if (found != shard.mMap.end()) {
+        shard.mLru.splice(shard.mLru.begin(), shard.mLru, found->second);
+        return found->second->second;
+      }
+    }
+
+    // Build the entry outside of the lock, as it's slow. Two threads can race to
+    // build the same entry, in which case the first one to finish wins.
+    mMisses.fetch_add(1, std::memory_order_relaxed);
+    std::shared_ptr<const Entry> entry = Build(aLocale, aSkeleton, aTimeZone, aStatus);
+    if (!entry) {
+      return nullptr;
+    }
+    std::lock_guard lock(shard.mMutex);
+    auto [found, isNew] = shard.mMap.try_emplace(key);
+    if (!isNew) {
+      shard.mLru.splice(shard.mLru.begin(), shard.mLru, found->second);
+      return found->second->second;
+    }
+    shard.mLru.emplace_front(key, entry);
+    found->second = shard.mLru.begin();
+    if (shard.mLru.size() > mShardCapacity) {
+      shard.mMap.erase(shard.mLru.back().first);
+      shard.mLru.pop_back();
+    }
+    return entry;
+  }
+
+  std::shared_ptr<const Entry> Build(const Locale &aLocale,
+                                     const UnicodeString &aSkeleton,
+                                     const UnicodeString &aTimeZone,
+                                     UErrorCode &aStatus) {
+    auto entry = std::make_shared<Entry>();
+    DateTimePatternGenerator *generator =
+        PatternGeneratorRegistry::Shared().ThreadGenerator(aLocale, aStatus);
+    if (!generator) {
+      return nullptr;
+    }
+    entry->mPattern = generator->getBestPattern(aSkeleton, aStatus);
+    entry->mPrototype =
+        std::make_unique<SimpleDateFormat>(entry->mPattern, aLocale, aStatus);
+    if (U_FAILURE(aStatus)) {
+      return nullptr;
+    }
+    if (!aTimeZone.isEmpty()) {
+      entry->mPrototype->adoptTimeZone(TimeZone::createTimeZone(aTimeZone));
+    }
+    return entry;
+  }
+
+  // This thread's clone of the entry's formatter.
+  static SimpleDateFormat &ThreadFormatter(const Entry &aEntry) {
+    if (SimpleDateFormat *clone = aEntry.mClones.Get()) {
+      return *clone;
+    }
+    return *aEntry.mClones.Set(
+        std::unique_ptr<SimpleDateFormat>(aEntry.mPrototype->clone()));
+  }
+
+  const size_t mShardCapacity;
+  Shard mShards[SHARD_COUNT];
+  std::atomic<size_t> mMisses{0};
+};
+
+/**
+ * The offset of a time zone, which is cached until the date crosses one of the
+ * zone's transitions, as looking it up each time is a search of the transitions.
+ */
+class TimeZoneOffsetCache {
+public:
+  void SetTimeZone(const TimeZone &aTimeZone) {
+    mTimeZone = &aTimeZone;
+    mBasicTimeZone = dynamic_cast<const BasicTimeZone *>(mTimeZone);
+    mStart = mEnd = 0;
+  }
+
+  void Update(UDate aDate, UErrorCode &aStatus) {
+    if (aDate >= mStart && aDate < mEnd) {
+      return;
+    }
+    mTimeZone->getOffset(aDate, false, mRawOffset, mDstOffset, aStatus);
+    mStart = mEnd = aDate;
+    ::icu::TimeZoneTransition transition;
+    if (mBasicTimeZone) {
+      mStart = mBasicTimeZone->getPreviousTransition(aDate, true, transition)
+                   ? transition.getTime()
+                   : -INFINITY;
+      mEnd = mBasicTimeZone->getNextTransition(aDate, false, transition)
+                 ? transition.getTime()
+                 : INFINITY;
+    }
+  }
+
+  int32_t RawOffset() const { return mRawOffset; }
+  int32_t DstOffset() const { return mDstOffset; }
+  // The milliseconds to add to UTC to get the local time.
+  int32_t Offset() const { return mRawOffset + mDstOffset; }
+
+private:
+  const TimeZone *mTimeZone = nullptr;
+  const BasicTimeZone *mBasicTimeZone = nullptr;
+  // The offsets are the same from mStart until mEnd.
+  double mStart = 0;
+  double mEnd = 0;
+  int32_t mRawOffset = 0;
+  int32_t mDstOffset = 0;
+};
+
+/**
+ * The UTF-8 text of a batch of formatted dates, which is all stored in one buffer.
+ * Date i is the text from mOffsets[i] to mOffsets[i + 1].
+ */
+struct FormattedDates {
+  std::string mText;
+  std::vector<size_t> mOffsets;
+
+  size_t Length() const { return mOffsets.empty() ? 0 : mOffsets.size() - 1; }
+
+  std::string_view operator[](size_t aIndex) const {
+    return std::string_view(mText).substr(mOffsets[aIndex],
+                                          mOffsets[aIndex + 1] - mOffsets[aIndex]);
+  }
+};
+
+/**
+ * Format many dates with the same pattern. Formatting a date with ICU computes the
+ * calendar fields from scratch, even though dates that come from logs are mostly
+ * in order, and so share the same day. This only asks ICU to format the first date
+ * of each day, and turns the result into a template, where the time of day fields
+ * are slots. The other dates on that day fill in the slots with the hours,
+ * minutes, and seconds that are computed from the milliseconds into the day.
+ *
+ * The template is checked against ICU's own digits when it's made. Patterns with
+ * time of day fields that aren't digits, other than AM and PM, are formatted by
+ * ICU for every date, as are locales that don't use ASCII digits.
+ */
+class BatchDateFormatter {
+public:
+  BatchDateFormatter(const UnicodeString &aPattern, const Locale &aLocale,
+                     UErrorCode &aStatus, const UnicodeString &aTimeZone = {})
+      : mFormatter(aPattern, aLocale, aStatus) {
+    if (U_FAILURE(aStatus)) {
+      return;
+    }
+    if (!aTimeZone.isEmpty()) {
+      mFormatter.adoptTimeZone(TimeZone::createTimeZone(aTimeZone));
+    }
+    mOffset.SetTimeZone(mFormatter.getTimeZone());
+    CompilePattern(aPattern);
+  }
+
+  // Format the dates, replacing the contents of aOut.
+  void Format(mozilla::Span<const UDate> aDates, FormattedDates &aOut,
+              UErrorCode &aStatus) {
+    aOut.mText.clear();
+    aOut.mOffsets.clear();
+    aOut.mOffsets.reserve(aDates.Length() + 1);
+    aOut.mOffsets.push_back(0);
+    for (UDate date : aDates) {
+      if (!mUsesTemplates || !FormatFromTemplate(date, aOut.mText, aStatus)) {
+        mScratch.remove();
+        mFormatter.format(date, mScratch, aStatus);
+        appendUtf8(mScratch, aOut.mText);
+      }
+      if (U_FAILURE(aStatus)) {
+        return;
+      }
+      aOut.mOffsets.push_back(aOut.mText.size());
+    }
+  }
+
+  // Whether the dates are filled into templates, or all formatted by ICU.
+  bool UsesTemplates() const { return mUsesTemplates; }
+
+  // How many dates ICU had to format to make the templates.
+  size_t TemplateCount() const { return mTemplateCount; }
+
+private:
+  static constexpr int64_t MS_PER_DAY = 24 * 60 * 60 * 1000;
+
+  struct TimeField {
+    char16_t mSymbol;
+    int32_t mCount;
+  };
+
+  struct Slot {
+    // Where the text before the slot ends in the template's literal text.
+    size_t mLiteralEnd;
+    TimeField mField;
+  };
+
+  // Find the time of day fields, in the order that they are formatted.
+  void CompilePattern(const UnicodeString &aPattern) {
+    bool inQuote = false;
+    for (int32_t i = 0; i < aPattern.length();) {
+      char16_t ch = aPattern[i];
+      if (ch == u'\'') {
+        inQuote = !inQuote;
+        i++;
+        continue;
+      }
+      bool isLetter = (ch >= u'a' && ch <= u'z') || (ch >= u'A' && ch <= u'Z');
+      if (inQuote || !isLetter) {
+        i++;
+        continue;
+      }
+      int32_t count = 1;
+      while (i + count < aPattern.length() && aPattern[i + count] == ch) {
+        count++;
+      }
+      i += count;
+      switch (ch) {
+      case u'H':
+      case u'k':
+      case u'K':
+      case u'h':
+      case u'm':
+      case u's':
+      case u'S':
+        mTimeFields.push_back({ch, count});
+        break;
+      case u'a':
+        mHasHalfDay = true;
+        break;
+      case u'A':
+      case u'b':
+      case u'B':
+        mUsesTemplates = false;
+        break;
+      }
+    }
+  }
+
+  static void WriteNumber(std::string &aOut, int32_t aValue, int32_t aMinDigits) {
+    char digits[12];
+    int32_t length = 0;
+    do {
+      digits[length++] = char('0' + aValue % 10);
+      aValue /= 10;
+    } while (aValue > 0);
+    for (int32_t i = length; i < aMinDigits; i++) {
+      aOut += '0';
+    }
+    while (length > 0) {
+      aOut += digits[--length];
+    }
+  }
+
+  static void WriteField(std::string &aOut, TimeField aField, int64_t aMsInDay) {
+    int32_t hour = int32_t(aMsInDay / 3600000);
+    switch (aField.mSymbol) {
+    case u'H':
+      return WriteNumber(aOut, hour, aField.mCount);
+    case u'k':
+      return WriteNumber(aOut, hour == 0 ? 24 : hour, aField.mCount);
+    case u'K':
+      return WriteNumber(aOut, hour % 12, aField.mCount);
+    case u'h':
+      return WriteNumber(aOut, hour % 12 == 0 ? 12 : hour % 12, aField.mCount);
+    case u'm':
+      return WriteNumber(aOut, int32_t(aMsInDay / 60000 % 60), aField.mCount);
+    case u's':
+      return WriteNumber(aOut, int32_t(aMsInDay / 1000 % 60), aField.mCount);
+    case u'S': {
+      // The fraction is truncated, and any digits past the milliseconds are zero.
+      int32_t millis = int32_t(aMsInDay % 1000);
+      if (aField.mCount < 3) {
+        return WriteNumber(aOut, millis / (aField.mCount == 1 ? 100 : 10), aField.mCount);
+      }
+      WriteNumber(aOut, millis, 3);
+      aOut.append(aField.mCount - 3, '0');
+      return;
+    }
+    }
+  }
+
+  static char16_t SymbolForField(int32_t aField) {
+    switch (aField) {
+    case UDAT_HOUR_OF_DAY0_FIELD:
+      return u'H';
+    case UDAT_HOUR_OF_DAY1_FIELD:
+      return u'k';
+    case UDAT_HOUR0_FIELD:
+      return u'K';
+    case UDAT_HOUR1_FIELD:
+      return u'h';
+    case UDAT_MINUTE_FIELD:
+      return u'm';
+    case UDAT_SECOND_FIELD:
+      return u's';
+    case UDAT_FRACTIONAL_SECOND_FIELD:
+      return u'S';
+    }
+    return 0;
+  }
+
+  // Returns false when the date has to be formatted by ICU instead.
+  bool FormatFromTemplate(UDate aDate, std::string &aOut, UErrorCode &aStatus) {
+    double millis = std::floor(aDate);
+    if (!(std::abs(millis) < 1e15)) {
+      return false;
+    }
+    mOffset.Update(millis, aStatus);
+    if (U_FAILURE(aStatus)) {
+      return false;
+    }
+    int64_t local = int64_t(millis) + mOffset.Offset();
+    int64_t day = local / MS_PER_DAY - (local % MS_PER_DAY < 0 ? 1 : 0);
+    int64_t msInDay = local - day * MS_PER_DAY;
+    bool isPm = mHasHalfDay && msInDay >= MS_PER_DAY / 2;
+    if (!mHasTemplate || day != mDay || isPm != mIsPm ||
+        mOffset.RawOffset() != mTemplateRawOffset ||
+        mOffset.DstOffset() != mTemplateDstOffset) {
+      if (!BuildTemplate(aDate, msInDay, aStatus)) {
+        return false;
+      }
+      mDay = day;
+      mIsPm = isPm;
+      mTemplateRawOffset = mOffset.RawOffset();
+      mTemplateDstOffset = mOffset.DstOffset();
+    }
+
+    size_t literalStart = 0;
+    for (const Slot &slot : mSlots) {
+      aOut.append(mLiterals, literalStart, slot.mLiteralEnd - literalStart);
+      WriteField(aOut, slot.mField, msInDay);
+      literalStart = slot.mLiteralEnd;
+    }
+    aOut.append(mLiterals, literalStart);
+    return true;
+  }
+
+  bool BuildTemplate(UDate aDate, int64_t aMsInDay, UErrorCode &aStatus) {
+    mTemplateCount++;
+    mHasTemplate = false;
+    mLiterals.clear();
+    mSlots.clear();
+    mScratch.remove();
+    ::icu::FieldPositionIterator positions;
+    mFormatter.format(aDate, mScratch, &positions, aStatus);
+    if (U_FAILURE(aStatus)) {
+      return false;
+    }
+
+    ::icu::FieldPosition position;
+    int32_t literalStart = 0;
+    std::string expected;
+    std::string actual;
+    while (positions.next(position)) {
+      char16_t symbol = SymbolForField(position.getField());
+      if (!symbol) {
+        continue;
+      }
+      if (mSlots.size() == mTimeFields.size() ||
+          mTimeFields[mSlots.size()].mSymbol != symbol) {
+        mUsesTemplates = false;
+        return false;
+      }
+      TimeField field = mTimeFields[mSlots.size()];
+      mScratch.tempSubStringBetween(literalStart, position.getBeginIndex())
+          .toUTF8String(mLiterals);
+      mSlots.push_back({mLiterals.size(), field});
+      literalStart = position.getEndIndex();
+
+      // Only keep using templates if ICU wrote the same digits.
+      expected.clear();
+      actual.clear();
+      WriteField(expected, field, aMsInDay);
+      mScratch.tempSubStringBetween(position.getBeginIndex(), position.getEndIndex())
+          .toUTF8String(actual);
+      if (expected != actual) {
+        mUsesTemplates = false;
+        return false;
+      }
+    }
+    if (mSlots.size() != mTimeFields.size()) {
+      mUsesTemplates = false;
+      return false;
+    }
+    mScratch.tempSubString(literalStart).toUTF8String(mLiterals);
+    mHasTemplate = true;
+    return true;
+  }
+
+  SimpleDateFormat mFormatter;
+  TimeZoneOffsetCache mOffset;
+  UnicodeString mScratch;
+
+  std::vector<TimeField> mTimeFields;
+  bool mHasHalfDay = false;
+  bool mUsesTemplates = true;
+
+  // The template for the day that was formatted last.
+  bool mHasTemplate = false;
+  int64_t mDay = 0;
+  bool mIsPm = false;
+  int32_t mTemplateRawOffset = 0;
+  int32_t mTemplateDstOffset = 0;
+  std::string mLiterals;
+  std::vector<Slot> mSlots;
+  size_t mTemplateCount = 0;
+};
+
+// Format the dates with the pattern, into one UTF-8 buffer.
+FormattedDates formatBatch(mozilla::Span<const UDate> aDates,
+                           const UnicodeString &aPattern, const Locale &aLocale,
+                           UErrorCode &aStatus) {
+  FormattedDates formatted;
+  BatchDateFormatter formatter(aPattern, aLocale, aStatus);
+  if (U_SUCCESS(aStatus)) {
+    formatter.Format(aDates, formatted, aStatus);
+  }
+  return formatted;
+}
+
+/**
+ * A formatter for patterns that are only made of numeric fields and literal text,
+ * like "HH:mm:ss", "M/d/y" or "mm:ss.SSS". Once the locale is known to use the
+ * Gregorian calendar and ASCII digits, those don't depend on any locale data, so
+ * the pattern is compiled into a list of fields that are written straight into
+ * the output, with the date computed from the days since the epoch, and the
+ * digits written two at a time. Every other pattern, and dates before the switch
+ * from the Julian calendar, are formatted by ICU.
+ */
+class NumericDateFormatter {
+public:
+  NumericDateFormatter(const UnicodeString &aPattern, const Locale &aLocale,
+                       UErrorCode &aStatus, const UnicodeString &aTimeZone = {})
+      : mFormatter(aPattern, aLocale, aStatus) {
+    if (U_FAILURE(aStatus)) {
+      return;
+    }
+    if (!aTimeZone.isEmpty()) {
+      mFormatter.adoptTimeZone(TimeZone::createTimeZone(aTimeZone));
+    }
+    mOffset.SetTimeZone(mFormatter.getTimeZone());
+    mIsCompiled = UsesAsciiDigits(aLocale) &&
+                  strcmp(mFormatter.getCalendar()->getType(), "gregorian") == 0 &&
+                  Compile(aPattern) && MatchesIcu();
+  }
+
+  // Format the date, and append it to aAppendTo.
+  std::string &Format(UDate aDate, std::string &aAppendTo, UErrorCode &aStatus) {
+    if (U_FAILURE(aStatus)) {
+      return aAppendTo;
+    }
+    double millis = std::floor(aDate);
+    if (mIsCompiled && millis >= GREGORIAN_START && millis < 1e15) {
+      mOffset.Update(millis, aStatus);
+      size_t start = aAppendTo.size();
+      aAppendTo.resize(start + mMaxLength);
+      char *end = Write(aAppendTo.data() + start, int64_t(millis) + mOffset.Offset());
+      aAppendTo.resize(end - aAppendTo.data());
+      return aAppendTo;
+    }
+    mScratch.remove();
+    mFormatter.format(aDate, mScratch, aStatus);
+    appendUtf8(mScratch, aAppendTo);
+    return aAppendTo;
+  }
+
+  // Whether the pattern was compiled, rather than formatted by ICU.
+  bool IsCompiled() const { return mIsCompiled; }
+
+private:
+  static constexpr int64_t MS_PER_DAY = 24 * 60 * 60 * 1000;
+  // The first day of the Gregorian calendar, October 15, 1582, plus a day so that
+  // no time zone puts it before the switch.
+  static constexpr double GREGORIAN_START = -12219292800000.0 + MS_PER_DAY;
+  // Enough for any field of a date before 1e15.
+  static constexpr size_t MAX_FIELD_LENGTH = 10;
+
+  static constexpr char DIGIT_PAIRS[] = "0001020304050607080910111213141516171819"
+                                        "2021222324252627282930313233343536373839"
+                                        "4041424344454647484950515253545556575859"
+                                        "6061626364656667686970717273747576777879"
+                                        "8081828384858687888990919293949596979899";
+
+  struct Field {
+    // The pattern letter, or 0 for literal text.
+    char16_t mSymbol;
+    int32_t mCount;
+    // The literal text in mLiterals.
+    size_t mLiteralStart;
+    size_t mLiteralLength;
+  };
+
+  static bool UsesAsciiDigits(const Locale &aLocale) {
+    UErrorCode status = U_ZERO_ERROR;
+    std::unique_ptr<::icu::NumberingSystem> numbers(
+        ::icu::NumberingSystem::createInstance(aLocale, status));
+    return U_SUCCESS(status) && numbers->getRadix() == 10 && !numbers->isAlgorithmic() &&
+           numbers->getDescription() == UnicodeString(u"0123456789");
+  }
+
+  void AddLiteral(const UnicodeString &aText) {
+    size_t start = mLiterals.size();
+    aText.toUTF8String(mLiterals);
+    mFields.push_back({0, 0, start, mLiterals.size() - start});
+    mMaxLength += mLiterals.size() - start;
+  }
+
+  bool Compile(const UnicodeString &aPattern) {
+    bool inQuote = false;
+    for (int32_t i = 0; i < aPattern.length();) {
+      char16_t ch = aPattern[i];
+      if (ch == u'\'') {
+        if (i + 1 < aPattern.length() && aPattern[i + 1] == u'\'') {
+          // Two quotes are a literal quote, both inside and outside of quotes.
+          AddLiteral(u"'");
+          i += 2;
+        } else {
+          inQuote = !inQuote;
+          i++;
+        }
+        continue;
+      }
+      bool isLetter = (ch >= u'a' && ch <= u'z') || (ch >= u'A' && ch <= u'Z');
+      if (inQuote || !isLetter) {
+        int32_t end = i + 1;
+        while (end < aPattern.length() && aPattern[end] != u'\'' &&
+               (inQuote || !((aPattern[end] >= u'a' && aPattern[end] <= u'z') ||
+                             (aPattern[end] >= u'A' && aPattern[end] <= u'Z')))) {
+          end++;
+        }
+        AddLiteral(aPattern.tempSubStringBetween(i, end));
+        i = end;
+        continue;
+      }
+      int32_t count = 1;
+      while (i + count < aPattern.length() && aPattern[i + count] == ch) {
+        count++;
+      }
+      i += count;
+      switch (ch) {
+      case u'M':
+      case u'L':
+        if (count > 2) {
+          // Months are names from three letters on.
+          return false;
+        }
+        break;
+      case u'y':
+      case u'd':
+      case u'H':
+      case u'k':
+      case u'K':
+      case u'h':
+      case u'm':
+      case u's':
+      case u'S':
+        break;
+      default:
+        return false;
+      }
+      if (count > int32_t(MAX_FIELD_LENGTH)) {
+        return false;
+      }
+      mFields.push_back({ch, count, 0, 0});
+      mMaxLength += MAX_FIELD_LENGTH;
+    }
+    return true;
+  }
+
+  // Check the compiled pattern against ICU, so it never formats differently.
+  bool MatchesIcu() {
+    const UDate dates[] = {0.0, 1583884800123.0, 1600000000000.0, 2e11, 9e12, -1e12};
+    for (UDate date : dates) {
+      UErrorCode status = U_ZERO_ERROR;
+      UnicodeString expected;
+      mFormatter.format(date, expected, status);
+      mOffset.Update(date, status);
+      std::string actual(mMaxLength, '\0');
+      char *end = Write(actual.data(), int64_t(date) + mOffset.Offset());
+      actual.resize(end - actual.data());
+      if (U_FAILURE(status) || actual != toString(expected)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  static char *WriteNumber(char *aCursor, uint32_t aValue, int32_t aMinDigits) {
+    int32_t digits = 1;
+    for (uint32_t rest = aValue; rest >= 10; rest /= 10) {
+      digits++;
+    }
+    digits = std::max(digits, aMinDigits);
+    char *end = aCursor + digits;
+    char *cursor = end;
+    while (aValue >= 10) {
+      cursor -= 2;
+      memcpy(cursor, &DIGIT_PAIRS[(aValue % 100) * 2], 2);
+      aValue /= 100;
+    }
+    if (cursor > aCursor && (aValue > 0 || cursor == end)) {
+      *--cursor = char('0' + aValue);
+    }
+    while (cursor > aCursor) {
+      *--cursor = '0';
+    }
+    return end;
+  }
+
+  // Write the date, given the milliseconds since the epoch in local time.
+  char *Write(char *aCursor, int64_t aLocal) const {
+    int64_t days = aLocal / MS_PER_DAY - (aLocal % MS_PER_DAY < 0 ? 1 : 0);
+    int64_t msInDay = aLocal - days * MS_PER_DAY;
+
+    // The Gregorian date from the days, from Howard Hinnant's civil_from_days.
+    int64_t shifted = days + 719468;
+    int64_t era = (shifted >= 0 ? shifted : shifted - 146096) / 146097;
+    int64_t dayOfEra = shifted - era * 146097;
+    int64_t yearOfEra =
+        (dayOfEra - dayOfEra / 1460 + dayOfEra / 36524 - dayOfEra / 146096) / 365;
+    int64_t dayOfYear = dayOfEra - (365 * yearOfEra + yearOfEra / 4 - yearOfEra / 100);
+    int64_t marchMonth = (5 * dayOfYear + 2) / 153;
+    uint32_t day = uint32_t(dayOfYear - (153 * marchMonth + 2) / 5 + 1);
+    uint32_t month = uint32_t(marchMonth < 10 ? marchMonth + 3 : marchMonth - 9);
+    uint32_t year = uint32_t(yearOfEra + era * 400 + (month <= 2 ? 1 : 0));
+
+    uint32_t hour = uint32_t(msInDay / 3600000);
+    for (const Field &field : mFields) {
+      switch (field.mSymbol) {
+      case 0:
+        memcpy(aCursor, mLiterals.data() + field.mLiteralStart, field.mLiteralLength);
+        aCursor += field.mLiteralLength;
+        break;
+      case u'y':
+        // Two letters are the last two digits of the year.
+        aCursor = field.mCount == 2 ? WriteNumber(aCursor, year % 100, 2)
+                                    : WriteNumber(aCursor, year, field.mCount);
+        break;
+      case u'M':
+      case u'L':
+        aCursor = WriteNumber(aCursor, month, field.mCount);
+        break;
+      case u'd':
+        aCursor = WriteNumber(aCursor, day, field.mCount);
+        break;
+      case u'H':
+        aCursor = WriteNumber(aCursor, hour, field.mCount);
+        break;
+      case u'k':
+        aCursor = WriteNumber(aCursor, hour == 0 ? 24 : hour, field.mCount);
+        break;
+      case u'K':
+        aCursor = WriteNumber(aCursor, hour % 12, field.mCount);
+        break;
+      case u'h':
+        aCursor = WriteNumber(aCursor, hour % 12 == 0 ? 12 : hour % 12, field.mCount);
+        break;
+      case u'm':
+        aCursor = WriteNumber(aCursor, uint32_t(msInDay / 60000 % 60), field.mCount);
+        break;
+      case u's':
+        aCursor = WriteNumber(aCursor, uint32_t(msInDay / 1000 % 60), field.mCount);
+        break;
+      case u'S': {
+        // The fraction is truncated, and any digits past the milliseconds are zero.
+        uint32_t millis = uint32_t(msInDay % 1000);
+        if (field.mCount < 3) {
+          aCursor = WriteNumber(aCursor, millis / (field.mCount == 1 ? 100 : 10),
+                                field.mCount);
+        } else {
+          aCursor = WriteNumber(aCursor, millis, 3);
+          memset(aCursor, '0', field.mCount - 3);
+          aCursor += field.mCount - 3;
+        }
+        break;
+      }
+      }
+    }
+    return aCursor;
+  }
+
+  SimpleDateFormat mFormatter;
+  TimeZoneOffsetCache mOffset;
+  UnicodeString mScratch;
+  bool mIsCompiled = false;
+  std::vector<Field> mFields;
+  std::string mLiterals;
+  // The most bytes that a compiled date can take.
+  size_t mMaxLength = 0;
+};
+
+/**
+ * A number formatter from a NumberFormatterCache. It can be used by any number of
+ * threads, as both of the ICU formatters in it are immutable.
+ */
+class CachedNumberFormatter {
+public:
+  CachedNumberFormatter(const Locale &aLocale, const UnicodeString &aSkeleton,
+                        UErrorCode &aStatus)
+      : mFormatter(NumberFormatter::forSkeleton(aSkeleton, aStatus).locale(aLocale)),
+        mCFormatter(unumf_openForSkeletonAndLocale(aSkeleton.getBuffer(),
+                                                   aSkeleton.length(),
+                                                   aLocale.getName(), &aStatus)) {}
+
+  const LocalizedNumberFormatter &Formatter() const { return mFormatter; }
+
+  /**
+   * Format the number as UTF-8 into the buffer, and return its length. When the
+   * buffer is too small, this sets U_BUFFER_OVERFLOW_ERROR and returns the length
+   * that is needed, like the ICU C API does. The result is not null terminated.
+   *
+   * Nothing is allocated here once the thread has formatted a number. Each thread
+   * keeps the result that ICU formats into, and reuses it for every number, and
+   * the UTF-16 text is copied into a buffer on the stack. ICU 72 itself still
+   * makes one small allocation while formatting each number.
+   */
+  int32_t FormatDouble(double aValue, mozilla::Span<char> aBuffer,
+                       UErrorCode &aStatus) const {
+    UFormattedNumber *result = ThreadResult(aStatus);
+    if (!result) {
+      return 0;
+    }
+    unumf_formatDouble(mCFormatter.getAlias(), aValue, result, &aStatus);
+    return ResultToUtf8(result, aBuffer, aStatus);
+  }
+
+  int32_t FormatInt64(int64_t aValue, mozilla::Span<char> aBuffer,
+                      UErrorCode &aStatus) const {
+    UFormattedNumber *result = ThreadResult(aStatus);
+    if (!result) {
+      return 0;
+    }
+    unumf_formatInt(mCFormatter.getAlias(), aValue, result, &aStatus);
+    return ResultToUtf8(result, aBuffer, aStatus);
+  }
+
+private:
+  // The longest formatted number that is copied on the stack. Anything longer
+  // goes through a buffer that each thread keeps.
+  static constexpr int32_t STACK_LENGTH = 128;
+
+  // This thread's result, or null when aStatus has already failed or the result
+  // can't be created. A failure isn't kept, so the next call tries again.
+  static UFormattedNumber *ThreadResult(UErrorCode &aStatus) {
+    if (U_FAILURE(aStatus)) {
+      return nullptr;
+    }
+    thread_local ::icu::LocalUFormattedNumberPointer sResult;
+    if (sResult.isNull()) {
+      UErrorCode status = U_ZERO_ERROR;
+      ::icu::LocalUFormattedNumberPointer result(unumf_openResult(&status));
+      if (U_FAILURE(status) || result.isNull()) {
+        aStatus = U_FAILURE(status) ? status : U_MEMORY_ALLOCATION_ERROR;
+        return nullptr;
+      }
+      sResult.adoptInstead(result.orphan());
+    }
+    return sResult.getAlias();
+  }
+
+  static int32_t ResultToUtf8(const UFormattedNumber *aResult,
+                              mozilla::Span<char> aBuffer, UErrorCode &aStatus) {
+    if (U_FAILURE(aStatus)) {
+      return 0;
+    }
+    UChar stackText[STACK_LENGTH];
+    const UChar *text = stackText;
+    int32_t length = unumf_resultToString(aResult, stackText, STACK_LENGTH, &aStatus);
+    if (aStatus == U_BUFFER_OVERFLOW_ERROR) {
+      thread_local std::u16string sLongText;
+      sLongText.resize(length);
+      aStatus = U_ZERO_ERROR;
+      unumf_resultToString(aResult, sLongText.data(), length, &aStatus);
+      text = sLongText.data();
+    }
+    if (aStatus == U_STRING_NOT_TERMINATED_WARNING) {
+      aStatus = U_ZERO_ERROR;
+    }
+    int32_t utf8Length = 0;
+    u_strToUTF8(aBuffer.data(), int32_t(aBuffer.Length()), &utf8Length, text, length,
+                &aStatus);
+    if (aStatus == U_STRING_NOT_TERMINATED_WARNING) {
+      aStatus = U_ZERO_ERROR;
+    }
+    return utf8Length;
+  }
+
+  LocalizedNumberFormatter mFormatter;
+  ::icu::LocalUNumberFormatterPointer mCFormatter;
+};
+
+/**
+ * Number formatters that are fully configured from a skeleton, like
+ * "compact-short currency/USD .##", and kept for each locale and skeleton. The
+ * skeleton is parsed and the formatter built once, rather than chaining the
+ * settings on NumberFormatter::withLocale for every number.
+ *
+ * The formatters are never removed, so the pointers that are handed out stay
+ * valid for the life of the cache. Lookups share a read lock, and only building a
+ * formatter takes the write lock.
+ */
+class NumberFormatterCache {
+public:
+  NumberFormatterCache() = default;
+  NumberFormatterCache(const NumberFormatterCache &) = delete;
+  NumberFormatterCache &operator=(const NumberFormatterCache &) = delete;
+
+  const CachedNumberFormatter *Get(const Locale &aLocale, const UnicodeString &aSkeleton,
+                                   UErrorCode &aStatus) {
+    if (U_FAILURE(aStatus)) {
+      return nullptr;
+    }
+    std::string key = aLocale.getName();
+    key += '\n';
+    aSkeleton.toUTF8String(key);
+    {
+      std::shared_lock lock(mMutex);
+      auto found = mFormatters.find(key);
+      if (found != mFormatters.end()) {
+        return found->second.get();
+      }
+    }
+
+    auto formatter = std::make_unique<CachedNumberFormatter>(aLocale, aSkeleton, aStatus);
+    if (U_FAILURE(aStatus)) {
+      return nullptr;
+    }
+    std::unique_lock lock(mMutex);
+    auto [found, isNew] = mFormatters.try_emplace(std::move(key), std::move(formatter));
+    return found->second.get();
+  }
+
+  size_t Size() {
+    std::shared_lock lock(mMutex);
+    return mFormatters.size();
+  }
+
+  // The cache that is shared by the whole program.
+  static NumberFormatterCache &Shared() {
+    static NumberFormatterCache sCache;
+    return sCache;
+  }
+
+private:
+  std::shared_mutex mMutex;
+  std::unordered_map<std::string, std::unique_ptr<CachedNumberFormatter>> mFormatters;
+};
+
+/**
+ * Interns locale tags as canonical locales, so that each tag is only canonicalized
+ * once. Every distinct canonical locale gets a small integer id, counting up from
+ * 0, that other tables can index or hash on instead of hashing the locale's name.
+ * Tags that canonicalize the same way, like "en-US" and "EN_us", share an id.
+ *
+ * Looking up a tag that was seen before only takes a shared lock, so many threads
+ * can read at once. The tags and locales are kept for the life of the table.
+ */
+class LocaleTable {
+public:
+  using LocaleId = uint32_t;
+
+  LocaleTable() = default;
+  LocaleTable(const LocaleTable &) = delete;
+  LocaleTable &operator=(const LocaleTable &) = delete;
+
+  LocaleId Intern(std::string_view aTag, UErrorCode &aStatus) {
+    if (U_FAILURE(aStatus)) {
+      return 0;
+    }
+    {
+      std::shared_lock lock(mMutex);
+      if (auto found = mTags.lookup(aTag)) {
+        return found->value();
+      }
+    }
+
+    // Canonicalize outside of the lock, as it's by far the slowest part.
+    Locale locale = Locale::createCanonical(std::string(aTag).c_str());
+    if (locale.isBogus()) {
+      aStatus = U_ILLEGAL_ARGUMENT_ERROR;
+      return 0;
+    }
+    std::unique_lock lock(mMutex);
+    auto tag = mTags.lookupForAdd(aTag);
+    if (tag) {
+      // Another thread added the tag while this one was canonicalizing.
+      return tag->value();
+    }
+    auto boxed = std::make_unique<Locale>(std::move(locale));
+    std::string_view name = boxed->getName();
+    auto canonical = mCanonicalIds.lookupForAdd(name);
+    if (!canonical) {
+      // Only keep the locale once its id can be found, so that a failure leaves no
+      // id behind that nothing refers to.
+      auto id = LocaleId(mLocales.size());
+      if (!mCanonicalIds.add(canonical, std::string(name), id)) {
+        aStatus = U_MEMORY_ALLOCATION_ERROR;
+        return 0;
+      }
+      mLocales.push_back(std::move(boxed));
+    }
+    LocaleId id = canonical->value();
+    if (!mTags.add(tag, std::string(aTag), id)) {
+      aStatus = U_MEMORY_ALLOCATION_ERROR;
+      return 0;
+    }
+    return id;
+  }
+
+  // The canonical locale of an id that was returned by Intern.
+  const Locale &Get(LocaleId aId) {
+    std::shared_lock lock(mMutex);
+    return *mLocales[aId];
+  }
+
+  // How many distinct canonical locales there are.
+  size_t Size() {
+    std::shared_lock lock(mMutex);
+    return mLocales.size();
+  }
+
+  size_t TagCount() {
+    std::shared_lock lock(mMutex);
+    return mTags.count();
+  }
+
+  // The table that is shared by the whole program.
+  static LocaleTable &Shared() {
+    static LocaleTable sTable;
+    return sTable;
+  }
+
+private:
+  struct StringHasher {
+    using Key = std::string;
+    using Lookup = std::string_view;
+
+    static mozilla::HashNumber hash(const Lookup &aLookup) {
+      return mozilla::HashString(aLookup.data(), aLookup.size());
+    }
+    static bool match(const Key &aKey, const Lookup &aLookup) { return aKey == aLookup; }
+    static void rekey(Key &aKey, const Key &aNewKey) { aKey = aNewKey; }
+  };
+
+  std::shared_mutex mMutex;
+  // The raw tags, as they were passed in.
+  mozilla::HashMap<std::string, LocaleId, StringHasher> mTags;
+  // The full names of the canonical locales, keywords included.
+  mozilla::HashMap<std::string, LocaleId, StringHasher> mCanonicalIds;
+  // Indexed by id. The locales are boxed so that references to them stay valid.
+  std::vector<std::unique_ptr<Locale>> mLocales;
+};
+
+/**
+ * Formats the same dates and numbers into many locales at once, with a task for
+ * each locale on a thread pool. Every thread keeps its own warm clones of each
+ * locale's date and number formatters, so the ICU objects are never shared between
+ * threads and nothing is locked while formatting. The prototypes that are cloned
+ * are only read.
+ *
+ * Each locale writes its results into its own arena, which is reserved up front
+ * from the longest text seen so far, and reused by the next batch. The views that
+ * are returned stay valid until the next call to Format.
+ */
+class MultiLocaleFormatter {
+public:
+  MultiLocaleFormatter(mozilla::Span<const char *const> aLocales,
+                       const UnicodeString &aDateSkeleton,
+                       const UnicodeString &aNumberSkeleton, UErrorCode &aStatus)
+      : mLocales(aLocales.Length()) {
+    for (size_t i = 0; i < aLocales.Length() && U_SUCCESS(aStatus); i++) {
+      LocaleFormats &formats = mLocales[i];
+      formats.mLocale = Locale(aLocales[i]);
+      DateTimePatternGenerator *generator =
+          PatternGeneratorRegistry::Shared().ThreadGenerator(formats.mLocale, aStatus);
+      if (!generator) {
+        return;
+      }
+      UnicodeString pattern = generator->getBestPattern(aDateSkeleton, aStatus);
+      formats.mDatePrototype =
+          std::make_unique<SimpleDateFormat>(pattern, formats.mLocale, aStatus);
+      formats.mNumberPrototype =
+          NumberFormatter::forSkeleton(aNumberSkeleton, aStatus).locale(formats.mLocale);
+      if (U_FAILURE(aStatus)) {
+        return;
+      }
+
+      // Start with the lengths of a long date and number, so that the first batch
+      // is reserved for too.
+      UnicodeString sample;
+      formats.mDatePrototype->format(SAMPLE_DATE, sample, nullptr, aStatus);
+      formats.mLongestDate = sample.length();
+      formats.mLongestNumber =
+          formats.mNumberPrototype.formatDouble(-1234567.89, aStatus)
+              .toTempString(aStatus)
+              .length();
+    }
+  }
+
+  MultiLocaleFormatter(const MultiLocaleFormatter &) = delete;
+  MultiLocaleFormatter &operator=(const MultiLocaleFormatter &) = delete;
+
+  size_t LocaleCount() const { return mLocales.size(); }
+  const Locale &GetLocale(size_t aLocale) const { return mLocales[aLocale].mLocale; }
+
+  // The results of the last call to Format, in the order of the values.
+  mozilla::Span<const std::string_view> Dates(size_t aLocale) const {
+    return mLocales[aLocale].mDates;
+  }
+  mozilla::Span<const std::string_view> Numbers(size_t aLocale) const {
+    return mLocales[aLocale].mNumbers;
+  }
+
+  // How many blocks the arenas have allocated in total.
+  size_t ArenaBlockCount() const {
+    size_t count = 0;
+    for (const LocaleFormats &formats : mLocales) {
+      count += formats.mArena.BlockCount();
+    }
+    return count;
+  }
+
+  void Format(parallel::ThreadPool &aPool, mozilla::Span<const UDate> aDates,
+              mozilla::Span<const double> aNumbers, UErrorCode &aStatus) {
+    if (U_FAILURE(aStatus)) {
+      return;
+    }
+    std::atomic<UErrorCode> firstError{U_ZERO_ERROR};
+    auto task = [&](size_t aLocale) {
+      UErrorCode status = U_ZERO_ERROR;
+      FormatLocale(mLocales[aLocale], aDates, aNumbers, status);
+      if (U_FAILURE(status)) {
+        UErrorCode none = U_ZERO_ERROR;
+        firstError.compare_exchange_strong(none, status);
+      }
+    };
+    aPool.run(mLocales.size(), task);
+    aStatus = firstError.load();
+  }
+
+private:
+  // 2020-09-30 23:59, late in a long month.
+  static constexpr UDate SAMPLE_DATE = 1601510340000.0;
+
+  struct ThreadFormats {
+    std::unique_ptr<SimpleDateFormat> mDate;
+    LocalizedNumberFormatter mNumber;
+    UnicodeString mScratch;
+  };
+
+  struct LocaleFormats {
+    Locale mLocale;
+    std::unique_ptr<SimpleDateFormat> mDatePrototype;
+    LocalizedNumberFormatter mNumberPrototype;
+    // Only written by the task that formats this locale.
+    Utf8Arena mArena;
+    std::vector<std::string_view> mDates;
+    std::vector<std::string_view> mNumbers;
+    size_t mLongestDate = 0;
+    size_t mLongestNumber = 0;
+    // The clones for each thread that has formatted this locale, which are freed
+    // with the formatter.
+    parallel::PerThread<ThreadFormats> mClones;
+  };
+
+  // This thread's clones of a locale's formatters.
+  static ThreadFormats &ThreadClones(LocaleFormats &aFormats) {
+    if (ThreadFormats *clones = aFormats.mClones.Get()) {
+      return *clones;
+    }
+    auto clones = std::make_unique<ThreadFormats>();
+    clones->mDate.reset(aFormats.mDatePrototype->clone());
+    clones->mNumber = aFormats.mNumberPrototype;
+    return *aFormats.mClones.Set(std::move(clones));
+  }
+
+  static void FormatLocale(LocaleFormats &aFormats, mozilla::Span<const UDate> aDates,
+                           mozilla::Span<const double> aNumbers, UErrorCode &aStatus) {
+    ThreadFormats &clones = ThreadClones(aFormats);
+    aFormats.mArena.Clear();
+    aFormats.mDates.clear();
+    aFormats.mNumbers.clear();
+    // Reserve for the longest UTF-8 of the longest text from the last batch, so
+    // that a batch like the last one fits in a single block.
+    aFormats.mArena.Reserve(3 * (aDates.Length() * aFormats.mLongestDate +
+                                 aNumbers.Length() * aFormats.mLongestNumber));
+
+    for (UDate date : aDates) {
+      clones.mScratch.remove();
+      clones.mDate->format(date, clones.mScratch, nullptr, aStatus);
+      if (U_FAILURE(aStatus)) {
+        return;
+      }
+      aFormats.mLongestDate =
+          std::max(aFormats.mLongestDate, size_t(clones.mScratch.length()));
+      aFormats.mDates.push_back(aFormats.mArena.Append(clones.mScratch));
+    }
+    for (double number : aNumbers) {
+      auto formatted = clones.mNumber.formatDouble(number, aStatus);
+      UnicodeString text = formatted.toTempString(aStatus);
+      if (U_FAILURE(aStatus)) {
+        return;
+      }
+      aFormats.mLongestNumber = std::max(aFormats.mLongestNumber, size_t(text.length()));
+      aFormats.mNumbers.push_back(aFormats.mArena.Append(text));
+    }
+  }
+
+  // Sized once, as the clones can't be moved.
+  std::vector<LocaleFormats> mLocales;
+};
+
 std::string test_pattern(UnicodeString pattern) {
   Locale locale("en");
   UErrorCode status = U_ZERO_ERROR;
 
-  SimpleDateFormat *formatter = new SimpleDateFormat(pattern, locale, status);
+  SimpleDateFormat formatter(pattern, locale, status);
   GregorianCalendar calendar(2020, 0, 21, 14, 5, status);
 
   UnicodeString formatted;
-  formatter->format(calendar.getTime(status), formatted, status);
+  formatter.format(calendar.getTime(status), formatted, status);
   return toString(formatted);
 }
 
@@ -50,7 +1563,7 @@ public:
     if (U_FAILURE(status)) {
       test::ok(false, "Unable to create gregorian calendar");
     }
-    generator = DateTimePatternGenerator::createInstance(locale, status);
+    generator = PatternGeneratorRegistry::Shared().ThreadGenerator(locale, status);
 
     if (U_FAILURE(status)) {
       test::ok(false, "Unable to generate the DateTimePatternGenerator");
@@ -67,15 +1580,18 @@ public:
     return patternStr;
   }
 
+  // The formatters are reused from the shared cache, rather than constructing one
+  // every time.
   std::string Format(UnicodeString skeleton) {
     UErrorCode status = U_ZERO_ERROR;
-    UnicodeString pattern = generator->getBestPattern(skeleton, status);
-    SimpleDateFormat *formatter = new SimpleDateFormat(pattern, locale, status);
     UnicodeString formatted;
-    formatted = formatter->format(calendar.getTime(status), formatted, status);
+    DateFormatCache::Shared().Format(locale, skeleton, calendar.getTime(status),
+                                     formatted, status);
     return toString(formatted);
   }
 
+  // This thread's generator from the shared registry, which lives as long as the
+  // registry does.
   DateTimePatternGenerator *generator;
   Locale locale;
   GregorianCalendar calendar;
@@ -569,6 +2085,332 @@ void run_tests() {
                   "Removes the .utf8 ends");
     });
 
+    test::describe("interned canonical locales", []() {
+      UErrorCode status = U_ZERO_ERROR;
+      LocaleTable table;
+      const char *tags[] = {"en-US", "en-US-posix", "und", "asdf", "es-es",
+                            "👍", "en-USA", "fr-fr@EURO", "ar-MA.utf8",
+                            "ja-JP-u-ca-japanese"};
+      bool allEqual = true;
+      for (const char *tag : tags) {
+        LocaleTable::LocaleId id = table.Intern(tag, status);
+        allEqual &= std::string(table.Get(id).getName()) ==
+                    Locale::createCanonical(tag).getName();
+      }
+      test::ok(U_SUCCESS(status), "The tags can be interned");
+      test::ok(allEqual, "The interned locales match Locale::createCanonical");
+
+      LocaleTable::LocaleId enUS = table.Intern("en-US", status);
+      test::equal(table.Intern("en-US", status), enUS, "A tag keeps its id");
+      test::equal(table.Intern("en_us", status), enUS,
+                  "Tags with the same canonical locale share an id");
+      test::equal(table.Intern("en-USA", status), enUS, "Even when the region differs");
+      test::ok(table.Intern("es-ES", status) != enUS, "Other locales get other ids");
+      test::ok(table.Intern("ja-JP-u-ca-japanese", status) !=
+                   table.Intern("ja-JP", status),
+               "Keywords are part of the canonical locale");
+      test::equal(table.Size(), size_t(10), "Only canonical locales get ids");
+      test::equal(table.TagCount(), size_t(13), "But every tag is remembered");
+      bool compact = true;
+      for (LocaleTable::LocaleId id = 0; id < table.Size(); id++) {
+        compact &= !table.Get(id).isBogus();
+      }
+      test::ok(compact, "The ids count up from 0");
+
+      parallel::ThreadPool pool(4);
+      const char *racingTags[] = {"de-de", "DE_DE", "de-DE", "pt-br", "pt_BR", "hi-in"};
+      LocaleTable racing;
+      std::atomic<size_t> mismatches = 0;
+      auto internTask = [&](size_t aTask) {
+        UErrorCode status = U_ZERO_ERROR;
+        const char *tag = racingTags[aTask % std::size(racingTags)];
+        LocaleTable::LocaleId id = racing.Intern(tag, status);
+        if (U_FAILURE(status) || std::string(racing.Get(id).getName()) !=
+                                     Locale::createCanonical(tag).getName()) {
+          mismatches++;
+        }
+      };
+      pool.run(300, internTask);
+      test::equal(mismatches.load(), size_t(0), "Threads can intern tags at once");
+      test::equal(racing.Size(), size_t(3), "Racing threads share the canonical ids");
+      test::equal(racing.TagCount(), std::size(racingTags),
+                  "And add each tag only once");
+    });
+
+    test::describe("interned canonical locales benchmark", []() {
+      UErrorCode status = U_ZERO_ERROR;
+      const char *tags[] = {"en-US", "es-419", "ar-EG", "ja-JP", "hi-IN", "zh-Hant-TW"};
+      test::BenchmarkOptions options;
+      options.samples = 5;
+
+      auto canonicalize = test::benchmark(
+          "canonicalize every tag",
+          [&]() {
+            for (const char *tag : tags) {
+              Locale locale = Locale::createCanonical(tag);
+              test::DoNotOptimize(locale);
+            }
+          },
+          options);
+      LocaleTable table;
+      auto interned = test::benchmark(
+          "look up the interned tags",
+          [&]() {
+            for (const char *tag : tags) {
+              test::DoNotOptimize(table.Intern(tag, status));
+            }
+          },
+          options);
+      printf("      speedup %.2fx\n", canonicalize.median / interned.median);
+      test::ok(U_SUCCESS(status), "Interning succeeds");
+    });
+
+    test::describe("UTF-8 conversion", []() {
+      UnicodeString unpaired(u"a\xd800" u"b");
+      UnicodeString lonePair(u"\U0001F44D");
+      UnicodeString strings[] = {
+          u"",
+          u"11:33 AM",
+          u"Mittwoch, 14. April 2021 um 20:10:49 Koordinierte Weltzeit",
+          u"2021年4月14日水曜日 20時10分49秒 協定世界時",
+          unpaired,
+          UnicodeString(u"Ελληνικά 👍 ").append(UnicodeString(u"x")).append(lonePair),
+      };
+      // A long string, with surrogate pairs at every offset over the stack pieces.
+      UnicodeString longString;
+      for (int i = 0; i < 100; i++) {
+        longString.append(u"aé👍東");
+      }
+
+      bool allEqual = true;
+      bool allFit = true;
+      bool allOverflow = true;
+      auto check = [&](UnicodeString &aString) {
+        std::string expected;
+        aString.toUTF8String(expected);
+        allEqual &= toString(aString) == expected;
+        // Buffers exactly long enough, and one byte too short.
+        UErrorCode status = U_ZERO_ERROR;
+        std::string buffer(expected.size(), '\0');
+        int32_t length = toUtf8(aString, buffer, status);
+        allFit &= U_SUCCESS(status) && buffer == expected &&
+                  length == int32_t(expected.size());
+        if (!expected.empty()) {
+          status = U_ZERO_ERROR;
+          length = toUtf8(aString, mozilla::Span(buffer).To(expected.size() - 1), status);
+          allOverflow &= status == U_BUFFER_OVERFLOW_ERROR &&
+                         length == int32_t(expected.size());
+        }
+      };
+      for (auto &string : strings) {
+        check(string);
+      }
+      for (int32_t length = 0; length <= longString.length(); length += 7) {
+        UnicodeString prefix = longString.tempSubString(0, length);
+        check(prefix);
+      }
+      test::ok(allEqual, "toString matches toUTF8String");
+      test::ok(allFit, "Strings can be written into buffers that fit exactly");
+      test::ok(allOverflow, "Smaller buffers overflow and report the length needed");
+
+      Utf8Arena arena(64);
+      std::vector<std::string_view> views;
+      for (auto &string : strings) {
+        views.push_back(arena.Append(string));
+      }
+      views.push_back(arena.Append(longString));
+      views.push_back(arena.Append(std::string_view("plain")));
+      bool viewsEqual = true;
+      for (size_t i = 0; i < std::size(strings); i++) {
+        viewsEqual &= views[i] == toString(strings[i]);
+      }
+      viewsEqual &= views[std::size(strings)] == toString(longString);
+      viewsEqual &= views.back() == "plain";
+      test::ok(viewsEqual, "Strings in the arena stay valid as it grows");
+
+      size_t blocks = arena.BlockCount();
+      arena.Clear();
+      for (auto &string : strings) {
+        arena.Append(string);
+      }
+      test::equal(arena.BlockCount(), blocks, "A cleared arena reuses its blocks");
+      arena.Clear();
+      arena.Reserve(longString.length() * 3 * 10);
+      blocks = arena.BlockCount();
+      for (int i = 0; i < 10; i++) {
+        arena.Append(longString);
+      }
+      test::equal(arena.BlockCount(), blocks, "Appending reserved room doesn't allocate");
+      test::equal(arena.Size(), toString(longString).size() * 10,
+                  "The arena counts its bytes");
+    });
+
+    test::describe("UTF-8 conversion benchmark", []() {
+      UnicodeString longString;
+      for (int i = 0; i < 200; i++) {
+        longString.append(u"Wednesday, April 14, 2021 — 水曜日 ");
+      }
+      struct Case {
+        const char *name;
+        UnicodeString text;
+      };
+      Case cases[] = {
+          {"short", u"11:33 AM"},
+          {"medium", u"Mittwoch, 14. April 2021 um 20:10:49 Koordinierte Weltzeit"},
+          {"long", longString},
+      };
+      test::BenchmarkOptions options;
+      options.samples = 5;
+      for (auto &aCase : cases) {
+        std::string name = aCase.name;
+        auto icu = test::benchmark(
+            name + " with toUTF8String",
+            [&]() {
+              std::string utf8;
+              aCase.text.toUTF8String(utf8);
+              test::DoNotOptimize(utf8);
+            },
+            options);
+        auto string = test::benchmark(
+            name + " with toString",
+            [&]() { test::DoNotOptimize(toString(aCase.text)); }, options);
+        std::string buffer(aCase.text.length() * 3, '\0');
+        auto span = test::benchmark(
+            name + " into a buffer",
+            [&]() {
+              UErrorCode status = U_ZERO_ERROR;
+              test::DoNotOptimize(toUtf8(aCase.text, buffer, status));
+            },
+            options);
+        Utf8Arena arena(1 << 16);
+        auto arenaResult = test::benchmark(
+            name + " into an arena",
+            [&]() {
+              arena.Clear();
+              test::DoNotOptimize(arena.Append(aCase.text));
+            },
+            options);
+        printf("      %s speedup %.2fx for toString, %.2fx into a buffer, %.2fx into an "
+               "arena\n",
+               aCase.name, icu.median / string.median, icu.median / span.median,
+               icu.median / arenaResult.median);
+      }
+    });
+
+    test::describe("multi-locale formatting", []() {
+      UErrorCode status = U_ZERO_ERROR;
+      const char *locales[] = {"en", "es", "ar", "ja", "hi", "de", "fr",
+                               "ru", "zh", "ko", "th", "he-IL"};
+      UnicodeString dateSkeleton(u"yMMMdjm");
+      UnicodeString numberSkeleton(u"compact-short currency/USD .##");
+      std::vector<UDate> dates;
+      std::vector<double> numbers;
+      for (int i = 0; i < 100; i++) {
+        dates.push_back(1583884800000.0 + i * 86400000.0 * 3.7);
+        numbers.push_back(i * i * 1234.5);
+      }
+
+      MultiLocaleFormatter formatter(locales, dateSkeleton, numberSkeleton, status);
+      parallel::ThreadPool pool(4);
+      formatter.Format(pool, dates, numbers, status);
+      test::ok(U_SUCCESS(status), "The batch can be formatted");
+      test::equal(formatter.LocaleCount(), std::size(locales), "Every locale is kept");
+
+      bool allEqual = true;
+      for (size_t i = 0; i < std::size(locales); i++) {
+        Locale locale(locales[i]);
+        std::unique_ptr<DateTimePatternGenerator> generator(
+            DateTimePatternGenerator::createInstance(locale, status));
+        SimpleDateFormat dateFormat(generator->getBestPattern(dateSkeleton, status),
+                                    locale, status);
+        LocalizedNumberFormatter numberFormat =
+            NumberFormatter::forSkeleton(numberSkeleton, status).locale(locale);
+        allEqual &= formatter.Dates(i).Length() == dates.size() &&
+                    formatter.Numbers(i).Length() == numbers.size();
+        for (size_t j = 0; allEqual && j < dates.size(); j++) {
+          UnicodeString date;
+          dateFormat.format(dates[j], date);
+          UnicodeString number =
+              numberFormat.formatDouble(numbers[j], status).toString(status);
+          allEqual &= formatter.Dates(i)[j] == toString(date) &&
+                      formatter.Numbers(i)[j] == toString(number);
+        }
+      }
+      test::ok(allEqual, "Every locale formats like its own formatters");
+
+      // The second batch reserves for the longest text of the first.
+      formatter.Format(pool, dates, numbers, status);
+      size_t blocks = formatter.ArenaBlockCount();
+      formatter.Format(pool, dates, numbers, status);
+      test::equal(formatter.ArenaBlockCount(), blocks,
+                  "Formatting the same batch again reuses the arenas");
+
+      parallel::ThreadPool inline_(1);
+      auto parallelDates = formatter.Dates(3);
+      std::vector<std::string> expected(parallelDates.begin(), parallelDates.end());
+      formatter.Format(inline_, dates, numbers, status);
+      auto inlineDates = formatter.Dates(3);
+      test::ok(std::equal(expected.begin(), expected.end(), inlineDates.begin(),
+                          inlineDates.end()),
+               "A pool with a single thread formats the same");
+      test::ok(U_SUCCESS(status), "Formatting succeeds");
+    });
+
+    test::describe("multi-locale formatting benchmark", []() {
+      UErrorCode status = U_ZERO_ERROR;
+      const char *locales[] = {"en", "es", "ar", "ja", "hi", "de", "fr", "ru"};
+      UnicodeString dateSkeleton(u"yMMMdjm");
+      UnicodeString numberSkeleton(u"compact-short currency/USD .##");
+      std::vector<UDate> dates;
+      std::vector<double> numbers;
+      for (int i = 0; i < 50; i++) {
+        dates.push_back(1583884800000.0 + i * 86400000.0 * 3.7);
+        numbers.push_back(i * i * 1234.5);
+      }
+      test::BenchmarkOptions options;
+      options.samples = 5;
+
+      std::vector<std::unique_ptr<SimpleDateFormat>> dateFormats;
+      std::vector<LocalizedNumberFormatter> numberFormats;
+      for (const char *name : locales) {
+        Locale locale(name);
+        std::unique_ptr<DateTimePatternGenerator> generator(
+            DateTimePatternGenerator::createInstance(locale, status));
+        dateFormats.push_back(std::make_unique<SimpleDateFormat>(
+            generator->getBestPattern(dateSkeleton, status), locale, status));
+        numberFormats.push_back(
+            NumberFormatter::forSkeleton(numberSkeleton, status).locale(locale));
+      }
+      auto serial = test::benchmark(
+          "format each locale in turn into strings",
+          [&]() {
+            std::vector<std::vector<std::string>> results(std::size(locales));
+            for (size_t i = 0; i < std::size(locales); i++) {
+              for (UDate date : dates) {
+                UnicodeString formatted;
+                dateFormats[i]->format(date, formatted);
+                results[i].push_back(toString(formatted));
+              }
+              for (double number : numbers) {
+                UnicodeString formatted =
+                    numberFormats[i].formatDouble(number, status).toString(status);
+                results[i].push_back(toString(formatted));
+              }
+            }
+            test::DoNotOptimize(results);
+          },
+          options);
+
+      MultiLocaleFormatter formatter(locales, dateSkeleton, numberSkeleton, status);
+      parallel::ThreadPool &pool = parallel::ThreadPool::global();
+      auto parallel = test::benchmark(
+          "format the locales in parallel into arenas",
+          [&]() { formatter.Format(pool, dates, numbers, status); }, options);
+      printf("      speedup %.2fx on %zu threads\n", serial.median / parallel.median,
+             pool.threadCount());
+      test::ok(U_SUCCESS(status), "Formatting succeeds");
+    });
+
     test::describe("fractional second", []() {
       auto maxString = std::string("05:00.0000000000000");
       test::equal(test_pattern("mm:ss.S"), std::string("05:00.0"));
@@ -586,6 +2428,574 @@ void run_tests() {
       test::equal(test_pattern("mm:ss.SSSSSSSSSSSSS"), maxString, "13 digits is the max");
       test::equal(test_pattern("mm:ss.SSSSSSSSSSSSSSSSSSSSSSSSS"), maxString);
     });
+
+    test::describe("pattern generator registry", []() {
+      UErrorCode status = U_ZERO_ERROR;
+      PatternGeneratorRegistry registry;
+      const char *locales[] = {"en", "es", "ar", "ja", "hi"};
+
+      bool allEqual = true;
+      for (const char *name : locales) {
+        std::unique_ptr<DateTimePatternGenerator> expected(
+            DateTimePatternGenerator::createInstance(name, status));
+        for (auto skeleton : {u"yMMMd", u"jm", u"EEEEMMMMd", u"GyMMMEd"}) {
+          allEqual &= registry.ThreadGenerator(name, status)->getBestPattern(
+                          skeleton, status) == expected->getBestPattern(skeleton, status);
+          allEqual &= registry.Clone(name, status)->getBestPattern(skeleton, status) ==
+                      expected->getBestPattern(skeleton, status);
+        }
+      }
+      test::ok(U_SUCCESS(status), "The generators can be looked up");
+      test::ok(allEqual, "The generators agree with new ones");
+      test::equal(registry.BuildCount(), std::size(locales),
+                  "Each locale's generator is only built once");
+      test::equal(registry.ThreadGenerator("ja", status),
+                  registry.ThreadGenerator("ja", status),
+                  "A thread reuses its generator");
+      test::ok(registry.Clone("ja", status).get() !=
+                   registry.ThreadGenerator("ja", status),
+               "A clone is a new generator");
+
+      parallel::ThreadPool pool(4);
+      std::atomic<size_t> mismatches = 0;
+      auto lookupTask = [&](size_t aTask) {
+        UErrorCode status = U_ZERO_ERROR;
+        const char *name = aTask % 2 ? "de" : "fr";
+        DateTimePatternGenerator *generator = registry.ThreadGenerator(name, status);
+        if (U_FAILURE(status) || generator->getBestPattern(u"yMMMd", status) !=
+                                     registry.Clone(name, status)->getBestPattern(
+                                         u"yMMMd", status)) {
+          mismatches++;
+        }
+      };
+      pool.run(100, lookupTask);
+      test::equal(mismatches.load(), size_t(0), "Threads can look up generators at once");
+      test::equal(registry.BuildCount(), std::size(locales) + 2,
+                  "Racing threads build each generator once");
+    });
+
+    test::describe("pattern generator registry benchmark", []() {
+      UErrorCode status = U_ZERO_ERROR;
+      Locale locale("en");
+      PatternGeneratorRegistry registry;
+      test::BenchmarkOptions options;
+      options.samples = 5;
+
+      auto create = test::benchmark(
+          "create a generator",
+          [&]() {
+            std::unique_ptr<DateTimePatternGenerator> generator(
+                DateTimePatternGenerator::createInstance(locale, status));
+            test::DoNotOptimize(generator);
+          },
+          options);
+      auto clone = test::benchmark(
+          "clone a generator from the registry",
+          [&]() { test::DoNotOptimize(registry.Clone(locale, status)); }, options);
+      auto thread = test::benchmark(
+          "look up the thread's generator",
+          [&]() { test::DoNotOptimize(registry.ThreadGenerator(locale, status)); },
+          options);
+      printf("      clone speedup %.2fx\n", create.median / clone.median);
+      printf("      lookup speedup %.2fx\n", create.median / thread.median);
+      test::ok(U_SUCCESS(status), "The generators can be looked up");
+    });
+
+    test::describe("date format cache", []() {
+      UErrorCode status = U_ZERO_ERROR;
+      GregorianCalendar calendar(2020, 0, 21, 14, 5, status);
+      UDate date = calendar.getTime(status);
+      const char *locales[] = {"en", "es", "ar", "ja", "hi"};
+      const char16_t *skeletons[] = {u"yMMMd", u"jm", u"EEEEMMMMd", u"yMd", u"Hms"};
+
+      // The cache should format exactly what a freshly built formatter does.
+      auto formatDirectly = [&](const Locale &aLocale, const UnicodeString &aSkeleton,
+                                const char16_t *aTimeZone) {
+        UErrorCode status = U_ZERO_ERROR;
+        std::unique_ptr<DateTimePatternGenerator> generator(
+            DateTimePatternGenerator::createInstance(aLocale, status));
+        SimpleDateFormat formatter(generator->getBestPattern(aSkeleton, status), aLocale,
+                                   status);
+        if (aTimeZone) {
+          formatter.adoptTimeZone(TimeZone::createTimeZone(aTimeZone));
+        }
+        UnicodeString formatted;
+        formatter.format(date, formatted, status);
+        return toString(formatted);
+      };
+
+      {
+        DateFormatCache cache;
+        bool allEqual = true;
+        for (const char *name : locales) {
+          for (const char16_t *skeleton : skeletons) {
+            Locale locale(name);
+            UnicodeString formatted;
+            cache.Format(locale, skeleton, date, formatted, status);
+            allEqual &= toString(formatted) == formatDirectly(locale, skeleton, nullptr);
+          }
+        }
+        test::ok(U_SUCCESS(status), "Formatting succeeds");
+        test::ok(allEqual, "The cache formats the same as a new formatter");
+        test::equal(cache.Size(), std::size(locales) * std::size(skeletons),
+                    "Every locale and skeleton is cached");
+        test::equal(cache.MissCount(), cache.Size(), "Only the first lookup misses");
+
+        UnicodeString formatted;
+        cache.Format("en", u"yMMMd", date, formatted, status);
+        test::equal(cache.MissCount(), cache.Size(), "A repeated lookup hits");
+
+        std::string tokyo;
+        {
+          UnicodeString formatted;
+          cache.Format("en", u"Hm", u"Asia/Tokyo", date, formatted, status);
+          tokyo = toString(formatted);
+        }
+        test::equal(tokyo, formatDirectly("en", u"Hm", u"Asia/Tokyo"),
+                    "The time zone is part of the key");
+
+        UnicodeString pattern = cache.GetBestPattern("en", u"yMMMd", status);
+        test::equal(toString(pattern), SkeletonTestingUtility("en", 2020, 0, 21, 14, 5)
+                                           .Pattern("yMMMd"),
+                    "The pattern can be looked up");
+      }
+
+      {
+        DateFormatCache cache(16);
+        for (int day = 1; day <= 28; day++) {
+          UnicodeString formatted;
+          cache.Format("en", UnicodeString("yMMMd ") + UnicodeString(day), date,
+                       formatted, status);
+        }
+        test::ok(cache.Size() <= 16 && cache.Size() > 0,
+                 "The least recently used formatters are evicted");
+      }
+
+      {
+        DateFormatCache cache;
+        parallel::ThreadPool pool(4);
+        std::string expected[std::size(locales)];
+        for (size_t i = 0; i < std::size(locales); i++) {
+          expected[i] = formatDirectly(locales[i], u"yMMMMEEEEd", nullptr);
+        }
+        std::atomic<size_t> mismatches = 0;
+        auto formatTask = [&](size_t aTask) {
+          UErrorCode status = U_ZERO_ERROR;
+          size_t index = aTask % std::size(locales);
+          UnicodeString formatted;
+          cache.Format(locales[index], u"yMMMMEEEEd", date, formatted, status);
+          if (U_FAILURE(status) || toString(formatted) != expected[index]) {
+            mismatches++;
+          }
+        };
+        pool.run(200, formatTask);
+        test::equal(mismatches.load(), size_t(0),
+                    "Threads can format from the same cache at once");
+      }
+    });
+
+    test::describe("date format cache benchmark", []() {
+      UErrorCode status = U_ZERO_ERROR;
+      Locale locale("en");
+      UnicodeString skeleton(u"yMMMMEEEEdjm");
+      GregorianCalendar calendar(2020, 0, 21, 14, 5, status);
+      UDate date = calendar.getTime(status);
+      test::BenchmarkOptions options;
+      options.samples = 5;
+
+      auto perCall = test::benchmark(
+          "build a generator and formatter for every call",
+          [&]() {
+            std::unique_ptr<DateTimePatternGenerator> generator(
+                DateTimePatternGenerator::createInstance(locale, status));
+            SimpleDateFormat formatter(generator->getBestPattern(skeleton, status),
+                                       locale, status);
+            UnicodeString formatted;
+            formatter.format(date, formatted, status);
+            test::DoNotOptimize(formatted);
+          },
+          options);
+      test::benchmark(
+          "format with a cold cache",
+          [&]() {
+            DateFormatCache cache;
+            UnicodeString formatted;
+            cache.Format(locale, skeleton, date, formatted, status);
+            test::DoNotOptimize(formatted);
+          },
+          options);
+      DateFormatCache cache;
+      auto warm = test::benchmark(
+          "format with a warm cache",
+          [&]() {
+            UnicodeString formatted;
+            cache.Format(locale, skeleton, date, formatted, status);
+            test::DoNotOptimize(formatted);
+          },
+          options);
+      printf("      speedup %.2fx\n", perCall.median / warm.median);
+      test::ok(U_SUCCESS(status), "Formatting succeeds");
+    });
+
+    test::describe("batch date formatting", []() {
+      // A day and a half of dates around the start of daylight saving time in New
+      // York, at uneven steps, with a few out of order.
+      std::vector<UDate> dates;
+      UDate start = 1583884800000.0; // 2020-03-08 00:00 UTC
+      for (UDate date = start - 40 * 3600000.0; date < start + 20 * 3600000.0;
+           date += 1234567.0) {
+        dates.push_back(date);
+      }
+      dates.push_back(start - 1e9);
+      dates.push_back(start + 0.5);
+      dates.push_back(-1.5e12);
+
+      // ICU formats every date by itself.
+      auto expectBatch = [&](const FormattedDates &aBatch, const UnicodeString &aPattern,
+                             const Locale &aLocale, const char16_t *aTimeZone) {
+        UErrorCode status = U_ZERO_ERROR;
+        SimpleDateFormat formatter(aPattern, aLocale, status);
+        if (aTimeZone) {
+          formatter.adoptTimeZone(TimeZone::createTimeZone(aTimeZone));
+        }
+        if (aBatch.Length() != dates.size()) {
+          return false;
+        }
+        for (size_t i = 0; i < dates.size(); i++) {
+          UnicodeString formatted;
+          formatter.format(dates[i], formatted, status);
+          if (aBatch[i] != toString(formatted)) {
+            printf("      %s != %s\n", std::string(aBatch[i]).c_str(),
+                   toString(formatted).c_str());
+            return false;
+          }
+        }
+        return bool(U_SUCCESS(status));
+      };
+
+      const char16_t *patterns[] = {
+          u"HH:mm:ss",
+          u"M/d/y h:mm:ss.SSS a",
+          u"EEEE, MMMM d, y 'at' k:mm:ss.S zzzz",
+          u"yyyy-MM-dd'T'HH:mm:ss.SSSSXXX",
+          u"K:mm a, z",
+          u"h 'o''clock' B",
+          u"MMM d",
+      };
+      for (const char *name : {"en", "es", "ar", "ja", "hi", "ar-EG"}) {
+        for (const char16_t *pattern : patterns) {
+          for (const char16_t *timeZone : {u"America/New_York", u"UTC"}) {
+            UErrorCode status = U_ZERO_ERROR;
+            BatchDateFormatter formatter(pattern, name, status, timeZone);
+            FormattedDates batch;
+            formatter.Format(dates, batch, status);
+            UnicodeString label = UnicodeString(u"Batch formats \"") + pattern +
+                                  u"\" in " + UnicodeString(name) + u", " + timeZone;
+            test::ok(U_SUCCESS(status) && expectBatch(batch, pattern, name, timeZone),
+                     toString(label));
+          }
+        }
+      }
+
+      UErrorCode status = U_ZERO_ERROR;
+      BatchDateFormatter formatter(u"HH:mm:ss.SSS", "en", status, u"UTC");
+      FormattedDates batch;
+      std::vector<UDate> oneDay;
+      for (int i = 0; i < 1000; i++) {
+        oneDay.push_back(start + i * 60000.0);
+      }
+      formatter.Format(oneDay, batch, status);
+      test::ok(formatter.UsesTemplates(), "Numeric time fields use templates");
+      test::equal(formatter.TemplateCount(), size_t(1), "A day only needs one template");
+      test::equal(batch[999], std::string_view("16:39:00.000"), "The time is filled in");
+
+      BatchDateFormatter hijri(u"h:mm a", "ar-EG", status);
+      hijri.Format(oneDay, batch, status);
+      test::ok(!hijri.UsesTemplates(), "Non-ASCII digits are formatted by ICU");
+
+      batch = formatBatch(mozilla::Span(dates).To(3), u"y-MM-dd", "en", status);
+      test::equal(batch.Length(), size_t(3), "There is an offset for each date");
+      test::equal(batch.mOffsets.back(), batch.mText.size(),
+                  "The last offset is the end of the text");
+    });
+
+    test::describe("batch date formatting benchmark", []() {
+      UErrorCode status = U_ZERO_ERROR;
+      UnicodeString pattern(u"y-MM-dd HH:mm:ss.SSS");
+      Locale locale("en");
+      std::vector<UDate> dates;
+      for (int i = 0; i < 100000; i++) {
+        dates.push_back(1583884800000.0 + i * 1000.0);
+      }
+      test::BenchmarkOptions options;
+      options.warmupRuns = 1;
+      options.samples = 5;
+
+      SimpleDateFormat formatter(pattern, locale, status);
+      auto perCall = test::benchmark(
+          "format " + std::to_string(dates.size()) + " dates one at a time",
+          [&]() {
+            std::vector<std::string> lines;
+            for (UDate date : dates) {
+              UnicodeString formatted;
+              formatter.format(date, formatted, status);
+              lines.push_back(toString(formatted));
+            }
+            test::DoNotOptimize(lines);
+          },
+          options);
+      BatchDateFormatter batchFormatter(pattern, locale, status);
+      FormattedDates batch;
+      auto batched = test::benchmark(
+          "format " + std::to_string(dates.size()) + " dates as a batch",
+          [&]() {
+            batchFormatter.Format(dates, batch, status);
+            test::DoNotOptimize(batch);
+          },
+          options);
+      printf("      %.1f ns per date, speedup %.2fx\n", batched.median / dates.size(),
+             perCall.median / batched.median);
+      test::ok(U_SUCCESS(status), "Formatting succeeds");
+    });
+
+    test::describe("numeric date patterns", []() {
+      std::mt19937_64 random(1234);
+      std::vector<UDate> dates = {0.0, -1.0, 951782400000.0, 1583650800000.0,
+                                  -12219292800000.0, -12219292800000.0 + 864e5 * 2,
+                                  253402300799999.0};
+      for (int i = 0; i < 2000; i++) {
+        // From about 1400 to 2600.
+        dates.push_back(std::floor(
+            std::uniform_real_distribution<double>(-1.8e13, 2e13)(random)));
+      }
+
+      // Check every date against ICU by itself.
+      auto matchesIcu = [&](const char16_t *aPattern, const char *aLocale,
+                            const char16_t *aTimeZone) {
+        UErrorCode status = U_ZERO_ERROR;
+        NumericDateFormatter formatter(aPattern, aLocale, status, aTimeZone);
+        SimpleDateFormat icuFormatter(aPattern, Locale(aLocale), status);
+        icuFormatter.adoptTimeZone(TimeZone::createTimeZone(aTimeZone));
+        for (UDate date : dates) {
+          std::string formatted;
+          UnicodeString expected;
+          formatter.Format(date, formatted, status);
+          icuFormatter.format(date, expected, status);
+          if (formatted != toString(expected)) {
+            printf("      %s != %s\n", formatted.c_str(), toString(expected).c_str());
+            return false;
+          }
+        }
+        return bool(U_SUCCESS(status));
+      };
+      auto isCompiled = [](const char16_t *aPattern, const char *aLocale) {
+        UErrorCode status = U_ZERO_ERROR;
+        return NumericDateFormatter(aPattern, aLocale, status).IsCompiled();
+      };
+
+      for (const char16_t *pattern :
+           {u"HH:mm:ss", u"M/d/y", u"mm:ss.SSS", u"dd.MM.yy", u"y-MM-dd'T'HH:mm:ss.SSS",
+            u"h:mm", u"k:mm:ss.S", u"K:mm:ss.SS", u"yyyyy/M/d 'o''clock' H",
+            u"'Week' d, 'y' y", u"mm:ss.SSSSSS", u"d LL年", u"yyy"}) {
+        UnicodeString quoted = UnicodeString(u"\"") + pattern + u"\"";
+        std::string label = toString(quoted);
+        test::ok(isCompiled(pattern, "en"), label + " is compiled");
+        test::ok(matchesIcu(pattern, "en", u"America/New_York") &&
+                     matchesIcu(pattern, "hi", u"Asia/Kolkata") &&
+                     matchesIcu(pattern, "en", u"Australia/Lord_Howe"),
+                 label + " is the same as ICU");
+      }
+      for (const char16_t *pattern : {u"MMM d", u"h:mm a", u"EEEE", u"HH:mm z", u"G y"}) {
+        UnicodeString quoted = UnicodeString(u"\"") + pattern + u"\"";
+        std::string label = toString(quoted);
+        test::ok(!isCompiled(pattern, "en"), label + " is formatted by ICU");
+        test::ok(matchesIcu(pattern, "en", u"Europe/Paris"),
+                 label + " is the same as ICU");
+      }
+      test::ok(!isCompiled(u"HH:mm", "ar-EG"), "Non-ASCII digits are formatted by ICU");
+      test::ok(!isCompiled(u"y/M/d", "ja@calendar=japanese"),
+               "Other calendars are formatted by ICU");
+      test::ok(matchesIcu(u"y/M/d", "ja@calendar=japanese", u"Asia/Tokyo") &&
+                   matchesIcu(u"HH:mm", "ar-EG", u"Africa/Cairo"),
+               "And are the same as ICU");
+    });
+
+    test::describe("numeric date patterns benchmark", []() {
+      UErrorCode status = U_ZERO_ERROR;
+      UnicodeString pattern(u"y-MM-dd HH:mm:ss.SSS");
+      Locale locale("en");
+      std::vector<UDate> dates;
+      for (int i = 0; i < 10000; i++) {
+        dates.push_back(1583884800000.0 + i * 86399999.0);
+      }
+      test::BenchmarkOptions options;
+      options.samples = 5;
+
+      SimpleDateFormat icuFormatter(pattern, locale, status);
+      auto icu = test::benchmark(
+          "format " + std::to_string(dates.size()) + " dates with ICU",
+          [&]() {
+            std::string formatted;
+            UnicodeString scratch;
+            for (UDate date : dates) {
+              scratch.remove();
+              icuFormatter.format(date, scratch, status);
+              scratch.toUTF8String(formatted);
+            }
+            test::DoNotOptimize(formatted);
+          },
+          options);
+      NumericDateFormatter formatter(pattern, locale, status);
+      auto compiled = test::benchmark(
+          "format " + std::to_string(dates.size()) + " dates with the compiled pattern",
+          [&]() {
+            std::string formatted;
+            for (UDate date : dates) {
+              formatter.Format(date, formatted, status);
+            }
+            test::DoNotOptimize(formatted);
+          },
+          options);
+      printf("      %.1f ns per date, speedup %.2fx\n", compiled.median / dates.size(),
+             icu.median / compiled.median);
+      test::ok(formatter.IsCompiled() && U_SUCCESS(status), "Formatting succeeds");
+    });
+
+    test::describe("number formatter cache", []() {
+      UErrorCode status = U_ZERO_ERROR;
+      NumberFormatterCache cache;
+      const CachedNumberFormatter *formatter =
+          cache.Get("en", u"compact-short currency/USD .##", status);
+      char buffer[64];
+      int32_t length = formatter->FormatInt64(1234, buffer, status);
+      test::equal(std::string(buffer, length), std::string("$1.23K"),
+                  "The number can be formatted from a skeleton.");
+      test::equal(cache.Get("en", u"compact-short currency/USD .##", status), formatter,
+                  "The formatter is cached");
+      test::equal(cache.Size(), size_t(1), "There is one formatter");
+
+      // The cached formatter formats the same as the one built by chaining.
+      auto chained = NumberFormatter::withLocale(Locale("en"))
+                         .notation(Notation::compactShort())
+                         .unit(CurrencyUnit("USD", status))
+                         .precision(Precision::maxFraction(2));
+      bool allEqual = true;
+      for (double value : {0.0, -1.5, 999.999, 1234.5678, 1e9, 3.25e15}) {
+        UnicodeString expected = chained.formatDouble(value, status).toString(status);
+        length = formatter->FormatDouble(value, buffer, status);
+        allEqual &= std::string(buffer, length) == toString(expected);
+        UnicodeString fromCpp =
+            formatter->Formatter().formatDouble(value, status).toString(status);
+        allEqual &= fromCpp == expected;
+      }
+      test::ok(allEqual && U_SUCCESS(status), "It matches a chained formatter");
+
+      allEqual = true;
+      for (const char *name : {"en", "es", "ar", "ja", "hi", "ar-EG"}) {
+        for (const char16_t *skeleton :
+             {u"", u"percent", u"precision-integer", u"measure-unit/length-meter",
+              u"scientific .00", u"currency/EUR unit-width-full-name"}) {
+          const CachedNumberFormatter *cached = cache.Get(name, skeleton, status);
+          LocalizedNumberFormatter built =
+              NumberFormatter::forSkeleton(skeleton, status).locale(name);
+          for (int64_t value : {int64_t(0), int64_t(-42), int64_t(1234567),
+                                std::numeric_limits<int64_t>::max()}) {
+            UnicodeString expected = built.formatInt(value, status).toString(status);
+            char longBuffer[256];
+            length = cached->FormatInt64(value, longBuffer, status);
+            allEqual &= std::string(longBuffer, length) == toString(expected);
+          }
+        }
+      }
+      test::ok(allEqual && U_SUCCESS(status), "Locales and skeletons match ICU");
+
+      char small[4];
+      length = formatter->FormatDouble(1234567.0, small, status);
+      test::equal(status, U_BUFFER_OVERFLOW_ERROR, "A small buffer overflows");
+      test::equal(length, int32_t(strlen("$1.23M")), "And reports the length needed");
+
+      // A thread whose first call has already failed can still format later.
+      std::string later;
+      std::thread([&]() {
+        UErrorCode failed = U_ILLEGAL_ARGUMENT_ERROR;
+        formatter->FormatInt64(1234, buffer, failed);
+        UErrorCode threadStatus = U_ZERO_ERROR;
+        int32_t threadLength = formatter->FormatInt64(1234, buffer, threadStatus);
+        if (U_SUCCESS(threadStatus)) {
+          later.assign(buffer, threadLength);
+        }
+      }).join();
+      test::equal(later, std::string("$1.23K"), "A failed first call isn't kept");
+
+      // ICU 72 still allocates a little inside of its own formatting, so compare
+      // against formatting with the C API into a reused result.
+      status = U_ZERO_ERROR;
+      ::icu::LocalUNumberFormatterPointer bare(unumf_openForSkeletonAndLocale(
+          u"compact-short currency/USD .##", -1, "en", &status));
+      ::icu::LocalUFormattedNumberPointer result(unumf_openResult(&status));
+      auto countAllocations = [](auto aFormat) {
+        // ICU only compiles a formatter after it has been used a few times.
+        for (int i = 0; i < 10; i++) {
+          aFormat(i);
+        }
+        size_t before = IcuAllocationCounter::Count();
+        for (int i = 0; i < 1000; i++) {
+          aFormat(i);
+        }
+        return IcuAllocationCounter::Count() - before;
+      };
+      size_t icuAllocations = countAllocations([&](int i) {
+        unumf_formatDouble(bare.getAlias(), i * 12.345, result.getAlias(), &status);
+        unumf_formatInt(bare.getAlias(), i * 1000003, result.getAlias(), &status);
+      });
+      size_t bufferAllocations = countAllocations([&](int i) {
+        formatter->FormatDouble(i * 12.345, buffer, status);
+        formatter->FormatInt64(i * 1000003, buffer, status);
+      });
+      size_t chainedAllocations = countAllocations([&](int i) {
+        chained.formatDouble(i * 12.345, status).toString(status);
+        chained.formatInt(i * 1000003, status).toString(status);
+      });
+      printf("      allocations per 1000 numbers: %zu for ICU, %zu into a buffer, %zu "
+             "chained\n",
+             icuAllocations, bufferAllocations, chainedAllocations);
+      test::ok(bufferAllocations <= icuAllocations,
+               "Formatting into a buffer doesn't allocate beyond ICU itself");
+      test::ok(U_SUCCESS(status), "Formatting succeeds");
+    });
+
+    test::describe("number formatter cache benchmark", []() {
+      UErrorCode status = U_ZERO_ERROR;
+      test::BenchmarkOptions options;
+      options.samples = 5;
+      double value = 1234.5678;
+
+      auto chained = test::benchmark(
+          "build the formatter for every number",
+          [&]() {
+            UnicodeString formatted = NumberFormatter::withLocale(Locale("en"))
+                                          .notation(Notation::compactShort())
+                                          .unit(CurrencyUnit("USD", status))
+                                          .precision(Precision::maxFraction(2))
+                                          .formatDouble(value, status)
+                                          .toString(status);
+            test::DoNotOptimize(toString(formatted));
+          },
+          options);
+      const CachedNumberFormatter *formatter = NumberFormatterCache::Shared().Get(
+          "en", u"compact-short currency/USD .##", status);
+      auto cached = test::benchmark(
+          "format with a cached formatter into a buffer",
+          [&]() {
+            char buffer[64];
+            int32_t length = formatter->FormatDouble(value, buffer, status);
+            test::DoNotOptimize(buffer);
+            test::DoNotOptimize(length);
+          },
+          options);
+      printf("      speedup %.2fx\n", chained.median / cached.median);
+      test::ok(U_SUCCESS(status), "Formatting succeeds");
+    });
   });
 }
 
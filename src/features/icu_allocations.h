@@ -0,0 +1,42 @@
+#pragma once
+#include "unicode/uclean.h"
+#include <atomic>
+#include <cstddef>
+#include <cstdlib>
+
+namespace features {
+
+/**
+ * Counts the heap allocations that ICU makes, by installing allocation functions
+ * that count before calling malloc. ICU only allows this before it has been used,
+ * so main() installs them before anything else runs, and they stay installed for
+ * the rest of the program.
+ */
+class IcuAllocationCounter {
+public:
+  // Must be called before any other ICU function, and before any threads start.
+  static bool Install() {
+    UErrorCode status = U_ZERO_ERROR;
+    u_setMemoryFunctions(nullptr, Alloc, Realloc, Free, &status);
+    return U_SUCCESS(status);
+  }
+
+  static size_t Count() { return sCount.load(std::memory_order_relaxed); }
+
+private:
+  static void *U_CALLCONV Alloc(const void *, size_t aSize) {
+    sCount.fetch_add(1, std::memory_order_relaxed);
+    return malloc(aSize);
+  }
+
+  static void *U_CALLCONV Realloc(const void *, void *aPointer, size_t aSize) {
+    sCount.fetch_add(1, std::memory_order_relaxed);
+    return realloc(aPointer, aSize);
+  }
+
+  static void U_CALLCONV Free(const void *, void *aPointer) { free(aPointer); }
+
+  static inline std::atomic<size_t> sCount{0};
+};
+
+} // namespace features
@@ -0,0 +1,359 @@
+#include "./parallel.h"
+#include "../test.h"
+#include <cmath>
+#include <numeric>
+#include <string>
+
+namespace features::parallel {
+
+// Set while a thread is running tasks, whether it's one of the pool's threads or
+// the thread that started the job, so that nested jobs run inline.
+static thread_local bool sIsRunningTasks = false;
+
+namespace {
+
+// The slots that threads have given back when they exited, and the next slot that
+// has never been used. Threads can exit at any time, so these take a lock.
+std::mutex sSlotMutex;
+std::vector<size_t> sFreeSlots;
+size_t sNextSlot = 0;
+
+struct ThreadSlotHolder {
+  ThreadSlotHolder() {
+    std::lock_guard lock(sSlotMutex);
+    if (sFreeSlots.empty()) {
+      mSlot = sNextSlot++;
+    } else {
+      mSlot = sFreeSlots.back();
+      sFreeSlots.pop_back();
+    }
+  }
+
+  ~ThreadSlotHolder() {
+    std::lock_guard lock(sSlotMutex);
+    sFreeSlots.push_back(mSlot);
+  }
+
+  size_t mSlot;
+};
+
+} // namespace
+
+size_t threadSlot() {
+  thread_local ThreadSlotHolder sHolder;
+  return sHolder.mSlot;
+}
+
+ThreadPool::ThreadPool(size_t aThreadCount) {
+  for (size_t i = 1; i < aThreadCount; i++) {
+    mWorkers.emplace_back([this]() { workerLoop(); });
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> lock(mMutex);
+    mIsShuttingDown = true;
+  }
+  mWake.notify_all();
+  for (std::thread &worker : mWorkers) {
+    worker.join();
+  }
+}
+
+ThreadPool &ThreadPool::global() {
+  static ThreadPool sPool(std::max(1u, std::thread::hardware_concurrency()));
+  return sPool;
+}
+
+void ThreadPool::runTasks(Job &aJob) {
+  sIsRunningTasks = true;
+  while (true) {
+    size_t task = aJob.mNextTask.fetch_add(1, std::memory_order_relaxed);
+    if (task >= aJob.mTaskCount) {
+      break;
+    }
+    aJob.mTask(task);
+  }
+  sIsRunningTasks = false;
+}
+
+void ThreadPool::workerLoop() {
+  uint64_t seenGeneration = 0;
+  std::unique_lock<std::mutex> lock(mMutex);
+  while (true) {
+    mWake.wait(lock,
+               [&]() { return mIsShuttingDown || mGeneration != seenGeneration; });
+    if (mIsShuttingDown) {
+      return;
+    }
+    seenGeneration = mGeneration;
+    Job *job = mJob;
+    if (!job) {
+      // The job finished before this thread woke up.
+      continue;
+    }
+    mWorkersInJob++;
+    lock.unlock();
+    runTasks(*job);
+    lock.lock();
+    if (--mWorkersInJob == 0) {
+      mJobDone.notify_all();
+    }
+  }
+}
+
+void ThreadPool::run(size_t aTaskCount, mozilla::FunctionRef<void(size_t)> aTask) {
+  if (aTaskCount == 0) {
+    return;
+  }
+  if (aTaskCount == 1 || mWorkers.empty() || sIsRunningTasks) {
+    for (size_t task = 0; task < aTaskCount; task++) {
+      aTask(task);
+    }
+    return;
+  }
+
+  std::lock_guard<std::mutex> runLock(mRunMutex);
+  Job job{aTask, aTaskCount};
+  {
+    std::lock_guard<std::mutex> lock(mMutex);
+    mJob = &job;
+    mGeneration++;
+  }
+  mWake.notify_all();
+
+  runTasks(job);
+
+  // Every task has been claimed, but workers may still be running theirs. The job
+  // lives on this stack, so it has to outlive every worker that picked it up.
+  std::unique_lock<std::mutex> lock(mMutex);
+  mJob = nullptr;
+  mJobDone.wait(lock, [&]() { return mWorkersInJob == 0; });
+}
+
+// A deliberately compute-bound kernel for the scaling tests.
+static double sumOfRoots(Range aRange) {
+  double sum = 0;
+  for (size_t i = aRange.begin; i < aRange.end; i++) {
+    sum += std::sqrt(static_cast<double>(i));
+  }
+  return sum;
+}
+
+void run_tests() {
+  test::suite("features::parallel", []() {
+    // Always run with a few threads, even on a single core machine, so that the
+    // tests exercise the concurrency.
+    const size_t maxThreads = std::max(4u, std::thread::hardware_concurrency());
+
+    test::describe("chunks cover the range exactly once", []() {
+      ThreadPool pool(4);
+      const size_t size = 100003;
+      std::vector<std::atomic<uint32_t>> visits(size);
+      parallel_for(pool, Range{0, size}, 0, [&](Range aChunk) {
+        for (size_t i = aChunk.begin; i < aChunk.end; i++) {
+          visits[i].fetch_add(1, std::memory_order_relaxed);
+        }
+      });
+      bool isExactlyOnce = true;
+      for (auto &visit : visits) {
+        isExactlyOnce = isExactlyOnce && visit.load() == 1;
+      }
+      test::ok(isExactlyOnce, "Every index was visited exactly once");
+    });
+
+    test::describe("chunking", []() {
+      ThreadPool pool(4);
+      test::equal(chunkCount(pool, Range{0, 0}, 0), size_t(0), "An empty range");
+      test::equal(chunkCount(pool, Range{0, 10}, 100), size_t(1),
+                  "A range smaller than the grain is one chunk");
+      test::equal(chunkCount(pool, Range{0, 1000}, 0), size_t(16),
+                  "Automatic chunking makes a few chunks per thread");
+      test::equal(chunkCount(pool, Range{0, 1000}, 250), size_t(4),
+                  "The grain limits the chunk count");
+      test::equal(chunkAt(Range{10, 20}, 3, 0).size(), size_t(4), "The first chunk");
+      test::equal(chunkAt(Range{10, 20}, 3, 2).end, size_t(20),
+                  "The last chunk ends at the end of the range");
+
+      size_t calls = 0;
+      parallel_for(pool, Range{5, 5}, 0, [&](Range) { calls++; });
+      test::equal(calls, size_t(0), "An empty range never calls the function");
+    });
+
+    test::describe("reduce combines the chunks in order", []() {
+      ThreadPool pool(4);
+      std::string letters = "abcdefghijklmnopqrstuvwxyz";
+      auto joined = parallel_reduce(
+          pool, Range{0, letters.size()}, 1, std::string(),
+          [&](Range aChunk) { return letters.substr(aChunk.begin, aChunk.size()); },
+          [](std::string aLeft, std::string aRight) { return aLeft + aRight; });
+      test::equal(joined, letters, "String concatenation is not commutative");
+
+      bool isInRange = parallel_reduce(
+          pool, Range{0, 1000}, 10, true,
+          [](Range aChunk) { return aChunk.begin < aChunk.end && aChunk.end <= 1000; },
+          [](bool aLeft, bool aRight) { return aLeft && aRight; });
+      test::ok(isInRange, "Boolean reductions work");
+    });
+
+    test::describe("nested jobs run inline", []() {
+      ThreadPool pool(4);
+      std::atomic<size_t> sum = 0;
+      parallel_for(pool, Range{0, 8}, 1, [&](Range aOuter) {
+        parallel_for(pool, Range{0, 100}, 1, [&](Range aInner) {
+          sum.fetch_add(aInner.size() * aOuter.size());
+        });
+      });
+      test::equal(sum.load(), size_t(800), "Every nested index was visited");
+    });
+
+    test::describe("the global pool is shared", []() {
+      test::ok(&ThreadPool::global() == &ThreadPool::global(), "There is one pool");
+      size_t sum = parallel_reduce(
+          Range{0, 1001}, 0, size_t(0),
+          [](Range aChunk) {
+            size_t chunkSum = 0;
+            for (size_t i = aChunk.begin; i < aChunk.end; i++) {
+              chunkSum += i;
+            }
+            return chunkSum;
+          },
+          std::plus<size_t>());
+      test::equal(sum, size_t(500500), "Sums with the global pool");
+    });
+
+    test::describe("thread slots and per-thread values", []() {
+      size_t mainSlot = threadSlot();
+      test::equal(threadSlot(), mainSlot, "A thread keeps its slot");
+
+      size_t firstSlot = 0;
+      std::thread([&]() { firstSlot = threadSlot(); }).join();
+      size_t secondSlot = 0;
+      std::thread([&]() { secondSlot = threadSlot(); }).join();
+      test::ok(firstSlot != mainSlot, "Live threads have different slots");
+      test::equal(secondSlot, firstSlot, "An exited thread's slot is reused");
+
+      auto values = std::make_unique<PerThread<size_t>>();
+      test::ok(values->Get() == nullptr, "A thread starts without a value");
+      values->Set(std::make_unique<size_t>(1));
+      std::atomic<size_t> wrong = 0;
+      std::vector<std::thread> threads;
+      for (size_t i = 0; i < 8; i++) {
+        threads.emplace_back([&, i]() {
+          size_t *value = values->Get();
+          if (!value) {
+            value = values->Set(std::make_unique<size_t>(i + 100));
+          }
+          if (values->Get() != value) {
+            wrong++;
+          }
+        });
+      }
+      for (auto &thread : threads) {
+        thread.join();
+      }
+      test::equal(*values->Get(), size_t(1), "Other threads leave this one's value");
+      test::equal(wrong.load(), size_t(0), "Each thread finds the value it set");
+      values.reset();
+      test::info("The values are destroyed with their owner");
+    });
+
+    test::describe("padded slots sit on their own cache lines", []() {
+      PaddedSlot<std::atomic<bool>> slots[4];
+      auto first = reinterpret_cast<uintptr_t>(&slots[0].value);
+      auto second = reinterpret_cast<uintptr_t>(&slots[1].value);
+      test::equal(first % CACHE_LINE_SIZE, uintptr_t(0), "Slots are aligned");
+      test::equal(second - first, uintptr_t(CACHE_LINE_SIZE),
+                  "Neighboring slots are a cache line apart");
+    });
+
+    test::describe("the mailbox delivers every message once", []() {
+      const size_t consumerCount = 3;
+      const uint64_t messageCount = 10000;
+      Mailbox<uint64_t> mailbox(consumerCount);
+      std::vector<PaddedSlot<uint64_t>> sums(consumerCount);
+      std::vector<std::thread> consumers;
+      for (size_t consumer = 0; consumer < consumerCount; consumer++) {
+        consumers.emplace_back([&, consumer]() {
+          while (auto message = mailbox.receive(consumer)) {
+            sums[consumer].value += *message;
+            mailbox.complete(consumer);
+          }
+        });
+      }
+      for (uint64_t i = 1; i <= messageCount; i++) {
+        mailbox.post(i);
+      }
+      mailbox.close();
+      for (auto &consumer : consumers) {
+        consumer.join();
+      }
+      uint64_t total = 0;
+      for (auto &sum : sums) {
+        total += sum.value;
+      }
+      test::equal(total, messageCount * (messageCount + 1) / 2,
+                  "The consumers received every message");
+      test::ok(mailbox.receive(0).isNothing(), "A closed mailbox has no messages");
+      mailbox.reopen();
+      test::ok(mailbox.tryPost(0, 1), "A reopened mailbox takes messages again");
+    });
+
+    test::describe("mailbox ping-pong latency", [&]() {
+      for (size_t consumerCount : {size_t(1), maxThreads}) {
+        Mailbox<uint64_t> mailbox(consumerCount);
+        std::vector<std::thread> consumers;
+        for (size_t consumer = 0; consumer < consumerCount; consumer++) {
+          consumers.emplace_back([&, consumer]() {
+            while (auto message = mailbox.receive(consumer)) {
+              test::DoNotOptimize(*message);
+              mailbox.complete(consumer);
+            }
+          });
+        }
+        // A round trip is posting a message, and waiting for it to be completed.
+        uint64_t next = 0;
+        test::benchmark("round trip with " + std::to_string(consumerCount) +
+                            " consumer threads",
+                        [&]() {
+                          mailbox.post(next++);
+                          mailbox.awaitAllCompleted();
+                        });
+        mailbox.close();
+        for (auto &consumer : consumers) {
+          consumer.join();
+        }
+      }
+    });
+
+    test::describe("scaling from 1 to N threads", [&]() {
+      const size_t size = 1 << 22;
+      const double expected = sumOfRoots(Range{0, size});
+      test::BenchmarkOptions options;
+      options.samples = 5;
+
+      double serialMedian = 0;
+      for (size_t threads = 1; threads <= maxThreads; threads++) {
+        ThreadPool pool(threads);
+        double sum = 0;
+        auto result = test::benchmark(
+            "sum of square roots with " + std::to_string(threads) + " threads",
+            [&]() {
+              sum = parallel_reduce(pool, Range{0, size}, 4096, 0.0, sumOfRoots,
+                                    std::plus<double>());
+            },
+            options);
+        if (threads == 1) {
+          serialMedian = result.median;
+        } else {
+          printf("      speedup %.2fx\n", serialMedian / result.median);
+        }
+        test::ok(std::abs(sum - expected) < expected * 1e-9,
+                 "The sum matches the serial sum");
+      }
+    });
+  });
+}
+
+} // namespace features::parallel
@@ -0,0 +1,383 @@
+#pragma once
+#include "mfbt/Assertions.h"
+#include "mfbt/FunctionRef.h"
+#include "mfbt/Maybe.h"
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <vector>
+
+namespace features::parallel {
+
+// The distance that two objects need to be apart to not share a cache line. GCC
+// warns that the standard constant can change between compiler flags, but this is
+// only used within this program, so that's fine.
+#ifdef __cpp_lib_hardware_interference_size
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Winterference-size"
+#endif
+constexpr size_t CACHE_LINE_SIZE = std::hardware_destructive_interference_size;
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+#else
+constexpr size_t CACHE_LINE_SIZE = 64;
+#endif
+
+/**
+ * A value that sits on its own cache line. When threads write to neighboring
+ * values, the cache line bounces between their cores even though they never touch
+ * each other's data, which is known as false sharing. Padding every value out to
+ * a whole cache line prevents it, at the cost of some memory.
+ */
+template <typename T> struct alignas(CACHE_LINE_SIZE) PaddedSlot {
+  T value;
+};
+
+static_assert(sizeof(PaddedSlot<char>) == CACHE_LINE_SIZE,
+              "A slot fills a whole cache line");
+static_assert(alignof(PaddedSlot<char>) == CACHE_LINE_SIZE,
+              "A slot starts on a cache line boundary");
+
+// Tells the CPU that this is a spin loop, which saves power and lets a sibling
+// hyperthread run.
+inline void cpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__)
+  asm volatile("yield");
+#endif
+}
+
+/**
+ * Spins for a short while, then starts yielding the thread. Spinning gives the
+ * lowest latency when the other thread is running on another core, but when
+ * there are more threads than cores, the other thread may need this core to make
+ * progress.
+ */
+class SpinWait {
+public:
+  void wait() {
+    if (mSpins < SPINS_BEFORE_YIELDING) {
+      mSpins++;
+      cpuRelax();
+    } else {
+      std::this_thread::yield();
+    }
+  }
+
+private:
+  static constexpr size_t SPINS_BEFORE_YIELDING = 128;
+  size_t mSpins = 0;
+};
+
+/**
+ * A single producer, multiple consumer mailbox, with one slot per consumer. The
+ * producer posts a message into a consumer's slot, and the slot stays full until
+ * that consumer completes the message, which lets the producer know when all of
+ * the work has finished, and not only when it has been picked up.
+ *
+ * The slots are padded and stored in one contiguous array, so that a consumer
+ * polling its own slot never shares a cache line with another consumer's slot.
+ */
+template <typename T> class Mailbox {
+public:
+  explicit Mailbox(size_t aConsumerCount)
+      : mConsumerCount(aConsumerCount), mSlots(new PaddedSlot<Slot>[aConsumerCount]) {}
+
+  size_t consumerCount() const { return mConsumerCount; }
+
+  // Producer: posts the message if the consumer's slot is empty.
+  bool tryPost(size_t aConsumer, const T &aMessage) {
+    Slot &slot = mSlots[aConsumer].value;
+    if (slot.mState.load(std::memory_order_acquire) != Empty) {
+      return false;
+    }
+    slot.mMessage = aMessage;
+    slot.mState.store(Full, std::memory_order_release);
+    return true;
+  }
+
+  // Producer: waits for any consumer to be free, posts the message to it, and
+  // returns which consumer it went to.
+  size_t post(const T &aMessage) {
+    SpinWait spin;
+    while (true) {
+      for (size_t consumer = 0; consumer < mConsumerCount; consumer++) {
+        if (tryPost(consumer, aMessage)) {
+          return consumer;
+        }
+      }
+      spin.wait();
+    }
+  }
+
+  // Producer: waits until every posted message has been completed. Anything the
+  // consumers wrote before completing is visible afterwards.
+  void awaitAllCompleted() {
+    for (size_t consumer = 0; consumer < mConsumerCount; consumer++) {
+      SpinWait spin;
+      while (mSlots[consumer].value.mState.load(std::memory_order_acquire) != Empty) {
+        spin.wait();
+      }
+    }
+  }
+
+  // Producer: waits for the outstanding messages, then tells every consumer to
+  // stop.
+  void close() {
+    awaitAllCompleted();
+    for (size_t consumer = 0; consumer < mConsumerCount; consumer++) {
+      mSlots[consumer].value.mState.store(Closed, std::memory_order_release);
+    }
+  }
+
+  // Producer: empties the slots of a closed mailbox so that it can be used again.
+  // The consumers from before it was closed must have stopped.
+  void reopen() {
+    for (size_t consumer = 0; consumer < mConsumerCount; consumer++) {
+      mSlots[consumer].value.mState.store(Empty, std::memory_order_release);
+    }
+  }
+
+  // Consumer: waits for a message, or Nothing once the mailbox is closed.
+  mozilla::Maybe<T> receive(size_t aConsumer) {
+    Slot &slot = mSlots[aConsumer].value;
+    SpinWait spin;
+    while (true) {
+      uint32_t state = slot.mState.load(std::memory_order_acquire);
+      if (state == Full) {
+        return mozilla::Some(slot.mMessage);
+      }
+      if (state == Closed) {
+        return mozilla::Nothing();
+      }
+      spin.wait();
+    }
+  }
+
+  // Consumer: marks the received message as done, which frees up the slot.
+  void complete(size_t aConsumer) {
+    mSlots[aConsumer].value.mState.store(Empty, std::memory_order_release);
+  }
+
+private:
+  enum State : uint32_t { Empty, Full, Closed };
+
+  struct Slot {
+    std::atomic<uint32_t> mState{Empty};
+    T mMessage{};
+  };
+
+  const size_t mConsumerCount;
+  std::unique_ptr<PaddedSlot<Slot>[]> mSlots;
+};
+
+/**
+ * A pool of threads that stay alive between jobs, so that running work in
+ * parallel doesn't pay for spawning threads every time like ParallelPrimes does.
+ *
+ * A job is a count of tasks. The tasks are handed out dynamically, so a slow task
+ * doesn't hold up the rest, and the calling thread works on the job too rather
+ * than sitting idle. Only one job runs at a time, and a job that is started from
+ * inside of a task runs inline on that thread, so nested parallelism can't
+ * deadlock the pool.
+ */
+class ThreadPool {
+public:
+  // The thread count includes the calling thread, so a pool of 1 runs everything
+  // inline.
+  explicit ThreadPool(size_t aThreadCount = std::thread::hardware_concurrency());
+  ~ThreadPool();
+
+  ThreadPool(const ThreadPool &) = delete;
+  ThreadPool &operator=(const ThreadPool &) = delete;
+
+  size_t threadCount() const { return mWorkers.size() + 1; }
+
+  // Calls aTask(i) for every i in [0, aTaskCount), and returns once they have all
+  // finished.
+  void run(size_t aTaskCount, mozilla::FunctionRef<void(size_t)> aTask);
+
+  // The pool that is shared across modules, sized to the hardware.
+  static ThreadPool &global();
+
+private:
+  struct Job {
+    mozilla::FunctionRef<void(size_t)> mTask;
+    size_t mTaskCount;
+    std::atomic<size_t> mNextTask{0};
+  };
+
+  static void runTasks(Job &aJob);
+  void workerLoop();
+
+  std::vector<std::thread> mWorkers;
+  // Only one job can run at a time.
+  std::mutex mRunMutex;
+  // The following are guarded by mMutex.
+  std::mutex mMutex;
+  std::condition_variable mWake;
+  std::condition_variable mJobDone;
+  Job *mJob = nullptr;
+  uint64_t mGeneration = 0;
+  size_t mWorkersInJob = 0;
+  bool mIsShuttingDown = false;
+};
+
+/**
+ * A small index for the calling thread, unique among the threads that are alive.
+ * When a thread exits its index goes to the next thread that asks for one, so the
+ * indexes stay dense, and state can be kept per thread in an array.
+ */
+size_t threadSlot();
+
+/**
+ * A value for each thread, owned by an object rather than by the threads, so that
+ * the values are destroyed along with the object, which a thread_local can't do.
+ * Each thread only touches the value at its own threadSlot, which doesn't take a
+ * lock. When a thread exits, its value is left for the next thread that gets its
+ * slot, so a value must not be tied to the thread that made it.
+ */
+template <typename T> class PerThread {
+public:
+  // The most threads that can be alive while using the values.
+  static constexpr size_t MAX_THREADS = 4096;
+
+  PerThread() = default;
+  PerThread(const PerThread &) = delete;
+  PerThread &operator=(const PerThread &) = delete;
+
+  ~PerThread() {
+    for (auto &chunk : mChunks) {
+      delete chunk.load(std::memory_order_acquire);
+    }
+  }
+
+  // The calling thread's value, or nullptr when it hasn't set one.
+  T *Get() {
+    size_t slot = threadSlot();
+    MOZ_RELEASE_ASSERT(slot < MAX_THREADS, "Too many threads for PerThread");
+    Chunk *chunk = mChunks[slot / CHUNK_SIZE].load(std::memory_order_acquire);
+    return chunk ? chunk->mValues[slot % CHUNK_SIZE].get() : nullptr;
+  }
+
+  // Replace the calling thread's value.
+  T *Set(std::unique_ptr<T> aValue) {
+    size_t slot = threadSlot();
+    MOZ_RELEASE_ASSERT(slot < MAX_THREADS, "Too many threads for PerThread");
+    std::atomic<Chunk *> &chunkSlot = mChunks[slot / CHUNK_SIZE];
+    Chunk *chunk = chunkSlot.load(std::memory_order_acquire);
+    if (!chunk) {
+      // The chunks are shared by the threads in them, so only one can be kept.
+      auto *created = new Chunk();
+      if (chunkSlot.compare_exchange_strong(chunk, created, std::memory_order_acq_rel)) {
+        chunk = created;
+      } else {
+        delete created;
+      }
+    }
+    auto &value = chunk->mValues[slot % CHUNK_SIZE];
+    value = std::move(aValue);
+    return value.get();
+  }
+
+private:
+  // The values are allocated in chunks as threads need them, so that an object
+  // only used by a few threads stays small.
+  static constexpr size_t CHUNK_SIZE = 64;
+
+  struct Chunk {
+    std::unique_ptr<T> mValues[CHUNK_SIZE];
+  };
+
+  std::atomic<Chunk *> mChunks[MAX_THREADS / CHUNK_SIZE] = {};
+};
+
+// A half-open range of indexes, [begin, end).
+struct Range {
+  size_t begin;
+  size_t end;
+
+  size_t size() const { return end > begin ? end - begin : 0; }
+};
+
+// How many chunks a range is split into. The grain is the smallest chunk worth
+// running as its own task, and a grain of 0 picks one automatically. There are a
+// few chunks per thread so that uneven chunks can be balanced across threads.
+inline size_t chunkCount(const ThreadPool &aPool, Range aRange, size_t aGrain) {
+  size_t size = aRange.size();
+  if (size == 0) {
+    return 0;
+  }
+  size_t maxChunks = aPool.threadCount() == 1 ? 1 : aPool.threadCount() * 4;
+  size_t grain = std::max<size_t>(aGrain, 1);
+  return std::min(maxChunks, (size + grain - 1) / grain);
+}
+
+inline Range chunkAt(Range aRange, size_t aChunkCount, size_t aChunk) {
+  // Spread the remainder over the first chunks, so no chunk is more than one
+  // larger than any other.
+  size_t base = aRange.size() / aChunkCount;
+  size_t remainder = aRange.size() % aChunkCount;
+  size_t begin = aRange.begin + aChunk * base + std::min(aChunk, remainder);
+  return Range{begin, begin + base + (aChunk < remainder ? 1 : 0)};
+}
+
+/**
+ * Calls aFn(Range) over consecutive chunks that cover aRange exactly once. The
+ * chunks may run concurrently, and in any order.
+ */
+template <typename F>
+void parallel_for(ThreadPool &aPool, Range aRange, size_t aGrain, F &&aFn) {
+  size_t chunks = chunkCount(aPool, aRange, aGrain);
+  auto task = [&](size_t aChunk) { aFn(chunkAt(aRange, chunks, aChunk)); };
+  aPool.run(chunks, task);
+}
+
+template <typename F> void parallel_for(Range aRange, size_t aGrain, F &&aFn) {
+  parallel_for(ThreadPool::global(), aRange, aGrain, std::forward<F>(aFn));
+}
+
+/**
+ * Maps every chunk of aRange to a value with aMap(Range), then combines the values
+ * with aReduce(T, T), starting from aIdentity. The values are combined in the
+ * order of their chunks, so aReduce only needs to be associative, and not
+ * commutative.
+ */
+template <typename T, typename Map, typename Reduce>
+T parallel_reduce(ThreadPool &aPool, Range aRange, size_t aGrain, T aIdentity,
+                  Map &&aMap, Reduce &&aReduce) {
+  // Wrap the values so that a std::vector<bool> doesn't pack them into shared
+  // words, which would turn the writes from different threads into a data race.
+  struct Slot {
+    T value;
+  };
+  size_t chunks = chunkCount(aPool, aRange, aGrain);
+  std::vector<Slot> slots(chunks, Slot{aIdentity});
+  auto task = [&](size_t aChunk) {
+    slots[aChunk].value = aMap(chunkAt(aRange, chunks, aChunk));
+  };
+  aPool.run(chunks, task);
+
+  T result = std::move(aIdentity);
+  for (Slot &slot : slots) {
+    result = aReduce(std::move(result), std::move(slot.value));
+  }
+  return result;
+}
+
+template <typename T, typename Map, typename Reduce>
+T parallel_reduce(Range aRange, size_t aGrain, T aIdentity, Map &&aMap,
+                  Reduce &&aReduce) {
+  return parallel_reduce(ThreadPool::global(), aRange, aGrain, std::move(aIdentity),
+                         std::forward<Map>(aMap), std::forward<Reduce>(aReduce));
+}
+
+} // namespace features::parallel
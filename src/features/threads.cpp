@@ -1,13 +1,28 @@
 #include "../test.h"
+#include "./parallel.h"
+#include "mfbt/Maybe.h"
+#include "mfbt/Span.h"
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cassert>
 #include <chrono>
 #include <cmath>
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <random>
 #include <thread>
 #include <vector>
 
 namespace features {
 namespace threads {
 
+using mozilla::Maybe;
+using mozilla::Nothing;
+using mozilla::Some;
+using mozilla::Span;
+
 // Provide a simple function to trivially test threading.
 void fn() {}
 
@@ -38,17 +53,10 @@ std::vector<char> computePrimesSerially(size_t count) {
 }
 
 class ParallelPrimes {
-  class ThreadCommunication {
-  public:
-    std::atomic<bool> mIsRunning;
-    std::atomic<bool> mHasData;
-    // Data:
-    std::atomic<size_t> mStartingMultipleIndex;
-    std::atomic<size_t> mPrimeValue;
-
-    ThreadCommunication()
-        : mIsRunning(true), mHasData(false), mStartingMultipleIndex(0),
-          mPrimeValue(0) {}
+  // The work that is sent to a writer thread.
+  struct WriteMultiples {
+    size_t mStartingMultipleIndex = 0;
+    size_t mPrimeValue = 0;
   };
 
   // Use dynamically allocated arrays rather than vectors, in order to support
@@ -56,23 +64,18 @@ class ParallelPrimes {
   size_t mPrimeCount;
   size_t mThreadCount;
   std::atomic<bool> *mPrimes;
-  // The following are arrays of pointers.
-  std::thread **mThreads;
-  ThreadCommunication **mThreadCommunications;
+  std::vector<std::thread> mThreads;
+  // Every writer thread polls its own padded slot in the mailbox, so the writers
+  // never share a cache line with each other.
+  parallel::Mailbox<WriteMultiples> mMailbox;
 
 public:
   ParallelPrimes(size_t aPrimeCount)
       : mPrimeCount(aPrimeCount),
-        mThreadCount(std::thread::hardware_concurrency()),
-        mPrimes(new std::atomic<bool>[aPrimeCount]),
-        mThreads(new std::thread *[mThreadCount]),
-        mThreadCommunications(new ThreadCommunication *[mThreadCount]) {}
-
-  ~ParallelPrimes() {
-    delete[] mThreads;
-    delete[] mThreadCommunications;
-    delete[] mPrimes;
-  }
+        mThreadCount(std::max(1u, std::thread::hardware_concurrency())),
+        mPrimes(new std::atomic<bool>[aPrimeCount]), mMailbox(mThreadCount) {}
+
+  ~ParallelPrimes() { delete[] mPrimes; }
 
   void compute() {
     for (size_t i = 0; i < mPrimeCount; i++) {
@@ -117,58 +120,41 @@ public:
   }
 
   void stopAllThreads() {
-    for (size_t i = 0; i < mThreadCount; i++) {
-      // Make sure all the threads are joined, so they aren't dangling and
-      // still operating.
-      mThreadCommunications[i]->mIsRunning = false;
-      mThreads[i]->join();
-      delete mThreads[i];
-      delete mThreadCommunications[i];
+    // Make sure all the threads are joined, so they aren't dangling and still
+    // operating.
+    mMailbox.close();
+    for (std::thread &thread : mThreads) {
+      thread.join();
     }
+    mThreads.clear();
   }
 
   void launchWriter(size_t startingMultipleIndex, size_t primeValue) {
-    while (true) {
-      // Loop forever looking for a free worker in the thread pool.
-      for (size_t threadIndex = 0; threadIndex < mThreadCount; threadIndex++) {
-        // Go through each active worker, and examine it's data.
-        if (!mThreadCommunications[threadIndex]->mHasData) {
-          // This free has no data, set it, and it will in turn find it, and
-          // write out the multiples.
-          mThreadCommunications[threadIndex]->mStartingMultipleIndex =
-              startingMultipleIndex;
-          mThreadCommunications[threadIndex]->mPrimeValue = primeValue;
-          // Make sure and set this value last:
-          mThreadCommunications[threadIndex]->mHasData = true;
-          return;
-        }
-      }
-    }
+    // Wait for a free worker in the thread pool, and hand it the multiples to
+    // write out.
+    mMailbox.post(WriteMultiples{startingMultipleIndex, primeValue});
   }
 
   void initializeThreads() {
+    // The mailbox was closed to stop the threads of the last computation.
+    mMailbox.reopen();
     for (size_t i = 0; i < mThreadCount; i++) {
-      mThreadCommunications[i] = new ThreadCommunication{};
-      mThreads[i] = new std::thread{ParallelPrimes::threadRunner,
-                                    std::ref(mThreadCommunications[i]),
-                                    std::ref(mPrimes), mPrimeCount};
+      mThreads.emplace_back(ParallelPrimes::threadRunner, std::ref(mMailbox), i, mPrimes,
+                            mPrimeCount);
     }
   }
 
-  static void threadRunner(ThreadCommunication *&aThreadCommunication,
-                           std::atomic<bool> *&primes, size_t primeCount) {
-    while (aThreadCommunication->mIsRunning) {
-      if (aThreadCommunication->mHasData) {
-        ParallelPrimes::writeMultiples(
-            aThreadCommunication->mStartingMultipleIndex,
-            aThreadCommunication->mPrimeValue, primeCount, primes);
-        aThreadCommunication->mHasData = false;
-      }
+  static void threadRunner(parallel::Mailbox<WriteMultiples> &aMailbox, size_t aIndex,
+                           std::atomic<bool> *primes, size_t primeCount) {
+    while (auto message = aMailbox.receive(aIndex)) {
+      ParallelPrimes::writeMultiples(message->mStartingMultipleIndex,
+                                     message->mPrimeValue, primeCount, primes);
+      aMailbox.complete(aIndex);
     }
   }
 
   static void writeMultiples(size_t startingMultipleIndex, size_t primeValue,
-                             size_t primeCount, std::atomic<bool> *&primes) {
+                             size_t primeCount, std::atomic<bool> *primes) {
     for (size_t j = startingMultipleIndex; j < primeCount; j += primeValue) {
       primes[j].store(false, std::memory_order_relaxed);
     }
@@ -176,57 +162,408 @@ public:
 
   bool isPrime(size_t number) { return mPrimes[number]; }
 
-  void awaitAllWriters() {
-    while (true) {
-      // Loop forever looking for a free worker in the thread pool.
-      bool areThreadsDone = true;
-      for (size_t threadIndex = 0; threadIndex < mThreadCount; threadIndex++) {
-        areThreadsDone =
-            areThreadsDone && !mThreadCommunications[threadIndex]->mHasData;
+  // Wait for every writer to finish, which also makes their writes visible.
+  void awaitAllWriters() { mMailbox.awaitAllCompleted(); }
+};
+
+/**
+ * A query service on top of a segmented sieve. computePrimesSerially has to
+ * sieve the entire range for every call, while this table splits the number line
+ * into fixed size segments, and only sieves a segment the first time that a query
+ * touches it. Sieved segments are cached for the lifetime of the table.
+ *
+ * Each segment only stores the odd numbers as a bitset, where bit k represents the
+ * number `segmentStart + 2k + 1`. The count of primes in each segment is kept along
+ * with a cumulative count of all the primes before it, which means pi(x) is a
+ * prefix lookup followed by a popcount over part of a single segment.
+ *
+ * Any number of threads can query the table at the same time. Once a segment is
+ * sieved, reading it only takes an acquire load. When a query needs many cold
+ * segments at once, they are sieved in parallel on the shared thread pool.
+ */
+class PrimeTable {
+public:
+  enum class QueryKind {
+    // Answers 1 if `a` is prime, and 0 if it isn't.
+    IsPrime,
+    // Answers pi(a), the count of primes <= a.
+    CountUpTo,
+    // Answers the count of primes in the inclusive range [a, b].
+    CountInRange,
+    // Answers the a-th prime, where the 1st prime is 2. Answers 0 when it is out
+    // of the table's range.
+    NthPrime,
+  };
+
+  struct Query {
+    QueryKind kind;
+    uint64_t a;
+    uint64_t b = 0;
+  };
+
+  // The limit is the exclusive upper bound of the numbers that can be queried.
+  // The segment size is how many numbers are covered by each segment, and is
+  // rounded up to a multiple of 128, so that a segment is made up of whole words.
+  explicit PrimeTable(uint64_t aLimit, uint64_t aSegmentSize = 1 << 18)
+      : mSegmentSize(roundUp(std::max<uint64_t>(aSegmentSize, 128), 128)),
+        mSegmentCount((std::max<uint64_t>(aLimit, 2) + mSegmentSize - 1) / mSegmentSize),
+        mLimit(aLimit),
+        mSegments(new Segment[mSegmentCount]),
+        mCumulativeCounts(new uint64_t[mSegmentCount + 1]) {
+    mCumulativeCounts[0] = 0;
+
+    // Sieve the odd base primes up to the square root of the limit. These are
+    // the only primes needed to cross off the composites in any segment.
+    uint64_t baseLimit = std::sqrt(static_cast<double>(mSegmentCount * mSegmentSize)) + 1;
+    std::vector<char> isComposite(baseLimit + 1, false);
+    for (uint64_t i = 3; i <= baseLimit; i += 2) {
+      if (!isComposite[i]) {
+        mBasePrimes.push_back(i);
+        for (uint64_t j = i * i; j <= baseLimit; j += 2 * i) {
+          isComposite[j] = true;
+        }
+      }
+    }
+  }
+
+  PrimeTable(const PrimeTable &) = delete;
+  PrimeTable &operator=(const PrimeTable &) = delete;
+
+  uint64_t limit() const { return mLimit; }
+
+  bool isPrime(uint64_t n) {
+    assert(n < mLimit);
+    if (n % 2 == 0) {
+      return n == 2;
+    }
+    uint64_t index = n / mSegmentSize;
+    const Segment &segment = ensureSegment(index);
+    uint64_t bit = (n - index * mSegmentSize) / 2;
+    return (segment.mBits[bit / 64] >> (bit % 64)) & 1;
+  }
+
+  // pi(x), the count of primes less than or equal to x.
+  uint64_t countPrimesUpTo(uint64_t x) {
+    assert(x < mLimit);
+    if (x < 2) {
+      return 0;
+    }
+    uint64_t index = x / mSegmentSize;
+    uint64_t before = ensureCumulativeCount(index);
+    const Segment &segment = ensureSegment(index);
+    // The odd numbers in [segmentStart, x] are the bits [0, bitCount).
+    uint64_t bitCount = (x - index * mSegmentSize + 1) / 2;
+    // Add one for the only even prime.
+    return 1 + before + popcountBits(segment, bitCount);
+  }
+
+  uint64_t countPrimesInRange(uint64_t a, uint64_t b) {
+    if (b < a) {
+      return 0;
+    }
+    uint64_t upToB = countPrimesUpTo(b);
+    return a == 0 ? upToB : upToB - countPrimesUpTo(a - 1);
+  }
+
+  // All of the primes in the inclusive range [a, b].
+  std::vector<uint64_t> primesInRange(uint64_t a, uint64_t b) {
+    assert(b < mLimit);
+    std::vector<uint64_t> primes;
+    if (b < a) {
+      return primes;
+    }
+    if (a <= 2 && b >= 2) {
+      primes.push_back(2);
+    }
+    for (uint64_t index = a / mSegmentSize; index <= b / mSegmentSize; index++) {
+      const Segment &segment = ensureSegment(index);
+      uint64_t start = index * mSegmentSize;
+      size_t wordCount = mSegmentSize / 128;
+      for (size_t word = 0; word < wordCount; word++) {
+        uint64_t bits = segment.mBits[word];
+        while (bits) {
+          uint64_t n = start + 2 * (word * 64 + std::countr_zero(bits)) + 1;
+          bits &= bits - 1;
+          if (n > b) {
+            return primes;
+          }
+          if (n >= a) {
+            primes.push_back(n);
+          }
+        }
+      }
+    }
+    return primes;
+  }
+
+  // The nth prime, where nthPrime(1) == 2. This is Nothing when the prime is
+  // beyond the limit of the table.
+  Maybe<uint64_t> nthPrime(uint64_t n) {
+    if (n == 0) {
+      return Nothing();
+    }
+    if (n == 1) {
+      return Some(uint64_t(2));
+    }
+    // Skip the even prime, and find the (n - 1)th odd prime.
+    uint64_t remaining = n - 1;
+    // Find the segment containing the prime, which is the last segment with fewer
+    // than `remaining` odd primes before it.
+    uint64_t index;
+    uint64_t ready = mCumulativeReady.load(std::memory_order_acquire);
+    if (ready > 1 && mCumulativeCounts[ready - 1] >= remaining) {
+      const uint64_t *counts = mCumulativeCounts.get();
+      index = std::lower_bound(counts + 1, counts + ready, remaining) - counts - 1;
+    } else {
+      index = ready == 0 ? 0 : ready - 1;
+      while (index < mSegmentCount && ensureCumulativeCount(index + 1) < remaining) {
+        index++;
+      }
+      if (index == mSegmentCount) {
+        return Nothing();
+      }
+    }
+    remaining -= mCumulativeCounts[index];
+
+    // Use the ranks to find the block of words, then the word, then the bit.
+    const Segment &segment = ensureSegment(index);
+    const uint32_t *ranks = segment.mRanks.get();
+    size_t block = std::lower_bound(ranks, ranks + blockCount(), remaining) - ranks - 1;
+    remaining -= ranks[block];
+    for (size_t word = block * WORDS_PER_BLOCK;; word++) {
+      uint64_t bits = segment.mBits[word];
+      uint64_t count = std::popcount(bits);
+      if (count < remaining) {
+        remaining -= count;
+        continue;
       }
-      if (areThreadsDone) {
-        return;
+      // Drop the lowest bits until the remaining one is the prime.
+      for (; remaining > 1; remaining--) {
+        bits &= bits - 1;
       }
+      return Some(index * mSegmentSize + 2 * (word * 64 + std::countr_zero(bits)) + 1);
     }
   }
-};
 
-long timeExecution(std::function<void()> callback) {
-  auto before = std::chrono::high_resolution_clock::now();
-  callback();
-  auto after = std::chrono::high_resolution_clock::now();
-  return (std::chrono::duration_cast<std::chrono::microseconds>(after - before)
-              .count());
-}
+  // Answers a batch of queries, writing the answers in the same order into
+  // aResults. The queries are answered in increasing order of their numbers so
+  // that segments are visited in order, rather than bouncing around memory.
+  void answer(Span<const Query> aQueries, Span<uint64_t> aResults) {
+    assert(aQueries.Length() == aResults.Length());
+    std::vector<uint32_t> order(aQueries.Length());
+    for (uint32_t i = 0; i < order.size(); i++) {
+      order[i] = i;
+    }
+    std::sort(order.begin(), order.end(), [&](uint32_t left, uint32_t right) {
+      return aQueries[left].a < aQueries[right].a;
+    });
+
+    for (uint32_t i : order) {
+      const Query &query = aQueries[i];
+      switch (query.kind) {
+      case QueryKind::IsPrime:
+        aResults[i] = isPrime(query.a);
+        break;
+      case QueryKind::CountUpTo:
+        aResults[i] = countPrimesUpTo(query.a);
+        break;
+      case QueryKind::CountInRange:
+        aResults[i] = countPrimesInRange(query.a, query.b);
+        break;
+      case QueryKind::NthPrime:
+        aResults[i] = nthPrime(query.a).valueOr(0);
+        break;
+      }
+    }
+  }
+
+  // How many segments have been sieved so far.
+  size_t sievedSegmentCount() const {
+    size_t count = 0;
+    for (size_t i = 0; i < mSegmentCount; i++) {
+      count += mSegments[i].mIsReady.load(std::memory_order_relaxed);
+    }
+    return count;
+  }
+
+private:
+  // The ranks are the count of the primes before each block of words, so that
+  // counting within a segment never needs to popcount more than one block.
+  static constexpr size_t WORDS_PER_BLOCK = 8;
+
+  struct Segment {
+    std::once_flag mOnce;
+    std::atomic<bool> mIsReady{false};
+    uint64_t mPrimeCount = 0;
+    std::unique_ptr<uint64_t[]> mBits;
+    std::unique_ptr<uint32_t[]> mRanks;
+  };
+
+  static uint64_t roundUp(uint64_t value, uint64_t multiple) {
+    return (value + multiple - 1) / multiple * multiple;
+  }
+
+  size_t blockCount() const {
+    return (mSegmentSize / 128 + WORDS_PER_BLOCK - 1) / WORDS_PER_BLOCK;
+  }
+
+  uint64_t popcountBits(const Segment &aSegment, uint64_t aBitCount) const {
+    if (aBitCount == mSegmentSize / 2) {
+      return aSegment.mPrimeCount;
+    }
+    uint64_t wholeWords = aBitCount / 64;
+    uint64_t block = wholeWords / WORDS_PER_BLOCK;
+    uint64_t count = aSegment.mRanks[block];
+    for (uint64_t word = block * WORDS_PER_BLOCK; word < wholeWords; word++) {
+      count += std::popcount(aSegment.mBits[word]);
+    }
+    if (aBitCount % 64) {
+      uint64_t mask = (uint64_t(1) << (aBitCount % 64)) - 1;
+      count += std::popcount(aSegment.mBits[wholeWords] & mask);
+    }
+    return count;
+  }
+
+  const Segment &ensureSegment(uint64_t aIndex) {
+    Segment &segment = mSegments[aIndex];
+    if (segment.mIsReady.load(std::memory_order_acquire)) {
+      return segment;
+    }
+    std::call_once(segment.mOnce, [&]() {
+      sieveSegment(aIndex, segment);
+      segment.mIsReady.store(true, std::memory_order_release);
+    });
+    return segment;
+  }
+
+  void sieveSegment(uint64_t aIndex, Segment &aSegment) {
+    size_t wordCount = mSegmentSize / 128;
+    uint64_t start = aIndex * mSegmentSize;
+    uint64_t end = start + mSegmentSize;
+    aSegment.mBits.reset(new uint64_t[wordCount]);
+    uint64_t *bits = aSegment.mBits.get();
+    std::fill(bits, bits + wordCount, ~uint64_t(0));
+
+    for (uint64_t prime : mBasePrimes) {
+      if (prime * prime >= end) {
+        break;
+      }
+      // Find the first odd multiple in this segment, but don't cross off the
+      // prime itself.
+      uint64_t multiple = std::max(prime * prime, (start + prime - 1) / prime * prime);
+      if (multiple % 2 == 0) {
+        multiple += prime;
+      }
+      for (uint64_t bit = (multiple - start) / 2; bit < mSegmentSize / 2; bit += prime) {
+        bits[bit / 64] &= ~(uint64_t(1) << (bit % 64));
+      }
+    }
+
+    if (aIndex == 0) {
+      // 1 is not prime.
+      bits[0] &= ~uint64_t(1);
+    }
+    if (end > mLimit) {
+      // Clear out everything at or past the limit.
+      for (uint64_t bit = (std::max(mLimit, start) - start) / 2; bit < mSegmentSize / 2;
+           bit++) {
+        bits[bit / 64] &= ~(uint64_t(1) << (bit % 64));
+      }
+    }
+
+    aSegment.mRanks.reset(new uint32_t[blockCount()]);
+    uint64_t count = 0;
+    for (size_t word = 0; word < wordCount; word++) {
+      if (word % WORDS_PER_BLOCK == 0) {
+        aSegment.mRanks[word / WORDS_PER_BLOCK] = count;
+      }
+      count += std::popcount(bits[word]);
+    }
+    aSegment.mPrimeCount = count;
+  }
+
+  // Returns the count of the odd primes in all segments before aIndex, sieving
+  // any segments that are needed to compute it.
+  uint64_t ensureCumulativeCount(uint64_t aIndex) {
+    uint64_t ready = mCumulativeReady.load(std::memory_order_acquire);
+    if (aIndex < ready) {
+      return mCumulativeCounts[aIndex];
+    }
+    // Sieve any of the missing segments in parallel before taking the lock. The
+    // pool may be busy with a job whose tasks query this table, and they would
+    // never finish if this thread waited for the pool while holding the lock.
+    if (ready + 1 < aIndex) {
+      parallel::parallel_for(parallel::Range{ready, aIndex}, 1,
+                             [&](parallel::Range aChunk) {
+                               for (size_t i = aChunk.begin; i < aChunk.end; i++) {
+                                 ensureSegment(i);
+                               }
+                             });
+    }
+    std::lock_guard<std::mutex> lock(mCumulativeMutex);
+    ready = mCumulativeReady.load(std::memory_order_relaxed);
+    for (; ready <= aIndex; ready++) {
+      mCumulativeCounts[ready] =
+          ready == 0 ? 0
+                     : mCumulativeCounts[ready - 1] +
+                           ensureSegment(ready - 1).mPrimeCount;
+    }
+    mCumulativeReady.store(ready, std::memory_order_release);
+    return mCumulativeCounts[aIndex];
+  }
+
+  const uint64_t mSegmentSize;
+  const uint64_t mSegmentCount;
+  const uint64_t mLimit;
+  std::vector<uint64_t> mBasePrimes;
+  std::unique_ptr<Segment[]> mSegments;
+  // mCumulativeCounts[i] is the count of odd primes before segment i. The entries
+  // before mCumulativeReady are immutable, and can be read without the lock.
+  std::unique_ptr<uint64_t[]> mCumulativeCounts;
+  std::atomic<uint64_t> mCumulativeReady{0};
+  std::mutex mCumulativeMutex;
+};
 
 void run_tests() {
   test::suite("features::primes", []() {
     size_t timing_count = 1000;
     // size_t timing_count = 100000000;
     test::describe("timing in serial", [&]() {
-      auto timing =
-          timeExecution([&]() { computePrimesSerially(timing_count); });
-      printf("    ℹ It took %ld microseconds to compute %ld primes in serial\n",
-             timing, timing_count);
+      test::benchmark("compute " + std::to_string(timing_count) + " primes in serial",
+                      [&]() {
+                        test::DoNotOptimize(computePrimesSerially(timing_count));
+                      });
     });
 
     test::describe("timing in parallel", [&]() {
-      auto timing = timeExecution([&]() {
-        ParallelPrimes primes(timing_count);
-        primes.compute();
-      });
-      printf("    ℹ It took %ld microseconds to compute %ld primes using "
-             "concurrent writers\n",
-             timing, timing_count);
+      // Each run spins up a thread per core, so take fewer samples.
+      test::BenchmarkOptions options;
+      options.warmupRuns = 1;
+      options.samples = 5;
+      test::benchmark("compute " + std::to_string(timing_count) +
+                          " primes using concurrent writers",
+                      [&]() {
+                        ParallelPrimes primes(timing_count);
+                        primes.compute();
+                        test::DoNotOptimize(primes.isPrime(timing_count - 1));
+                      },
+                      options);
+    });
+
+    test::describe("parallel primes can be computed again", []() {
+      ParallelPrimes primes(1000);
+      primes.compute();
+      primes.compute();
+      auto serialPrimes = computePrimesSerially(1000);
+      bool doMatch = true;
+      for (size_t i = 0; i < serialPrimes.size(); i++) {
+        doMatch = doMatch && primes.isPrime(i) == (bool)serialPrimes[i];
+      }
+      test::ok(doMatch, "the second computation agrees");
     });
     return;
     test::describe("compute primes serially", []() {
-      std::vector<char> primes;
-
-      auto timing =
-          timeExecution([&]() { primes = computePrimesSerially(1000); });
-
-      printf("    ℹ It took %ld microseconds\n", timing);
+      std::vector<char> primes = computePrimesSerially(1000);
 
       test::equal((bool)primes[1], true, "1 is prime");
       test::equal((bool)primes[2], true, "2 is prime");
@@ -244,9 +581,7 @@ void run_tests() {
 
     test::describe("compute primes parallel", []() {
       ParallelPrimes primes(1000);
-      auto timing = timeExecution([&]() { primes.compute(); });
-
-      printf("    ℹ It took %ld microseconds\n", timing);
+      primes.compute();
 
       test::equal(primes.isPrime(1), true, "1 is prime");
       test::equal(primes.isPrime(2), true, "2 is prime");
@@ -274,6 +609,187 @@ void run_tests() {
     });
   });
 
+  test::suite("features::prime_table", []() {
+    const uint64_t limit = 1000000;
+    auto serialPrimes = computePrimesSerially(limit);
+
+    test::describe("answers queries about small numbers", []() {
+      PrimeTable table(1000, 128);
+      test::equal(table.isPrime(0), false, "0 is not prime");
+      test::equal(table.isPrime(1), false, "1 is not prime");
+      test::equal(table.isPrime(2), true, "2 is prime");
+      test::equal(table.isPrime(3), true, "3 is prime");
+      test::equal(table.isPrime(9), false, "9 is not prime");
+      test::equal(table.isPrime(997), true, "997 is prime");
+      test::equal(table.countPrimesUpTo(1), uint64_t(0), "pi(1)");
+      test::equal(table.countPrimesUpTo(2), uint64_t(1), "pi(2)");
+      test::equal(table.countPrimesUpTo(10), uint64_t(4), "pi(10)");
+      test::equal(table.countPrimesUpTo(999), uint64_t(168), "pi(999)");
+      test::equal(table.nthPrime(1), Some(uint64_t(2)), "The 1st prime is 2");
+      test::equal(table.nthPrime(5), Some(uint64_t(11)), "The 5th prime is 11");
+      test::equal(table.nthPrime(168), Some(uint64_t(997)), "The 168th prime is 997");
+      test::ok(table.nthPrime(169).isNothing(), "The 169th prime is out of range");
+      test::ok(table.primesInRange(90, 100) == std::vector<uint64_t>{97},
+               "The primes in [90, 100]");
+      test::ok(table.primesInRange(0, 12) == std::vector<uint64_t>{2, 3, 5, 7, 11},
+               "The primes in [0, 12]");
+    });
+
+    test::describe("segments are only sieved when they are queried", []() {
+      PrimeTable table(1 << 20, 1 << 16);
+      test::equal(table.sievedSegmentCount(), size_t(0), "Nothing is sieved up front");
+      table.isPrime(500001);
+      test::equal(table.sievedSegmentCount(), size_t(1), "Only one segment is sieved");
+      table.countPrimesUpTo(200000);
+      test::equal(table.sievedSegmentCount(), size_t(5),
+                  "pi(x) sieves every segment up to x");
+    });
+
+    test::describe("agrees with the serial sieve", [&]() {
+      PrimeTable table(limit, 1 << 12);
+      bool doMatch = true;
+      uint64_t count = 0;
+      for (uint64_t i = 2; i < limit; i++) {
+        count += serialPrimes[i];
+        doMatch = doMatch && table.isPrime(i) == (bool)serialPrimes[i] &&
+                  table.countPrimesUpTo(i) == count;
+      }
+      test::ok(doMatch, "isPrime and pi(x) agree for every number");
+      test::equal(table.countPrimesUpTo(limit - 1), uint64_t(78498), "pi(10^6)");
+      test::equal(table.nthPrime(78498), Some(uint64_t(999983)),
+                  "The last prime below 10^6");
+
+      auto primes = table.primesInRange(123456, 234567);
+      bool rangeMatches = primes.size() == table.countPrimesInRange(123456, 234567);
+      for (uint64_t prime : primes) {
+        rangeMatches = rangeMatches && serialPrimes[prime];
+      }
+      test::ok(rangeMatches, "The primes in a range span many segments");
+    });
+
+    test::describe("answers batches of queries", []() {
+      PrimeTable table(100000);
+      std::vector<PrimeTable::Query> queries{
+          {PrimeTable::QueryKind::CountUpTo, 99999},
+          {PrimeTable::QueryKind::IsPrime, 7919},
+          {PrimeTable::QueryKind::NthPrime, 1000},
+          {PrimeTable::QueryKind::CountInRange, 10, 20},
+          {PrimeTable::QueryKind::IsPrime, 7917},
+      };
+      std::vector<uint64_t> results(queries.size());
+      table.answer(Span{queries}, Span{results});
+      test::equal(results[0], uint64_t(9592), "pi(99999)");
+      test::equal(results[1], uint64_t(1), "7919 is prime");
+      test::equal(results[2], uint64_t(7919), "The 1000th prime");
+      test::equal(results[3], uint64_t(4), "The primes in [10, 20]");
+      test::equal(results[4], uint64_t(0), "7917 is not prime");
+    });
+
+    test::describe("supports concurrent readers", [&]() {
+      PrimeTable table(limit, 1 << 12);
+      std::atomic<bool> doMatch = true;
+      std::vector<std::thread> readers;
+      for (size_t t = 0; t < std::max(2u, std::thread::hardware_concurrency()); t++) {
+        readers.emplace_back([&, t]() {
+          std::mt19937_64 random(t);
+          for (size_t i = 0; i < 10000; i++) {
+            uint64_t n = random() % limit;
+            if (table.isPrime(n) != (n >= 2 && serialPrimes[n])) {
+              doMatch = false;
+            }
+          }
+          if (table.countPrimesUpTo(limit - 1) != 78498) {
+            doMatch = false;
+          }
+        });
+      }
+      for (auto &reader : readers) {
+        reader.join();
+      }
+      test::ok(doMatch, "Every reader sees the same primes");
+    });
+
+    test::describe("pool jobs can query while a cold pi(x) fills the table", [&]() {
+      PrimeTable table(limit, 1 << 12);
+      const uint64_t middle = limit / 2;
+      const uint64_t expected =
+          std::count(serialPrimes.begin() + 2, serialPrimes.begin() + middle + 1, 1);
+      std::atomic<bool> isCounting = false;
+      std::atomic<bool> doMatch = true;
+      std::thread counter;
+      auto task = [&](size_t aTask) {
+        if (aTask == 0) {
+          // Force a cold pi(x) on another thread while this job holds the pool.
+          counter = std::thread([&]() {
+            isCounting = true;
+            if (table.countPrimesUpTo(limit - 1) != 78498) {
+              doMatch = false;
+            }
+          });
+          while (!isCounting) {
+            std::this_thread::yield();
+          }
+          std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        if (table.countPrimesUpTo(middle) != expected) {
+          doMatch = false;
+        }
+      };
+      parallel::ThreadPool::global().run(8, task);
+      counter.join();
+      test::ok(doMatch, "Both the job and the other thread finish");
+    });
+
+    test::describe("benchmark a random query mix", []() {
+      const uint64_t tableLimit = 100000000;
+      const size_t queryCount = 100000;
+      PrimeTable table(tableLimit);
+      std::mt19937_64 random(0);
+      std::vector<PrimeTable::Query> queries;
+      for (size_t i = 0; i < queryCount; i++) {
+        auto kind = static_cast<PrimeTable::QueryKind>(random() % 4);
+        uint64_t a = random() % tableLimit;
+        uint64_t b = std::min(tableLimit - 1, a + random() % 1000000);
+        if (kind == PrimeTable::QueryKind::NthPrime) {
+          a = a / 20;
+        }
+        queries.push_back({kind, a, b});
+      }
+
+      // Prime the table so that every query is answered from cached segments.
+      table.countPrimesUpTo(tableLimit - 1);
+
+      auto benchmarkQueries = [&](const std::string &label,
+                                  const std::vector<PrimeTable::Query> &aQueries) {
+        size_t next = 0;
+        test::benchmark(label, [&]() {
+          const auto &query = aQueries[next++ % aQueries.size()];
+          uint64_t result = 0;
+          table.answer(Span{&query, 1}, Span{&result, 1});
+          test::DoNotOptimize(result);
+        });
+      };
+      const char *kindNames[] = {"isPrime", "pi(x)", "count in range", "nth prime"};
+      for (size_t kind = 0; kind < 4; kind++) {
+        std::vector<PrimeTable::Query> ofKind;
+        for (const auto &query : queries) {
+          if (static_cast<size_t>(query.kind) == kind) {
+            ofKind.push_back(query);
+          }
+        }
+        benchmarkQueries(std::string(kindNames[kind]) + " queries", ofKind);
+      }
+      benchmarkQueries("mixed queries, one at a time", queries);
+
+      std::vector<uint64_t> results(queries.size());
+      test::BenchmarkOptions options;
+      options.samples = 5;
+      test::benchmark(
+          "mixed queries, answered as a batch of " + std::to_string(queryCount),
+          [&]() { table.answer(Span{queries}, Span{results}); }, options);
+    });
+  });
+
   test::suite("features::threads", []() {
     test::describe("Created a thread", []() {
       std::thread thread(fn);
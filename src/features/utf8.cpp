@@ -1,159 +1,894 @@
 #include "../test.h"
+#include "./parallel.h"
+#include "./utf8_case_fold_table.h"
 #include "./utf8_codepoints.h"
+#include "./utf8_grapheme_table.h"
+#include "./utf8_simd.h"
+#include "mfbt/AllocPolicy.h"
+#include "mfbt/BufferList.h"
 #include "mfbt/Maybe.h"
 #include "mfbt/Result.h"
 #include "mfbt/ResultVariant.h"
 #include "mfbt/Span.h"
 #include "mfbt/UniquePtr.h"
 #include "mfbt/Vector.h"
+#include "unicode/brkiter.h"
+#include "unicode/uchar.h"
+#include "unicode/unistr.h"
+#include "unicode/ustring.h"
+#include "unicode/utext.h"
 #include <cassert>
+#include <codecvt>
+#include <fcntl.h>
+#include <locale>
+#include <random>
+#include <string>
 #include <string_view>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 namespace features::utf8 {
 using namespace mozilla;
 
+enum class Utf8Error { InvalidEncoding };
+
+// | Code Points        | Bytes                                        |
+// |--------------------|----------------------------------------------|
+// |  First    Last     |                                              |
+// |  U+0000   U+007F   | 0xxxxxxx    -           -           -        |
+// |  U+0080   U+07FF   | 110xxxxx    10xxxxxx    -           -        |
+// |  U+0800   U+FFFF   | 1110xxxx    10xxxxxx    10xxxxxx    -        |
+// |  U+10000  U+10FFFF | 11110xxx    10xxxxxx    10xxxxxx    10xxxxxx |
+//
+// On top of the bit patterns, overlong encodings, surrogates, and anything above
+// U+10FFFF are invalid. See utf8_simd.cpp for the details.
+static Result<Ok, Utf8Error> Validate(Span<const uint8_t> aData) {
+  if (!simd::IsValidUtf8(aData)) {
+    return Err(Utf8Error::InvalidEncoding);
+  }
+  return Ok();
+}
+
+// The offset of the start of the first invalid sequence.
+struct Utf8ErrorOffset {
+  size_t offset;
+};
+
 /**
- * A custom string-handling class with UTF-8 support.
+ * Validate and count the code points of a large buffer on a thread pool, returning
+ * the code point count. The buffer is split into chunks of about aGrain bytes.
+ *
+ * The chunks can't split a sequence in two, so their boundaries are moved forward
+ * past any continuation bytes, which resynchronizes on the start of the next
+ * sequence. A sequence has at most 3 continuation bytes, so more than that is an
+ * error anyway, and the boundary stops after 3. The chunks are then merged in
+ * order, and the first chunk with an error has the first error in the buffer, as
+ * every chunk before it was valid up to its end.
  */
-class UTF8 final {
+static Result<size_t, Utf8ErrorOffset>
+ValidateAndCountInParallel(Span<const uint8_t> aData,
+                           parallel::ThreadPool &aPool = parallel::ThreadPool::global(),
+                           size_t aGrain = 1 << 20) {
+  auto boundary = [&](size_t aOffset) {
+    for (size_t i = 0; i < 3 && aOffset < aData.Length(); i++, aOffset++) {
+      if ((aData[aOffset] & 0xc0) != 0x80) {
+        break;
+      }
+    }
+    return aOffset;
+  };
+
+  struct Scan {
+    bool isValid;
+    // The end of the valid text, which is the error offset when it's invalid.
+    size_t validEnd;
+    size_t codePointCount;
+  };
+  Scan scan = parallel::parallel_reduce(
+      aPool, parallel::Range{0, aData.Length()}, aGrain, Scan{true, 0, 0},
+      [&](parallel::Range aRange) {
+        size_t start = aRange.begin == 0 ? 0 : boundary(aRange.begin);
+        size_t end = boundary(aRange.end);
+        if (start >= end) {
+          return Scan{true, end, 0};
+        }
+        auto chunk = aData.FromTo(start, end);
+        if (!simd::IsValidUtf8(chunk)) {
+          return Scan{false, start + simd::ValidUtf8PrefixLength(chunk), 0};
+        }
+        return Scan{true, end, simd::CountCodePoints(chunk)};
+      },
+      [](Scan aLeft, Scan aRight) {
+        if (!aLeft.isValid) {
+          return aLeft;
+        }
+        aRight.codePointCount += aLeft.codePointCount;
+        return aRight;
+      });
+  if (!scan.isValid) {
+    return Err(Utf8ErrorOffset{scan.validEnd});
+  }
+  return scan.codePointCount;
+}
+
+static Span<const uint8_t> BytesOfCString(const char *aCString) {
+  static_assert(sizeof(char) == sizeof(uint8_t),
+                "The UTF8 class expects char to be the same size as uint8_t.");
+  return Span{reinterpret_cast<const uint8_t *>(aCString), strlen(aCString)};
+}
+
+/**
+ * Iterate over the code points of UTF-8 that has already been validated.
+ */
+class CodePointIter {
 public:
-  // Move only
-  UTF8(UTF8 &&other) = default;
-  UTF8 &operator=(UTF8 &&other) = default;
+  explicit CodePointIter(Span<const uint8_t> aData) : mData(aData) {}
 
-  enum class Error { InvalidEncoding };
+  Maybe<uint32_t> Next() {
+    if (mIndex == mData.Length()) {
+      return Nothing{};
+    }
+    if (mIndex < mAsciiEnd) {
+      return Some(static_cast<uint32_t>(mData[mIndex++]));
+    }
+    if (mData[mIndex] < 0x80) {
+      // Find where this run of ASCII ends, so that the rest of the run can be
+      // returned straight away.
+      mAsciiEnd = mIndex + simd::AsciiPrefixLength(mData.From(mIndex));
+      return Some(static_cast<uint32_t>(mData[mIndex++]));
+    }
+    uint8_t first_byte = mData[mIndex++];
+    uint8_t out[4]{0, 0, 0, 0};
 
-  static Result<UTF8, Error> TryCreate(const char *aCString) {
-    size_t len = strlen(aCString);
-    static_assert(sizeof(char) == sizeof(uint8_t),
-                  "The UTF8 class expects char to be the same size as uint8_t.");
-    return TryCreate(Span{reinterpret_cast<const uint8_t *>(aCString), len});
+    if (first_byte >> 5 == 0b110) {
+      uint8_t a = first_byte & 0b00011111;
+      uint8_t b = mData[mIndex++] & 0b00111111;
+
+      out[0] = (b & 0b00111111) | (a << 6);
+      out[1] = a >> 2;
+    } else if (first_byte >> 4 == 0b1110) {
+      uint8_t a = first_byte & 0b00001111;
+      uint8_t b = mData[mIndex++] & 0b00111111;
+      uint8_t c = mData[mIndex++] & 0b00111111;
+
+      out[0] = c | (b << 6);
+      out[1] = (b >> 2) | a << 4;
+    } else if (first_byte >> 3 == 0b11110) {
+      uint8_t a = first_byte & 0b00000111;
+      uint8_t b = mData[mIndex++] & 0b00111111;
+      uint8_t c = mData[mIndex++] & 0b00111111;
+      uint8_t d = mData[mIndex++] & 0b00111111;
+      out[0] = d | (c << 6);
+      out[1] = (c >> 2) | b << 4;
+      out[2] = (a << 2) | b >> 4;
+
+    } else {
+      out[0] = first_byte;
+    }
+
+    assert(mIndex <= mData.Length());
+
+    if constexpr (std::endian::native == std::endian::big) {
+      return Some((out[0] << 24) | (out[1] << 16) | (out[2] << 8) | out[3]);
+    } else {
+      return Some((out[3] << 24) | (out[2] << 16) | (out[1] << 8) | out[0]);
+    }
   }
 
-  static Result<UTF8, Error> TryCreate(Span<const uint8_t> aData) {
-    // Validate the ascii
+private:
+  Span<const uint8_t> mData;
+  size_t mIndex = 0;
+  // The end of the run of ASCII that mIndex is in.
+  size_t mAsciiEnd = 0;
+};
 
-    // | Code Points        | Bytes                                        |
-    // |--------------------|----------------------------------------------|
-    // |  First    Last     |                                              |
-    // |  U+0000   U+007F   | 0xxxxxxx    -           -           -        |
-    // |  U+0080   U+07FF   | 110xxxxx    10xxxxxx    -           -        |
-    // |  U+0800   U+FFFF   | 1110xxxx    10xxxxxx    10xxxxxx    -        |
-    // |  U+10000  U+10FFFF | 11110xxx    10xxxxxx    10xxxxxx    10xxxxxx |
+/**
+ * Breadcrumbs into valid UTF-8, which record the byte offset of every STRIDE-th
+ * code point. Finding a code point then only needs to walk from the breadcrumb
+ * before it, instead of from the start of the text.
+ */
+class CodePointIndex {
+public:
+  static constexpr size_t STRIDE = 64;
 
-    size_t expectedBytes = 0;
-    for (const uint8_t &byte : aData) {
-      if (expectedBytes > 0) {
-        if (byte >> 6 != 0b10) {
-          return Err(Error::InvalidEncoding);
+  explicit CodePointIndex(Span<const uint8_t> aData) {
+    // Count a block at a time, which can't hold more than one breadcrumb as every
+    // code point is at least a byte. Only look at the bytes in the blocks that have
+    // a breadcrumb in them.
+    constexpr size_t BLOCK_SIZE = STRIDE;
+    size_t count = 0;
+    for (size_t start = 0; start < aData.Length(); start += BLOCK_SIZE) {
+      auto block = aData.Subspan(start, std::min(BLOCK_SIZE, aData.Length() - start));
+      size_t blockCount = simd::CountCodePoints(block);
+      size_t nextCrumb = mOffsets.length() * STRIDE;
+      if (count + blockCount > nextCrumb) {
+        size_t index = count;
+        for (size_t i = 0; i < block.Length(); i++) {
+          if (!IsContinuation(block[i]) && index++ == nextCrumb) {
+            MOZ_RELEASE_ASSERT(mOffsets.append(start + i));
+            break;
+          }
         }
-        expectedBytes--;
-        continue;
-      }
-      if (byte >> 7 == 0b0) {
-        // Valid ASCII
-        continue;
-      }
-      if (byte >> 5 == 0b110) {
-        expectedBytes = 1;
-      }
-      if (byte >> 4 == 0b1110) {
-        expectedBytes = 2;
-      }
-      if (byte >> 3 == 0b11110) {
-        expectedBytes = 3;
       }
+      count += blockCount;
+    }
+    mCodePointCount = count;
+  }
+
+  size_t CodePointCount() const { return mCodePointCount; }
+
+  // The byte offset of a code point, where the code point count is the end.
+  size_t ByteOffset(Span<const uint8_t> aData, size_t aCodePoint) const {
+    assert(aCodePoint <= mCodePointCount);
+    if (aCodePoint == mCodePointCount) {
+      return aData.Length();
     }
-    if (expectedBytes > 0) {
-      // No bytes should be remaining.
+    size_t offset = mOffsets[aCodePoint / STRIDE];
+    for (size_t i = aCodePoint % STRIDE; i > 0; i--) {
+      offset += SequenceLength(aData[offset]);
+    }
+    return offset;
+  }
+
+private:
+  static bool IsContinuation(uint8_t aByte) { return (aByte & 0xc0) == 0x80; }
+
+  static size_t SequenceLength(uint8_t aLead) {
+    return 1 + (aLead >= 0xc0) + (aLead >= 0xe0) + (aLead >= 0xf0);
+  }
+
+  Vector<size_t> mOffsets;
+  size_t mCodePointCount = 0;
+};
+
+class GraphemeIter;
+
+/**
+ * Borrowed UTF-8 text that has been validated in place, without copying it. The
+ * bytes must outlive the view.
+ */
+class Utf8View final {
+public:
+  using Error = Utf8Error;
+
+  static Result<Utf8View, Error> TryCreate(const char *aCString) {
+    return TryCreate(BytesOfCString(aCString));
+  }
+
+  static Result<Utf8View, Error> TryCreate(Span<const uint8_t> aData) {
+    MOZ_TRY(Validate(aData));
+    return Utf8View(aData);
+  }
+
+  // Validate a large buffer on the shared thread pool instead.
+  static Result<Utf8View, Error> TryCreateInParallel(Span<const uint8_t> aData) {
+    if (ValidateAndCountInParallel(aData).isErr()) {
       return Err(Error::InvalidEncoding);
     }
-    return UTF8(aData);
+    return Utf8View(aData);
   }
 
-  bool IsAscii() const {
-    for (const uint8_t &byte : mData) {
-      if (byte >> 7 != 0b0) {
-        return false;
+  bool IsAscii() const { return simd::IsAscii(mData); }
+
+  size_t Length() const { return mData.Length(); }
+
+  Span<const uint8_t> Bytes() const { return mData; }
+
+  std::string_view GetStringView() const {
+    return std::string_view{reinterpret_cast<const char *>(mData.Elements()),
+                            mData.Length()};
+  }
+
+  CodePointIter Iter() const { return CodePointIter(mData); }
+
+  GraphemeIter Graphemes() const;
+
+  // Compare while only ignoring the case of the ASCII letters, which is what
+  // protocols like HTTP use for header names. This works a vector at a time.
+  bool EqualsIgnoringAsciiCase(Utf8View aOther) const {
+    return simd::EqualsIgnoringAsciiCase(mData, aOther.mData);
+  }
+  bool StartsWithIgnoringAsciiCase(Utf8View aPrefix) const {
+    return simd::StartsWithIgnoringAsciiCase(mData, aPrefix.mData);
+  }
+
+  // Compare with the Unicode simple case folding, so that "ΣΑΣ" equals "σας". The
+  // simple folding maps one code point to one, so "ß" doesn't equal "ss".
+  bool EqualsIgnoringCase(Utf8View aOther) const {
+    const uint8_t *left = mData.Elements();
+    const uint8_t *right = aOther.mData.Elements();
+    size_t leftLength = mData.Length();
+    size_t rightLength = aOther.mData.Length();
+    size_t i = 0;
+    size_t j = 0;
+    while (true) {
+      // Skip over the bytes that match a vector at a time, which is most of them
+      // when the text is mostly the same.
+      size_t same = simd::CommonPrefixLengthIgnoringAsciiCase(mData.From(i),
+                                                             aOther.mData.From(j));
+      i += same;
+      j += same;
+      if (i == leftLength || j == rightLength) {
+        // Folding never changes the number of code points, so the text can't
+        // match when one side has more of them.
+        return i == leftLength && j == rightLength;
+      }
+      // The bytes can differ partway through a sequence, such as with "é" and "É",
+      // so back up to the start of the sequences. The bytes before are the same,
+      // so both sides start their sequences at the same place.
+      while (same > 0 && (left[i] & 0xc0) == 0x80) {
+        i--;
+        j--;
+        same--;
       }
+      // Fold a code point at a time for as long as the next few bytes differ, which
+      // is all of the time when the text is in different cases.
+      auto nextBytesDiffer = [&]() {
+        uint32_t leftBytes;
+        uint32_t rightBytes;
+        if (i + sizeof(uint32_t) > leftLength || j + sizeof(uint32_t) > rightLength) {
+          return i < leftLength && j < rightLength;
+        }
+        memcpy(&leftBytes, left + i, sizeof(uint32_t));
+        memcpy(&rightBytes, right + j, sizeof(uint32_t));
+        return leftBytes != rightBytes;
+      };
+      do {
+        char32_t leftCodePoint;
+        char32_t rightCodePoint;
+        i += simd::DecodeCodePoint(left + i, leftCodePoint);
+        j += simd::DecodeCodePoint(right + j, rightCodePoint);
+        if (tables::SimpleCaseFold(leftCodePoint) !=
+            tables::SimpleCaseFold(rightCodePoint)) {
+          return false;
+        }
+      } while (nextBytesDiffer());
     }
-    return true;
   }
 
-  std::string_view GetStringView() const {
-    return std::string_view{reinterpret_cast<const char *>(mData.begin()),
-                            mData.length()};
-  }
-
-  class CodePointIter {
-  public:
-    explicit CodePointIter(UTF8 &aUtf8) : mUtf8(aUtf8) {}
-
-    Maybe<uint32_t> Next() {
-      if (mIndex == mUtf8.mData.length()) {
-        return Nothing{};
-      }
-      uint8_t first_byte = mUtf8.mData[mIndex++];
-      uint8_t out[4]{0, 0, 0, 0};
-
-      if (first_byte >> 5 == 0b110) {
-        uint8_t a = first_byte & 0b00011111;
-        uint8_t b = mUtf8.mData[mIndex++] & 0b00111111;
-
-        out[0] = (b & 0b00111111) | (a << 6);
-        out[1] = a >> 2;
-      } else if (first_byte >> 4 == 0b1110) {
-        uint8_t a = first_byte & 0b00001111;
-        uint8_t b = mUtf8.mData[mIndex++] & 0b00111111;
-        uint8_t c = mUtf8.mData[mIndex++] & 0b00111111;
-
-        out[0] = c | (b << 6);
-        out[1] = (b >> 2) | a << 4;
-      } else if (first_byte >> 3 == 0b11110) {
-        uint8_t a = first_byte & 0b00000111;
-        uint8_t b = mUtf8.mData[mIndex++] & 0b00111111;
-        uint8_t c = mUtf8.mData[mIndex++] & 0b00111111;
-        uint8_t d = mUtf8.mData[mIndex++] & 0b00111111;
-        out[0] = d | (c << 6);
-        out[1] = (c >> 2) | b << 4;
-        out[2] = (a << 2) | b >> 4;
+  // Decode all of the text at once, which is much faster than iterating over it.
+  // The output must be at least as long as the text in bytes. Returns the number of
+  // code units that were written.
+  size_t DecodeToUtf32(Span<char32_t> aDest) const {
+    return simd::Utf8ToUtf32(mData, aDest);
+  }
+  size_t TranscodeToUtf16(Span<char16_t> aDest) const {
+    return simd::Utf8ToUtf16(mData, aDest);
+  }
 
-      } else {
-        out[0] = first_byte;
+private:
+  explicit Utf8View(Span<const uint8_t> aData) : mData(aData) {}
+
+  Span<const uint8_t> mData;
+
+  friend class UTF8;
+  friend class GraphemeIter;
+  friend class Utf8File;
+};
+
+/**
+ * Iterate over the extended grapheme clusters of valid UTF-8, which are what a
+ * reader would think of as a single character. This follows the rules in UAX #29:
+ * https://www.unicode.org/reports/tr29/#Grapheme_Cluster_Boundary_Rules
+ *
+ * The properties come from the generated tables in utf8_grapheme_table.h, which
+ * should be regenerated with make-unicode-tables.sh when ICU is updated.
+ */
+class GraphemeIter {
+public:
+  explicit GraphemeIter(Utf8View aView) : mData(aView.mData) {}
+
+  Maybe<Utf8View> Next() {
+    size_t length = mData.Length();
+    if (mIndex == length) {
+      return Nothing{};
+    }
+    size_t start = mIndex;
+    const uint8_t *data = mData.Elements();
+
+    // Two ASCII characters in a row always have a boundary between them, unless
+    // they are a CR LF.
+    if (data[start] < 0x80 &&
+        (start + 1 == length || (data[start + 1] < 0x80 &&
+                                 !(data[start] == '\r' && data[start + 1] == '\n')))) {
+      mIndex++;
+      return Some(Utf8View(mData.FromTo(start, mIndex)));
+    }
+
+    char32_t codePoint;
+    mIndex += simd::DecodeCodePoint(data + mIndex, codePoint);
+    State state;
+    state.Push(tables::GraphemeProperties(codePoint));
+    while (mIndex < length) {
+      size_t sequenceLength = simd::DecodeCodePoint(data + mIndex, codePoint);
+      uint8_t properties = tables::GraphemeProperties(codePoint);
+      if (state.IsBoundaryBefore(properties)) {
+        break;
       }
+      state.Push(properties);
+      mIndex += sequenceLength;
+    }
+    return Some(Utf8View(mData.FromTo(start, mIndex)));
+  }
 
-      assert(mIndex <= mUtf8.mData.length());
+private:
+  using Break = tables::GraphemeBreak;
 
-      if constexpr (std::endian::native == std::endian::big) {
-        return Some((out[0] << 24) | (out[1] << 16) | (out[2] << 8) | out[3]);
+  // What is known about the code points in the cluster so far.
+  struct State {
+    Break mPrevious = Break::Other;
+    // The cluster so far ends with Extended_Pictographic Extend*.
+    bool mInEmoji = false;
+    // The cluster so far ends with Extended_Pictographic Extend* ZWJ.
+    bool mAfterEmojiZwj = false;
+    // How many regional indicators the cluster so far ends with.
+    size_t mRegionalIndicators = 0;
+    // The cluster so far ends with an Indic consonant and then combining marks.
+    bool mInConjunct = false;
+    // The same, but with a virama in the combining marks.
+    bool mAfterLinker = false;
+
+    void Push(uint8_t aProperties) {
+      Break category = CategoryOf(aProperties);
+      mAfterEmojiZwj = mInEmoji && category == Break::ZWJ;
+      mInEmoji = (aProperties & tables::EXTENDED_PICTOGRAPHIC) ||
+                 (mInEmoji && category == Break::Extend);
+      mRegionalIndicators =
+          category == Break::RegionalIndicator ? mRegionalIndicators + 1 : 0;
+      if (aProperties & tables::CONJUNCT_CONSONANT) {
+        mInConjunct = true;
+        mAfterLinker = false;
+      } else if (mInConjunct && (aProperties & tables::CONJUNCT_EXTEND)) {
+        mAfterLinker = mAfterLinker || (aProperties & tables::CONJUNCT_LINKER);
       } else {
-        return Some((out[3] << 24) | (out[2] << 16) | (out[1] << 8) | out[0]);
+        mInConjunct = false;
+        mAfterLinker = false;
+      }
+      mPrevious = category;
+    }
+
+    bool IsBoundaryBefore(uint8_t aProperties) const {
+      Break next = CategoryOf(aProperties);
+      // GB3, GB4 and GB5
+      if (mPrevious == Break::CR && next == Break::LF) {
+        return false;
+      }
+      if (IsControl(mPrevious) || IsControl(next)) {
+        return true;
+      }
+      // GB6, GB7 and GB8 keep Hangul syllables together.
+      if (mPrevious == Break::L && (next == Break::L || next == Break::V ||
+                                    next == Break::LV || next == Break::LVT)) {
+        return false;
+      }
+      if ((mPrevious == Break::LV || mPrevious == Break::V) &&
+          (next == Break::V || next == Break::T)) {
+        return false;
+      }
+      if ((mPrevious == Break::LVT || mPrevious == Break::T) && next == Break::T) {
+        return false;
+      }
+      // GB9, GB9a and GB9b
+      if (next == Break::Extend || next == Break::ZWJ || next == Break::SpacingMark ||
+          mPrevious == Break::Prepend) {
+        return false;
+      }
+      // GB9c keeps Indic conjuncts together. This is in ICU ahead of Unicode 15.1.
+      if (mAfterLinker && (aProperties & tables::CONJUNCT_CONSONANT)) {
+        return false;
       }
+      // GB11 keeps emoji ZWJ sequences together.
+      if (mAfterEmojiZwj && (aProperties & tables::EXTENDED_PICTOGRAPHIC)) {
+        return false;
+      }
+      // GB12 and GB13 pair up regional indicators into flags.
+      if (next == Break::RegionalIndicator && mRegionalIndicators % 2 == 1) {
+        return false;
+      }
+      // GB999
+      return true;
+    }
+
+    static Break CategoryOf(uint8_t aProperties) {
+      return static_cast<Break>(aProperties & tables::CATEGORY_MASK);
     }
 
-  private:
-    UTF8 &mUtf8;
-    size_t mIndex = 0;
+    static bool IsControl(Break aCategory) {
+      return aCategory == Break::CR || aCategory == Break::LF ||
+             aCategory == Break::Control;
+    }
   };
 
-  CodePointIter Iter() { return CodePointIter(*this); }
+  Span<const uint8_t> mData;
+  size_t mIndex = 0;
+};
+
+inline GraphemeIter Utf8View::Graphemes() const { return GraphemeIter(*this); }
+
+/**
+ * A custom string-handling class with UTF-8 support.
+ */
+class UTF8 final {
+public:
+  // Move only
+  UTF8(UTF8 &&other) = default;
+  UTF8 &operator=(UTF8 &&other) = default;
+
+  using Error = Utf8Error;
+  using CodePointIter = utf8::CodePointIter;
+
+  static Result<UTF8, Error> TryCreate(const char *aCString) {
+    return TryCreate(BytesOfCString(aCString));
+  }
+
+  static Result<UTF8, Error> TryCreate(Span<const uint8_t> aData) {
+    MOZ_TRY(Validate(aData));
+    return UTF8(aData);
+  }
+
+  // Validate a large buffer on the shared thread pool instead.
+  static Result<UTF8, Error> TryCreateInParallel(Span<const uint8_t> aData) {
+    if (ValidateAndCountInParallel(aData).isErr()) {
+      return Err(Error::InvalidEncoding);
+    }
+    return UTF8(aData);
+  }
+
+  // Append text that is validated first. On failure the string is left unchanged.
+  Result<Ok, Error> Append(Span<const uint8_t> aData) {
+    MOZ_TRY(Validate(aData));
+    AppendBytes(aData);
+    return Ok();
+  }
+
+  // Appending a view skips validation, as the view has already been validated.
+  void Append(Utf8View aView) { AppendBytes(aView.mData); }
+
+  bool IsAscii() const { return AsView().IsAscii(); }
+
+  std::string_view GetStringView() const { return AsView().GetStringView(); }
+
+  Utf8View AsView() const { return Utf8View(Span{mData.begin(), mData.length()}); }
+
+  CodePointIter Iter() const { return AsView().Iter(); }
+
+  GraphemeIter Graphemes() const { return AsView().Graphemes(); }
+
+  bool EqualsIgnoringAsciiCase(Utf8View aOther) const {
+    return AsView().EqualsIgnoringAsciiCase(aOther);
+  }
+  bool StartsWithIgnoringAsciiCase(Utf8View aPrefix) const {
+    return AsView().StartsWithIgnoringAsciiCase(aPrefix);
+  }
+  bool EqualsIgnoringCase(Utf8View aOther) const {
+    return AsView().EqualsIgnoringCase(aOther);
+  }
+
+  // The random access methods build a CodePointIndex the first time they are
+  // used, so the first call is O(n), and the rest are O(CodePointIndex::STRIDE).
+  // This makes them unsafe to call from multiple threads at the same time.
+  size_t CodePointLength() const { return GetCodePointIndex().CodePointCount(); }
+
+  Maybe<uint32_t> CodePointAt(size_t aIndex) const {
+    if (aIndex >= CodePointLength()) {
+      return Nothing{};
+    }
+    auto data = AsView().Bytes();
+    return CodePointIter(data.From(GetCodePointIndex().ByteOffset(data, aIndex))).Next();
+  }
+
+  // A view of aLength code points from aStart, or to the end when there are fewer.
+  Maybe<Utf8View> SubstringByCodePoints(size_t aStart, size_t aLength) const {
+    const CodePointIndex &index = GetCodePointIndex();
+    if (aStart > index.CodePointCount()) {
+      return Nothing{};
+    }
+    size_t end = aStart + std::min(aLength, index.CodePointCount() - aStart);
+    auto data = AsView().Bytes();
+    size_t startOffset = index.ByteOffset(data, aStart);
+    size_t endOffset = index.ByteOffset(data, end);
+    return Some(Utf8View(data.FromTo(startOffset, endOffset)));
+  }
+
+  size_t DecodeToUtf32(Span<char32_t> aDest) const {
+    return AsView().DecodeToUtf32(aDest);
+  }
+  size_t TranscodeToUtf16(Span<char16_t> aDest) const {
+    return AsView().TranscodeToUtf16(aDest);
+  }
 
 private:
-  explicit UTF8(Span<const uint8_t> aData) {
-    if (!mData.reserve(aData.size())) {
-      return;
-    };
+  explicit UTF8(Span<const uint8_t> aData) { AppendBytes(aData); }
+
+  const CodePointIndex &GetCodePointIndex() const {
+    if (!mCodePointIndex) {
+      mCodePointIndex.emplace(AsView().Bytes());
+    }
+    return *mCodePointIndex;
+  }
 
-    for (const auto &datum : aData) {
-      mData.infallibleAppend(datum);
+  // Copy the bytes with a single memcpy rather than appending them one at a time.
+  void AppendBytes(Span<const uint8_t> aData) {
+    if (aData.IsEmpty()) {
+      return;
     }
+    mCodePointIndex.reset();
+    if (!mData.growByUninitialized(aData.Length())) {
+      MOZ_CRASH("Out of memory");
+    }
+    memcpy(mData.end() - aData.Length(), aData.Elements(), aData.Length());
   }
 
   Vector<uint8_t> mData;
+  mutable Maybe<CodePointIndex> mCodePointIndex;
+};
+
+/**
+ * A file of UTF-8 text that is mapped into memory read-only, rather than read into
+ * a buffer. The text is validated once when it's opened, and then viewed in place,
+ * so a large file is never copied. The pages are only read in from the file as
+ * they are touched, and MADV_SEQUENTIAL lets the kernel read ahead and drop the
+ * pages behind the validator as it goes.
+ */
+class Utf8File final {
+public:
+  enum class Error { CantOpen, CantMap, InvalidEncoding };
+
+  static Result<Utf8File, Error> Open(const char *aPath) {
+    int fd = open(aPath, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      return Err(Error::CantOpen);
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0) {
+      close(fd);
+      return Err(Error::CantOpen);
+    }
+    size_t length = static_cast<size_t>(info.st_size);
+    if (length == 0) {
+      // An empty file can't be mapped, but it's still valid text.
+      close(fd);
+      return Utf8File(nullptr, 0);
+    }
+    void *mapping = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    // The mapping keeps its own reference to the file.
+    close(fd);
+    if (mapping == MAP_FAILED) {
+      return Err(Error::CantMap);
+    }
+    // This is only a hint, so it doesn't matter if it fails.
+    madvise(mapping, length, MADV_SEQUENTIAL);
+
+    Utf8File file(static_cast<const uint8_t *>(mapping), length);
+    if (!simd::IsValidUtf8(file.Bytes())) {
+      return Err(Error::InvalidEncoding);
+    }
+    return file;
+  }
+
+  Utf8File(Utf8File &&aOther)
+      : mData(std::exchange(aOther.mData, nullptr)),
+        mLength(std::exchange(aOther.mLength, 0)) {}
+
+  Utf8File &operator=(Utf8File &&aOther) {
+    if (this != &aOther) {
+      Unmap();
+      mData = std::exchange(aOther.mData, nullptr);
+      mLength = std::exchange(aOther.mLength, 0);
+    }
+    return *this;
+  }
+
+  ~Utf8File() { Unmap(); }
+
+  size_t Length() const { return mLength; }
+
+  Span<const uint8_t> Bytes() const { return Span{mData, mLength}; }
+
+  // The view is only valid for as long as the file is open.
+  Utf8View AsView() const { return Utf8View(Bytes()); }
 
-  friend class CodePointIter;
+private:
+  Utf8File(const uint8_t *aData, size_t aLength) : mData(aData), mLength(aLength) {}
+
+  void Unmap() {
+    if (mData) {
+      munmap(const_cast<uint8_t *>(mData), mLength);
+    }
+  }
+
+  const uint8_t *mData;
+  size_t mLength;
 };
 
+/**
+ * Validate UTF-8 that arrives in chunks, such as from the network, without
+ * buffering it up first. A sequence that is split between two chunks is carried
+ * over to the next call to Feed.
+ */
+class Utf8StreamValidator final {
+public:
+  struct Error {
+    // The offset in the whole stream of the start of the first invalid sequence.
+    size_t offset;
+  };
+
+  Result<Ok, Error> Feed(Span<const uint8_t> aChunk) {
+    if (mError) {
+      return Err(*mError);
+    }
+    if (mPendingLength > 0) {
+      MOZ_TRY_VAR(aChunk, FeedPending(aChunk));
+      if (mPendingLength > 0) {
+        // The whole chunk went into the pending sequence, which still isn't done.
+        return Ok();
+      }
+    }
+
+    // Hold back a sequence at the end that's not complete yet.
+    size_t pendingLength = IncompleteSuffixLength(aChunk);
+    auto complete = aChunk.To(aChunk.Length() - pendingLength);
+    size_t validLength = simd::ValidUtf8PrefixLength(complete);
+    if (validLength != complete.Length()) {
+      return Fail(mOffset + validLength);
+    }
+    mOffset += complete.Length();
+    memcpy(mPending, complete.Elements() + complete.Length(), pendingLength);
+    mPendingLength = pendingLength;
+    return Ok();
+  }
+
+  // Validate every segment of a BufferList, without copying them together.
+  template <typename AllocPolicy>
+  Result<Ok, Error> Feed(const BufferList<AllocPolicy> &aBuffers) {
+    for (auto iter = aBuffers.Iter(); !iter.Done();) {
+      size_t length = iter.RemainingInSegment();
+      MOZ_TRY(Feed(Span{reinterpret_cast<const uint8_t *>(iter.Data()), length}));
+      iter.Advance(aBuffers, length);
+    }
+    return Ok();
+  }
+
+  // The stream has ended, so it can't end in the middle of a sequence.
+  Result<Ok, Error> Finish() {
+    if (mError) {
+      return Err(*mError);
+    }
+    if (mPendingLength > 0) {
+      return Fail(mOffset);
+    }
+    return Ok();
+  }
+
+  // The number of bytes that have been validated so far.
+  size_t ValidLength() const { return mOffset; }
+
+private:
+  // The length of a sequence from its leading byte, or 0 for bytes that can't
+  // start a multi-byte sequence.
+  static size_t SequenceLength(uint8_t aLead) {
+    if (aLead >= 0xc2 && aLead <= 0xdf) {
+      return 2;
+    }
+    if (aLead >= 0xe0 && aLead <= 0xef) {
+      return 3;
+    }
+    if (aLead >= 0xf0 && aLead <= 0xf4) {
+      return 4;
+    }
+    return 0;
+  }
+
+  static size_t IncompleteSuffixLength(Span<const uint8_t> aChunk) {
+    // A sequence is at most 4 bytes, so only look at the last 3.
+    for (size_t back = 1; back <= std::min(aChunk.Length(), size_t(3)); back++) {
+      uint8_t byte = aChunk[aChunk.Length() - back];
+      if ((byte & 0xc0) != 0x80) {
+        return SequenceLength(byte) > back ? back : 0;
+      }
+    }
+    return 0;
+  }
+
+  // Complete the pending sequence from the start of the chunk, and return the rest.
+  Result<Span<const uint8_t>, Error> FeedPending(Span<const uint8_t> aChunk) {
+    size_t sequenceLength = SequenceLength(mPending[0]);
+    size_t taken = std::min(sequenceLength - mPendingLength, aChunk.Length());
+    memcpy(mPending + mPendingLength, aChunk.Elements(), taken);
+    mPendingLength += taken;
+
+    // Fill in any missing bytes with continuations so that what is there so far can
+    // be checked. The only constraints past the second byte are to be continuations.
+    uint8_t sequence[4];
+    memcpy(sequence, mPending, mPendingLength);
+    memset(sequence + mPendingLength, 0x80, sequenceLength - mPendingLength);
+    if (mPendingLength > 1 && !simd::IsValidUtf8(Span{sequence, sequenceLength})) {
+      return Fail(mOffset);
+    }
+    if (mPendingLength == sequenceLength) {
+      mOffset += sequenceLength;
+      mPendingLength = 0;
+    }
+    return aChunk.From(taken);
+  }
+
+  GenericErrorResult<Error> Fail(size_t aOffset) {
+    mError = Some(Error{aOffset});
+    return Err(*mError);
+  }
+
+  size_t mOffset = 0;
+  uint8_t mPending[4];
+  size_t mPendingLength = 0;
+  Maybe<Error> mError;
+};
+
+// Repeat some sample text until it's about the target size, which is used as a
+// corpus for the benchmarks.
+static std::string makeCorpus(const char *aSample, size_t aTargetSize) {
+  std::string corpus;
+  while (corpus.size() < aTargetSize) {
+    corpus += aSample;
+  }
+  return corpus;
+}
+
+static Span<const uint8_t> bytesOf(const std::string &aString) {
+  return Span{reinterpret_cast<const uint8_t *>(aString.data()), aString.size()};
+}
+
+// Write the text out to a new temporary file, and return its path.
+static std::string writeTempFile(const std::string &aText) {
+  char path[] = "/tmp/utf8-test-XXXXXX";
+  int fd = mkstemp(path);
+  MOZ_RELEASE_ASSERT(fd >= 0);
+  for (size_t written = 0; written < aText.size();) {
+    ssize_t result = write(fd, aText.data() + written, aText.size() - written);
+    MOZ_RELEASE_ASSERT(result > 0);
+    written += result;
+  }
+  close(fd);
+  return path;
+}
+
+static std::vector<simd::Isa> supportedIsas() {
+  std::vector<simd::Isa> isas;
+  for (auto isa : {simd::Isa::Scalar, simd::Isa::Ssse3, simd::Isa::Avx2}) {
+    if (simd::IsSupported(isa)) {
+      isas.push_back(isa);
+    }
+  }
+  return isas;
+}
+
+static std::vector<std::string> graphemesOf(Utf8View aView) {
+  std::vector<std::string> graphemes;
+  auto iter = aView.Graphemes();
+  while (auto grapheme = iter.Next()) {
+    graphemes.emplace_back(grapheme->GetStringView());
+  }
+  return graphemes;
+}
+
+// Split the text with ICU's BreakIterator, which is the reference implementation.
+static std::vector<std::string> icuGraphemesOf(const std::string &aText) {
+  UErrorCode status = U_ZERO_ERROR;
+  UText *text = utext_openUTF8(nullptr, aText.data(), aText.size(), &status);
+  UniquePtr<icu::BreakIterator> iter{
+      icu::BreakIterator::createCharacterInstance(icu::Locale::getRoot(), status)};
+  iter->setText(text, status);
+  MOZ_RELEASE_ASSERT(U_SUCCESS(status));
+  std::vector<std::string> graphemes;
+  int32_t start = iter->first();
+  for (int32_t end = iter->next(); end != icu::BreakIterator::DONE; end = iter->next()) {
+    graphemes.push_back(aText.substr(start, end - start));
+    start = end;
+  }
+  utext_close(text);
+  return graphemes;
+}
+
 void run_tests() {
   test::suite("features::utf8", []() {
     test::describe("basic ascii example", []() {
@@ -341,6 +1076,906 @@ void run_tests() {
       }
       test::ok(!iter.Next(), "Is nothing");
     });
+
+    test::describe("validation follows RFC 3629", []() {
+      struct Case {
+        const char *name;
+        std::string bytes;
+        bool isValid;
+      };
+      std::vector<Case> cases{
+          {"U+007F", "\x7f", true},
+          {"U+0080", "\xc2\x80", true},
+          {"U+07FF", "\xdf\xbf", true},
+          {"U+0800", "\xe0\xa0\x80", true},
+          {"U+D7FF before the surrogates", "\xed\x9f\xbf", true},
+          {"U+E000 after the surrogates", "\xee\x80\x80", true},
+          {"U+FFFF", "\xef\xbf\xbf", true},
+          {"U+10000", "\xf0\x90\x80\x80", true},
+          {"U+10FFFF", "\xf4\x8f\xbf\xbf", true},
+          {"overlong 2 byte encoding", "\xc0\xaf", false},
+          {"overlong 2 byte encoding with C1", "\xc1\xbf", false},
+          {"overlong 3 byte encoding", "\xe0\x80\xaf", false},
+          {"overlong 3 byte encoding of U+07FF", "\xe0\x9f\xbf", false},
+          {"overlong 4 byte encoding", "\xf0\x80\x80\xaf", false},
+          {"overlong 4 byte encoding of U+FFFF", "\xf0\x8f\xbf\xbf", false},
+          {"the first surrogate", "\xed\xa0\x80", false},
+          {"the last surrogate", "\xed\xbf\xbf", false},
+          {"U+110000", "\xf4\x90\x80\x80", false},
+          {"F5 leading byte", "\xf5\x80\x80\x80", false},
+          {"FF byte", "\xff", false},
+          {"leading continuation byte", "\x80", false},
+          {"stray continuation byte", "a\xbf", false},
+          {"too many continuation bytes", "\xc2\x80\x80", false},
+          {"truncated 2 byte sequence", "\xc2", false},
+          {"truncated 3 byte sequence", "\xe2\x82", false},
+          {"truncated 4 byte sequence", "\xf0\x9f\x98", false},
+          {"leading byte followed by ascii", "\xe2" "a\x82", false},
+      };
+
+      // Move each case through a block of ASCII so that it's tested at every
+      // position in the vectors, including across the boundary between two blocks.
+      for (const auto &testCase : cases) {
+        bool isCorrect = true;
+        for (auto isa : supportedIsas()) {
+          for (size_t offset = 0; offset < 70; offset++) {
+            for (size_t trailing : {0, 1, 40}) {
+              std::string text = std::string(offset, 'x') + testCase.bytes +
+                                 std::string(trailing, 'y');
+              if (simd::IsValidUtf8(bytesOf(text), isa) != testCase.isValid) {
+                isCorrect = false;
+              }
+            }
+          }
+        }
+        test::ok(isCorrect, std::string(testCase.isValid ? "Accepts " : "Rejects ") +
+                                testCase.name);
+      }
+      test::ok(UTF8::TryCreate("\xed\xa0\x80").isErr(), "TryCreate rejects surrogates");
+      test::ok(UTF8::TryCreate("\xc0\xaf").isErr(),
+               "TryCreate rejects overlong encodings");
+    });
+
+    test::describe("the validators agree on random mutations", []() {
+      std::string text = makeCorpus("Grüße, 世界! 👍😅 ascii text ", 200);
+      std::mt19937_64 random(0);
+      size_t disagreements = 0;
+      size_t validCount = 0;
+      for (size_t i = 0; i < 20000; i++) {
+        std::string mutated = text.substr(0, random() % text.size());
+        for (size_t j = random() % 3; j > 0 && !mutated.empty(); j--) {
+          mutated[random() % mutated.size()] = static_cast<char>(random());
+        }
+        bool expected = simd::IsValidUtf8(bytesOf(mutated), simd::Isa::Scalar);
+        validCount += expected;
+        for (auto isa : supportedIsas()) {
+          if (simd::IsValidUtf8(bytesOf(mutated), isa) != expected) {
+            disagreements++;
+          }
+        }
+      }
+      test::equal(disagreements, size_t(0), "Every implementation agrees with scalar");
+      test::ok(validCount > 1000 && validCount < 19000,
+               "The mutations have a mix of valid and invalid text");
+    });
+
+    test::describe("ascii fast path", []() {
+      bool isCorrect = true;
+      for (auto isa : supportedIsas()) {
+        for (size_t length = 0; length < 100; length++) {
+          for (size_t position = 0; position <= length; position++) {
+            std::string text(length, 'a');
+            if (position < length) {
+              text[position] = '\xc3';
+            }
+            if (simd::AsciiPrefixLength(bytesOf(text), isa) != position) {
+              isCorrect = false;
+            }
+          }
+        }
+      }
+      test::ok(isCorrect, "Finds the first non-ASCII byte at every position");
+      std::string text = makeCorpus("plain text ", 1000);
+      test::ok(UTF8::TryCreate(text.c_str()).unwrap().IsAscii(), "Long text is ASCII");
+      text += "é";
+      test::ok(!UTF8::TryCreate(text.c_str()).unwrap().IsAscii(),
+               "Long text ending in é is not ASCII");
+    });
+
+    test::describe("iterate over runs of ascii", []() {
+      std::string text = makeCorpus("Runs of ascii text, then é, then 👍 again. ", 500);
+      auto string = UTF8::TryCreate(text.c_str()).unwrap();
+      auto iter = string.Iter();
+      std::u32string expected =
+          std::wstring_convert<std::codecvt_utf8<char32_t>, char32_t>{}.from_bytes(text);
+      std::u32string codePoints;
+      while (auto codePoint = iter.Next()) {
+        codePoints.push_back(*codePoint);
+      }
+      test::ok(codePoints == expected, "The code points match the standard library");
+    });
+
+    test::describe("borrowed views", []() {
+      const char *text = "Grüße 👍";
+      auto view = Utf8View::TryCreate(text).unwrap();
+      test::ok(view.GetStringView().data() == text, "The view doesn't copy the text");
+      test::equal(view.Length(), strlen(text), "The view has the same length");
+      test::ok(!view.IsAscii(), "The view is not ASCII");
+
+      auto iter = view.Iter();
+      test::equal(iter.Next(), Some(static_cast<uint32_t>('G')));
+      test::equal(iter.Next(), Some(static_cast<uint32_t>('r')));
+      test::equal(iter.Next(), Some(static_cast<uint32_t>(0xfc)), "ü");
+
+      test::ok(Utf8View::TryCreate("\xe2\x82").unwrapErr() ==
+                   Utf8View::Error::InvalidEncoding,
+               "Invalid views are rejected");
+
+      auto string = UTF8::TryCreate("abc").unwrap();
+      auto stringView = string.AsView();
+      test::ok(stringView.GetStringView() == string.GetStringView(),
+               "An owned string can be viewed");
+    });
+
+    test::describe("appending", []() {
+      auto string = UTF8::TryCreate("Grüße").unwrap();
+      const char *world = ", 世界";
+      test::ok(string.Append(BytesOfCString(world)).isOk(), "Valid text can be appended");
+      string.Append(Utf8View::TryCreate("!").unwrap());
+      test::equal(string.GetStringView(), "Grüße, 世界!");
+
+      test::ok(string.Append(BytesOfCString("\xed\xa0\x80")).isErr(),
+               "Invalid text can't be appended");
+      test::equal(string.GetStringView(), "Grüße, 世界!",
+                  "The string is unchanged after a failed append");
+    });
+
+    test::describe("viewing is cheaper than copying", []() {
+      std::string text = makeCorpus("Mostly ascii text with a café in it. ", 1 << 20);
+      test::benchmark("create an owned UTF8", [&]() {
+        test::DoNotOptimize(UTF8::TryCreate(bytesOf(text)).unwrap());
+      });
+      test::benchmark("create a Utf8View", [&]() {
+        test::DoNotOptimize(Utf8View::TryCreate(bytesOf(text)).unwrap());
+      });
+    });
+
+    test::describe("bulk transcoding", []() {
+      std::string text = makeCorpus("ascii, Grüße, Ελληνικά, 世界, 👍😅 ", 300);
+      std::u32string expected32 =
+          std::wstring_convert<std::codecvt_utf8<char32_t>, char32_t>{}.from_bytes(text);
+      std::u16string expected16 =
+          std::wstring_convert<std::codecvt_utf8_utf16<char16_t>, char16_t>{}.from_bytes(
+              text);
+
+      auto string = UTF8::TryCreate(text.c_str()).unwrap();
+      std::u32string utf32(text.size(), U'\0');
+      utf32.resize(string.DecodeToUtf32(Span{utf32.data(), utf32.size()}));
+      test::ok(utf32 == expected32, "Decodes to UTF-32");
+      std::u16string utf16(text.size(), u'\0');
+      utf16.resize(string.TranscodeToUtf16(Span{utf16.data(), utf16.size()}));
+      test::ok(utf16 == expected16, "Transcodes to UTF-16 with surrogate pairs");
+
+      // Start at every offset so that every kind of sequence lines up with the
+      // start of a vector.
+      bool isCorrect = true;
+      for (auto isa : supportedIsas()) {
+        for (size_t start = 0; start < 64; start++) {
+          auto view = Utf8View::TryCreate(bytesOf(text).From(start));
+          if (view.isErr()) {
+            // This started in the middle of a code point.
+            continue;
+          }
+          auto bytes = view.unwrap().Bytes();
+          std::u32string expected =
+              std::wstring_convert<std::codecvt_utf8<char32_t>, char32_t>{}.from_bytes(
+                  text.substr(start));
+          std::u32string decoded(bytes.Length(), U'\0');
+          Span<char32_t> dest{decoded.data(), decoded.size()};
+          decoded.resize(simd::Utf8ToUtf32(bytes, dest, isa));
+          if (decoded != expected) {
+            isCorrect = false;
+          }
+        }
+      }
+      test::ok(isCorrect, "Every implementation decodes from every offset");
+    });
+
+    test::describe("encoding UTF-16", []() {
+      // The runs are long enough that each vector can be all of one length of
+      // sequence, and also a mix of them.
+      std::string text = makeCorpus("ascii, Grüße, Ελληνικά γράμματα, 東京は日本の首都であり、"
+                                    "👍😅 ",
+                                    600);
+      std::u16string utf16 =
+          std::wstring_convert<std::codecvt_utf8_utf16<char16_t>, char16_t>{}.from_bytes(
+              text);
+
+      bool isCorrect = true;
+      for (auto isa : supportedIsas()) {
+        for (size_t start = 0; start < 64; start++) {
+          std::u16string source = utf16.substr(start);
+          if (source[0] >= 0xdc00 && source[0] <= 0xdfff) {
+            // This started in the middle of a surrogate pair.
+            continue;
+          }
+          std::string expected =
+              std::wstring_convert<std::codecvt_utf8_utf16<char16_t>, char16_t>{}
+                  .to_bytes(source);
+          std::string encoded(source.size() * 3, '\0');
+          encoded.resize(simd::Utf16ToUtf8(
+              Span{source.data(), source.size()},
+              Span{reinterpret_cast<uint8_t *>(encoded.data()), encoded.size()}, isa));
+          if (encoded != expected) {
+            isCorrect = false;
+          }
+        }
+      }
+      test::ok(isCorrect, "Every implementation encodes from every offset");
+
+      for (auto isa : supportedIsas()) {
+        std::u16string source = u"0123456789abcdef\xd83d 0123456789abcdef\xdc4d\xd83d";
+        std::string encoded(source.size() * 3, '\0');
+        encoded.resize(simd::Utf16ToUtf8(
+            Span{source.data(), source.size()},
+            Span{reinterpret_cast<uint8_t *>(encoded.data()), encoded.size()}, isa));
+        test::equal(encoded,
+                    std::string("0123456789abcdef\uFFFD 0123456789abcdef\uFFFD\uFFFD"),
+                    std::string("Unpaired surrogates are replaced with ") +
+                        simd::IsaName(isa));
+      }
+    });
+
+    test::describe("transcoding throughput", []() {
+      struct Corpus {
+        const char *name;
+        std::string text;
+      };
+      const size_t size = 1 << 18;
+      Corpus corpora[]{
+          {"ascii", makeCorpus("The quick brown fox jumps over the lazy dog. ", size)},
+          {"latin", makeCorpus("Größere Übungen, déjà vu, façade, señor. ", size)},
+          {"greek", makeCorpus("Ελληνικά γράμματα και λέξεις ", size)},
+          {"cjk", makeCorpus("東京は日本の首都であり、人口が多い都市です。", size)},
+      };
+      for (const auto &corpus : corpora) {
+        auto view = Utf8View::TryCreate(bytesOf(corpus.text)).unwrap();
+        std::vector<char32_t> utf32(view.Length());
+        std::vector<char16_t> utf16(view.Length());
+        std::string name = corpus.name;
+
+        test::benchmark(name + " to UTF-32 with CodePointIter", [&]() {
+          auto iter = view.Iter();
+          size_t i = 0;
+          while (auto codePoint = iter.Next()) {
+            utf32[i++] = *codePoint;
+          }
+          test::DoNotOptimize(utf32.data());
+        });
+        test::benchmark(name + " to UTF-32 with DecodeToUtf32", [&]() {
+          test::DoNotOptimize(view.DecodeToUtf32(Span{utf32.data(), utf32.size()}));
+        });
+        // mozilla::ConvertUtf8toUtf16 is backed by encoding_rs, which isn't built
+        // here, so compare against ICU's converter instead.
+        test::benchmark(name + " to UTF-16 with ICU u_strFromUTF8", [&]() {
+          int32_t length = 0;
+          UErrorCode status = U_ZERO_ERROR;
+          u_strFromUTF8(reinterpret_cast<UChar *>(utf16.data()), utf16.size(), &length,
+                        corpus.text.data(), corpus.text.size(), &status);
+          test::DoNotOptimize(length);
+        });
+        test::benchmark(name + " to UTF-16 with TranscodeToUtf16", [&]() {
+          test::DoNotOptimize(view.TranscodeToUtf16(Span{utf16.data(), utf16.size()}));
+        });
+
+        size_t utf16Length = view.TranscodeToUtf16(Span{utf16.data(), utf16.size()});
+        std::vector<uint8_t> utf8(utf16Length * 3);
+        test::benchmark(name + " from UTF-16 with ICU u_strToUTF8", [&]() {
+          int32_t length = 0;
+          UErrorCode status = U_ZERO_ERROR;
+          u_strToUTF8(reinterpret_cast<char *>(utf8.data()), utf8.size(), &length,
+                      reinterpret_cast<const UChar *>(utf16.data()), utf16Length,
+                      &status);
+          test::DoNotOptimize(length);
+        });
+        test::benchmark(name + " from UTF-16 with Utf16ToUtf8", [&]() {
+          test::DoNotOptimize(simd::Utf16ToUtf8(Span{utf16.data(), utf16Length},
+                                                Span{utf8.data(), utf8.size()}));
+        });
+      }
+    });
+
+    test::describe("streaming validation", []() {
+      std::string text = makeCorpus("ascii, Grüße, 世界, 👍😅 ", 100);
+      auto bytes = bytesOf(text);
+      bool isCorrect = true;
+      for (size_t split = 0; split <= bytes.Length(); split++) {
+        Utf8StreamValidator validator;
+        if (validator.Feed(bytes.To(split)).isErr() ||
+            validator.Feed(bytes.From(split)).isErr() || validator.Finish().isErr()) {
+          isCorrect = false;
+        }
+      }
+      test::ok(isCorrect, "Text split at every byte is valid");
+
+      Utf8StreamValidator truncated;
+      test::ok(truncated.Feed(bytesOf("abc\xf0\x9f")).isOk(),
+               "A sequence split at the end is not an error yet");
+      test::equal(truncated.Finish().unwrapErr().offset, size_t(3),
+                  "It's an error when the stream ends");
+
+      Utf8StreamValidator invalid;
+      test::ok(invalid.Feed(bytesOf("abc\xed")).isOk(), "The start of a surrogate");
+      test::equal(invalid.Feed(bytesOf("\xa0\x80 more")).unwrapErr().offset, size_t(3),
+                  "The surrogate is reported at its first byte");
+      test::ok(invalid.Feed(bytesOf("valid")).isErr(), "The error sticks");
+    });
+
+    test::describe("streaming errors match whole buffer validation", []() {
+      std::string text = makeCorpus("ascii, Grüße, 世界, 👍😅 ", 300);
+      std::mt19937_64 random(0);
+      size_t mismatches = 0;
+      for (size_t i = 0; i < 5000; i++) {
+        std::string mutated = text.substr(0, random() % text.size());
+        if (!mutated.empty() && random() % 4 != 0) {
+          mutated[random() % mutated.size()] = static_cast<char>(random());
+        }
+        auto bytes = bytesOf(mutated);
+        size_t validLength = simd::ValidUtf8PrefixLength(bytes);
+
+        Utf8StreamValidator validator;
+        Result<Ok, Utf8StreamValidator::Error> result = Ok();
+        for (size_t offset = 0; offset < bytes.Length() && result.isOk();) {
+          size_t length = std::min(size_t(random() % 8), bytes.Length() - offset);
+          result = validator.Feed(bytes.Subspan(offset, length));
+          offset += length;
+        }
+        if (result.isOk()) {
+          result = validator.Finish();
+        }
+        size_t streamedLength =
+            result.isOk() ? bytes.Length() : result.unwrapErr().offset;
+        if (streamedLength != validLength) {
+          mismatches++;
+        }
+      }
+      test::equal(mismatches, size_t(0), "The error offsets are the same");
+    });
+
+    test::describe("streaming validation over a BufferList", []() {
+      std::string text = makeCorpus("ascii, Grüße, 世界, 👍😅 ", 10000);
+      // Use an odd segment size so that sequences are split between segments.
+      BufferList<MallocAllocPolicy> buffers(0, 0, 97);
+      test::ok(buffers.WriteBytes(text.data(), text.size()), "Wrote the buffers");
+
+      Utf8StreamValidator validator;
+      test::ok(validator.Feed(buffers).isOk() && validator.Finish().isOk(),
+               "The segments are valid together");
+      test::equal(validator.ValidLength(), text.size(), "Every byte was validated");
+
+      std::string packets = makeCorpus("Mostly ascii text with a café in it. ", 1 << 20);
+      auto bytes = bytesOf(packets);
+      test::benchmark("validate in 1460 byte packets", [&]() {
+        Utf8StreamValidator packetValidator;
+        for (size_t offset = 0; offset < bytes.Length(); offset += 1460) {
+          size_t length = std::min(size_t(1460), bytes.Length() - offset);
+          test::DoNotOptimize(packetValidator.Feed(bytes.Subspan(offset, length)).isOk());
+        }
+        test::DoNotOptimize(packetValidator.Finish().isOk());
+      });
+      test::benchmark("validate the whole buffer",
+                      [&]() { test::DoNotOptimize(simd::IsValidUtf8(bytes)); });
+    });
+
+    test::describe("random access by code point", []() {
+      std::string text = makeCorpus("ascii, Grüße, 世界, 👍😅 ", 2000);
+      std::u32string expected =
+          std::wstring_convert<std::codecvt_utf8<char32_t>, char32_t>{}.from_bytes(text);
+
+      bool isCountCorrect = true;
+      for (auto isa : supportedIsas()) {
+        for (size_t length = 0; length < 300; length++) {
+          auto prefix = bytesOf(text).To(length);
+          size_t count = 0;
+          for (uint8_t byte : prefix) {
+            count += (byte & 0xc0) != 0x80;
+          }
+          if (simd::CountCodePoints(prefix, isa) != count) {
+            isCountCorrect = false;
+          }
+        }
+        if (simd::CountCodePoints(bytesOf(text), isa) != expected.size()) {
+          isCountCorrect = false;
+        }
+      }
+      test::ok(isCountCorrect, "Every implementation counts the code points");
+
+      auto string = UTF8::TryCreate(text.c_str()).unwrap();
+      test::equal(string.CodePointLength(), expected.size(), "Has the code point length");
+      bool isCorrect = true;
+      for (size_t i = 0; i < expected.size(); i++) {
+        if (string.CodePointAt(i) != Some(static_cast<uint32_t>(expected[i]))) {
+          isCorrect = false;
+        }
+      }
+      test::ok(isCorrect, "Every code point can be accessed");
+      test::ok(string.CodePointAt(expected.size()).isNothing(),
+               "Out of bounds is nothing");
+
+      auto substring = string.SubstringByCodePoints(7, 5);
+      test::ok(substring.isSome(), "Got a substring");
+      test::equal(substring->GetStringView(), "Grüße");
+      test::equal(string.SubstringByCodePoints(expected.size() - 2, 100)->GetStringView(),
+                  "😅 ", "The substring is clamped to the end");
+
+      test::ok(string.Append(bytesOf("!")).isOk(), "Appended");
+      test::equal(string.CodePointLength(), expected.size() + 1,
+                  "Appending rebuilds the index");
+    });
+
+    test::describe("random access throughput", []() {
+      std::string text = makeCorpus("ascii, Grüße, 世界, 👍😅 ", 1 << 20);
+      auto string = UTF8::TryCreate(text.c_str()).unwrap();
+      size_t length = string.CodePointLength();
+      std::mt19937_64 random(0);
+      test::benchmark("code point at a random index", [&]() {
+        test::DoNotOptimize(string.CodePointAt(random() % length));
+      });
+      test::benchmark("code point at a random index by iterating", [&]() {
+        auto iter = string.Iter();
+        for (size_t i = random() % length; i > 0; i--) {
+          iter.Next();
+        }
+        test::DoNotOptimize(iter.Next());
+      });
+      for (auto isa : supportedIsas()) {
+        auto name = std::string("count code points with ") + simd::IsaName(isa);
+        auto result = test::benchmark(name, [&]() {
+          test::DoNotOptimize(simd::CountCodePoints(bytesOf(text), isa));
+        });
+        printf("      %.2f GB/s\n", text.size() / result.median);
+      }
+      test::benchmark("build the code point index", [&]() {
+        test::DoNotOptimize(CodePointIndex(bytesOf(text)).CodePointCount());
+      });
+    });
+
+    test::describe("grapheme clusters", []() {
+      auto check = [](const char *aText, std::vector<std::string> aExpected,
+                      const char *aMessage) {
+        auto view = Utf8View::TryCreate(aText).unwrap();
+        test::ok(graphemesOf(view) == aExpected, aMessage);
+      };
+      check("", {}, "Empty text has no clusters");
+      check("abc", {"a", "b", "c"}, "ASCII is one cluster per byte");
+      check("yy̆", {"y", "y̆"}, "A combining breve joins the y before it");
+      check("y̆̆̆ab", {"y̆̆̆", "a", "b"}, "Any number of combining marks join");
+      check("a\r\n\nb", {"a", "\r\n", "\n", "b"}, "CR LF is a single cluster");
+      check("✋🏽👍", {"✋🏽", "👍"}, "A skin tone joins the emoji before it");
+      check("👨‍👩‍👧‍👦!", {"👨‍👩‍👧‍👦", "!"}, "An emoji ZWJ sequence is one cluster");
+      check("a‍👍", {"a‍", "👍"}, "A ZWJ only joins emoji to emoji");
+      check("🇯🇵🇺🇸🇫", {"🇯🇵", "🇺🇸", "🇫"}, "Regional indicators pair into flags");
+      check("한국어", {"한", "국", "어"}, "Hangul syllables are clusters");
+      check("\u1100\u1161\u11a8\u1100", {"\u1100\u1161\u11a8", "\u1100"},
+            "Hangul jamo join into syllables");
+      check("नमस्ते", {"न", "म", "स्ते"}, "Devanagari conjuncts join");
+      check("\u0600a", {"\u0600a"}, "A prepended concatenation mark joins");
+
+      auto string = UTF8::TryCreate("🇨🇦 café").unwrap();
+      auto iter = string.Graphemes();
+      test::equal(iter.Next()->GetStringView(), "🇨🇦", "An owned string has clusters");
+    });
+
+    test::describe("grapheme clusters match ICU", []() {
+      const char *samples[]{
+          "The quick brown fox jumps over the lazy dog.\r\n",
+          "Größere Übungen, déjà vu, façade, señor.",
+          "東京は日本の首都であり、人口が多い都市です。",
+          "👍😅😜🎉🚀✋🏽 👨‍👩‍👧‍👦 🏳️‍🌈 🇯🇵🇺🇸",
+          "नमस्ते दुनिया, سلام دنیا, 안녕하세요 세계",
+          "ผู้ใหญ่ ຂໍ້ຄວາມ ཀྲྀ y̆̆̆",
+      };
+      for (const char *sample : samples) {
+        auto view = Utf8View::TryCreate(sample).unwrap();
+        test::ok(graphemesOf(view) == icuGraphemesOf(sample), sample);
+      }
+
+      // Random sequences of code points from every category, so that every pair of
+      // categories is tried against ICU.
+      const char32_t codePoints[]{
+          U'a',     U'\r',    U'\n',    0x0085,  0x0300,  0x200d,  0x1f1e6, 0x1f1fa,
+          0x0600,  0x0903,  0x1100,  0x1161,  0x11a8,  0xac00,  0xac01,  0x1f468,
+          0x2764,  0x1f3fd, 0xfe0f,  0xe0020, 0x4e00,  0x200b,  0x0e33,  0x1f600,
+          0x0915,  0x094d,  0x093c,  0x0947,  0x0995,  0x09cd,  0x0e3a,  0x0020,
+      };
+      std::wstring_convert<std::codecvt_utf8<char32_t>, char32_t> converter;
+      std::mt19937 random(37);
+      bool isCorrect = true;
+      for (size_t run = 0; run < 5000 && isCorrect; run++) {
+        std::u32string sequence;
+        for (size_t i = random() % 12; i > 0; i--) {
+          sequence.push_back(codePoints[random() % std::size(codePoints)]);
+        }
+        std::string text = converter.to_bytes(sequence);
+        auto view = Utf8View::TryCreate(bytesOf(text)).unwrap();
+        if (graphemesOf(view) != icuGraphemesOf(text)) {
+          isCorrect = false;
+          printf("Mismatch on run %zu\n", run);
+        }
+      }
+      test::ok(isCorrect, "Random sequences are split the same as ICU");
+    });
+
+    test::describe("grapheme throughput", []() {
+      struct Corpus {
+        const char *name;
+        std::string text;
+      };
+      const size_t size = 1 << 18;
+      Corpus corpora[]{
+          {"ascii", makeCorpus("The quick brown fox jumps over the lazy dog. ", size)},
+          {"latin", makeCorpus("Größere Übungen, déjà vu, façade, señor. ", size)},
+          {"cjk", makeCorpus("東京は日本の首都であり、人口が多い都市です。", size)},
+          {"emoji", makeCorpus("👍😅😜🎉🚀✋🏽 👨‍👩‍👧‍👦 🇯🇵🇺🇸 ", size)},
+      };
+      for (const auto &corpus : corpora) {
+        auto view = Utf8View::TryCreate(bytesOf(corpus.text)).unwrap();
+        std::string name = corpus.name;
+        auto result = test::benchmark(name + " with GraphemeIter", [&]() {
+          auto iter = view.Graphemes();
+          size_t count = 0;
+          while (iter.Next()) {
+            count++;
+          }
+          test::DoNotOptimize(count);
+        });
+        printf("      %.2f GB/s\n", corpus.text.size() / result.median);
+
+        UErrorCode status = U_ZERO_ERROR;
+        UText *text =
+            utext_openUTF8(nullptr, corpus.text.data(), corpus.text.size(), &status);
+        UniquePtr<icu::BreakIterator> iter{
+            icu::BreakIterator::createCharacterInstance(icu::Locale::getRoot(), status)};
+        iter->setText(text, status);
+        result = test::benchmark(name + " with ICU BreakIterator", [&]() {
+          size_t count = 0;
+          for (iter->first(); iter->next() != icu::BreakIterator::DONE;) {
+            count++;
+          }
+          test::DoNotOptimize(count);
+        });
+        printf("      %.2f GB/s\n", corpus.text.size() / result.median);
+        utext_close(text);
+      }
+    });
+
+    test::describe("parallel validation", []() {
+      parallel::ThreadPool pool(4);
+      std::string text = makeCorpus("ascii, Grüße, Ελληνικά, 世界, 👍😅 ", 20000);
+      auto bytes = bytesOf(text);
+      auto count = ValidateAndCountInParallel(bytes, pool, 100);
+      test::ok(count.isOk(), "The text is valid");
+      test::equal(count.unwrap(), simd::CountCodePoints(bytes),
+                  "The code points are counted across the chunks");
+      test::equal(ValidateAndCountInParallel(Span<const uint8_t>{}, pool).unwrap(),
+                  size_t(0), "Empty text has no code points");
+
+      // Mutate the text so that the errors land all over the chunks, including on
+      // and around their boundaries.
+      std::mt19937 random(38);
+      bool isCorrect = true;
+      for (size_t run = 0; run < 200; run++) {
+        std::string mutated = text;
+        for (size_t i = random() % 3; i > 0; i--) {
+          mutated[random() % mutated.size()] = static_cast<char>(random());
+        }
+        auto mutatedBytes = bytesOf(mutated);
+        size_t expected = simd::ValidUtf8PrefixLength(mutatedBytes);
+        auto result = ValidateAndCountInParallel(mutatedBytes, pool, 1 + random() % 200);
+        if (expected == mutated.size()) {
+          isCorrect &= result.isOk() &&
+                       result.unwrap() == simd::CountCodePoints(mutatedBytes);
+        } else {
+          isCorrect &= result.isErr() && result.unwrapErr().offset == expected;
+        }
+      }
+      test::ok(isCorrect, "The exact error offset is found");
+
+      // A run of continuation bytes is longer than the resynchronization.
+      std::string stray = text + std::string(50, '\x80') + text;
+      auto result = ValidateAndCountInParallel(bytesOf(stray), pool, 7);
+      test::equal(result.unwrapErr().offset, text.size(),
+                  "A long run of continuation bytes fails at its start");
+
+      test::ok(UTF8::TryCreateInParallel(bytes).isOk(), "An owned string is created");
+      test::ok(Utf8View::TryCreateInParallel(bytesOf(stray)).isErr(),
+               "An invalid view is rejected");
+    });
+
+    test::describe("parallel validation throughput", []() {
+      std::string text = makeCorpus("ascii, Grüße, Ελληνικά, 世界, 👍😅 ", 1 << 26);
+      auto bytes = bytesOf(text);
+      auto result = test::benchmark("validate and count on one thread", [&]() {
+        test::DoNotOptimize(simd::IsValidUtf8(bytes));
+        test::DoNotOptimize(simd::CountCodePoints(bytes));
+      });
+      printf("      %.2f GB/s\n", text.size() / result.median);
+      auto &pool = parallel::ThreadPool::global();
+      auto name = "validate and count on " + std::to_string(pool.threadCount());
+      result = test::benchmark(name + " threads", [&]() {
+        test::DoNotOptimize(ValidateAndCountInParallel(bytes, pool).unwrap());
+      });
+      printf("      %.2f GB/s\n", text.size() / result.median);
+    });
+
+    test::describe("memory mapped files", []() {
+      std::string text = makeCorpus("Grüße, 世界, 👍 ", 10000);
+      std::string path = writeTempFile(text);
+      auto file = Utf8File::Open(path.c_str()).unwrap();
+      test::equal(file.Length(), text.size(), "The whole file is mapped");
+      test::ok(file.AsView().GetStringView() == text, "The file is viewed in place");
+      Utf8File moved = std::move(file);
+      test::equal(file.Length(), size_t(0), "Moving the file leaves nothing behind");
+      test::equal(moved.AsView().Iter().Next(), Some(static_cast<uint32_t>('G')),
+                  "The moved file is still mapped");
+      unlink(path.c_str());
+
+      std::string emptyPath = writeTempFile("");
+      test::equal(Utf8File::Open(emptyPath.c_str()).unwrap().Length(), size_t(0),
+                  "An empty file is valid");
+      unlink(emptyPath.c_str());
+
+      std::string invalidPath = writeTempFile(text + "\xed\xa0\x80");
+      test::ok(Utf8File::Open(invalidPath.c_str()).unwrapErr() ==
+                   Utf8File::Error::InvalidEncoding,
+               "An invalid file is rejected");
+      unlink(invalidPath.c_str());
+
+      test::ok(Utf8File::Open("/tmp/utf8-test-missing").unwrapErr() ==
+                   Utf8File::Error::CantOpen,
+               "A missing file can't be opened");
+    });
+
+    test::describe("memory mapped file throughput", []() {
+      // Run with UTF8_FILE_MB=1024 to benchmark a 1 GB file.
+      const char *megabytes = std::getenv("UTF8_FILE_MB");
+      size_t size = (megabytes ? std::stoul(megabytes) : 64) << 20;
+      std::string path = writeTempFile(
+          makeCorpus("Mostly ascii text with a café in it, and some 世界. ", size));
+
+      auto result = test::benchmark("read() into a buffer and create a UTF8", [&]() {
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        struct stat info;
+        fstat(fd, &info);
+        Vector<uint8_t> buffer;
+        MOZ_RELEASE_ASSERT(buffer.growByUninitialized(info.st_size));
+        for (size_t offset = 0; offset < buffer.length();) {
+          ssize_t bytes = read(fd, buffer.begin() + offset, buffer.length() - offset);
+          MOZ_RELEASE_ASSERT(bytes > 0);
+          offset += bytes;
+        }
+        close(fd);
+        test::DoNotOptimize(
+            UTF8::TryCreate(Span{buffer.begin(), buffer.length()}).isOk());
+      });
+      printf("      %.2f GB/s\n", size / result.median);
+      result = test::benchmark("mmap and validate with Utf8File", [&]() {
+        test::DoNotOptimize(Utf8File::Open(path.c_str()).unwrap().Length());
+      });
+      printf("      %.2f GB/s\n", size / result.median);
+      unlink(path.c_str());
+    });
+
+    test::describe("ascii case insensitive comparison", []() {
+      auto view = [](const char *aText) { return Utf8View::TryCreate(aText).unwrap(); };
+      test::ok(view("Content-Type").EqualsIgnoringAsciiCase(view("content-type")),
+               "ASCII letters are compared without case");
+      test::ok(!view("Content-Type").EqualsIgnoringAsciiCase(view("Content-Typo")),
+               "Different letters are different");
+      test::ok(!view("[").EqualsIgnoringAsciiCase(view("{")),
+               "Only letters are folded, and not the punctuation 0x20 away");
+      test::ok(!view("É").EqualsIgnoringAsciiCase(view("é")),
+               "Non-ASCII letters keep their case");
+      test::ok(view("Grüße").EqualsIgnoringAsciiCase(view("GRüßE")),
+               "Non-ASCII bytes must be the same");
+      test::ok(!view("abc").EqualsIgnoringAsciiCase(view("abcd")),
+               "Different lengths are different");
+      test::ok(view("Accept-Encoding: gzip").StartsWithIgnoringAsciiCase(view("ACCEPT-")),
+               "Prefixes ignore case");
+      test::ok(!view("Accept").StartsWithIgnoringAsciiCase(view("Accept-Encoding")),
+               "A prefix can't be longer than the text");
+
+      // Try every pair of bytes at every position in a vector, for every
+      // implementation.
+      bool isCorrect = true;
+      for (auto isa : supportedIsas()) {
+        for (size_t position = 0; position < 40; position++) {
+          for (int left = 0; left < 256; left++) {
+            for (int right : {left, left ^ 0x20, left + 1}) {
+              std::string a(40, 'x');
+              std::string b(40, 'X');
+              a[position] = static_cast<char>(left);
+              b[position] = static_cast<char>(right);
+              bool isSame = tolower(left) == tolower(right & 0xff);
+              size_t expected = isSame ? 40 : position;
+              size_t length =
+                  simd::CommonPrefixLengthIgnoringAsciiCase(bytesOf(a), bytesOf(b), isa);
+              isCorrect &= length == expected;
+            }
+          }
+        }
+      }
+      test::ok(isCorrect, "Every implementation folds exactly the ASCII letters");
+    });
+
+    test::describe("case folding comparison", []() {
+      auto view = [](const char *aText) { return Utf8View::TryCreate(aText).unwrap(); };
+      test::ok(view("Grüße, Welt").EqualsIgnoringCase(view("GRÜSSE, WELT")) == false,
+               "Simple folding doesn't expand ß");
+      test::ok(view("ΣΑΣ").EqualsIgnoringCase(view("σας")), "Greek sigmas fold");
+      test::ok(view("ÉCOLE").EqualsIgnoringCase(view("école")),
+               "Sequences that differ in their last byte fold");
+      test::ok(view("\u212a").EqualsIgnoringCase(view("k")),
+               "The Kelvin sign folds to ASCII");
+      test::ok(view("𐐀𞤀").EqualsIgnoringCase(view("𐐨𞤢")),
+               "Deseret and Adlam fold");
+      test::ok(!view("abc").EqualsIgnoringCase(view("abcé")), "Longer text differs");
+      test::ok(!view("é").EqualsIgnoringCase(view("e")), "Accents don't fold away");
+
+      auto string = UTF8::TryCreate("Straße").unwrap();
+      test::ok(string.EqualsIgnoringCase(view("STRAßE")), "Owned strings can compare");
+      test::ok(string.StartsWithIgnoringAsciiCase(view("STRA")),
+               "Owned strings can match prefixes");
+
+      bool isCorrect = true;
+      for (char32_t codePoint = 0; codePoint <= 0x10ffff; codePoint++) {
+        isCorrect &= tables::SimpleCaseFold(codePoint) ==
+                     static_cast<char32_t>(u_foldCase(codePoint, U_FOLD_CASE_DEFAULT));
+      }
+      test::ok(isCorrect, "The table matches ICU for every code point");
+
+      // Change the case of random letters, and compare against folding every code
+      // point with ICU.
+      std::u32string sample = U"Grüße ΣΑΣ σας École 𐐀𞤀 ǅ ǈ KELVIN \u212a ﬀ 世界 ";
+      std::wstring_convert<std::codecvt_utf8<char32_t>, char32_t> converter;
+      std::mt19937 random(40);
+      isCorrect = true;
+      for (size_t run = 0; run < 2000; run++) {
+        std::u32string left;
+        std::u32string right;
+        for (size_t i = random() % 16; i > 0; i--) {
+          char32_t codePoint = sample[random() % sample.size()];
+          left.push_back(codePoint);
+          switch (random() % 4) {
+          case 0:
+            right.push_back(u_toupper(codePoint));
+            break;
+          case 1:
+            right.push_back(u_tolower(codePoint));
+            break;
+          case 2:
+            right.push_back(sample[random() % sample.size()]);
+            break;
+          default:
+            right.push_back(codePoint);
+          }
+        }
+        auto fold = [](std::u32string aText) {
+          for (char32_t &codePoint : aText) {
+            codePoint = u_foldCase(codePoint, U_FOLD_CASE_DEFAULT);
+          }
+          return aText;
+        };
+        std::string leftBytes = converter.to_bytes(left);
+        std::string rightBytes = converter.to_bytes(right);
+        isCorrect &= Utf8View::TryCreate(bytesOf(leftBytes))
+                         .unwrap()
+                         .EqualsIgnoringCase(
+                             Utf8View::TryCreate(bytesOf(rightBytes)).unwrap()) ==
+                     (fold(left) == fold(right));
+      }
+      test::ok(isCorrect, "Random text compares the same as ICU's folding");
+    });
+
+    test::describe("case insensitive comparison throughput", []() {
+      struct Corpus {
+        const char *name;
+        std::string left;
+        std::string right;
+      };
+      const size_t size = 1 << 16;
+      Corpus corpora[]{
+          {"ascii", makeCorpus("Content-Type: Text/HTML; Charset=UTF-8 ", size),
+           makeCorpus("content-type: text/html; charset=utf-8 ", size)},
+          {"latin", makeCorpus("Größere Übungen, Déjà Vu, Façade, Señor. ", size),
+           makeCorpus("GRÖßERE ÜBUNGEN, DÉJÀ VU, FAÇADE, SEÑOR. ", size)},
+          {"greek", makeCorpus("Ελληνικά Γράμματα ", size),
+           makeCorpus("ΕΛΛΗΝΙΚΆ ΓΡΆΜΜΑΤΑ ", size)},
+      };
+      for (const auto &corpus : corpora) {
+        auto left = Utf8View::TryCreate(bytesOf(corpus.left)).unwrap();
+        auto right = Utf8View::TryCreate(bytesOf(corpus.right)).unwrap();
+        test::ok(left.EqualsIgnoringCase(right), "The corpora are equal");
+        std::string name = corpus.name;
+        test::benchmark(name + " with ICU UnicodeString::caseCompare", [&]() {
+          auto leftString = icu::UnicodeString::fromUTF8(corpus.left);
+          auto rightString = icu::UnicodeString::fromUTF8(corpus.right);
+          test::DoNotOptimize(leftString.caseCompare(rightString, U_FOLD_CASE_DEFAULT));
+        });
+        test::benchmark(name + " with EqualsIgnoringCase", [&]() {
+          test::DoNotOptimize(left.EqualsIgnoringCase(right));
+        });
+        if (name == "ascii") {
+          test::benchmark(name + " with strncasecmp", [&]() {
+            test::DoNotOptimize(
+                strncasecmp(corpus.left.data(), corpus.right.data(), corpus.left.size()));
+          });
+          test::benchmark(name + " with EqualsIgnoringAsciiCase", [&]() {
+            test::DoNotOptimize(left.EqualsIgnoringAsciiCase(right));
+          });
+        }
+      }
+    });
+
+    test::describe("validation throughput", []() {
+      struct Corpus {
+        const char *name;
+        std::string text;
+      };
+      const size_t size = 1 << 20;
+      Corpus corpora[]{
+          {"ascii", makeCorpus("The quick brown fox jumps over the lazy dog. ", size)},
+          {"latin", makeCorpus("Größere Übungen, déjà vu, façade, señor. ", size)},
+          {"cjk", makeCorpus("東京は日本の首都であり、人口が多い都市です。", size)},
+          {"emoji", makeCorpus("👍😅😜🎉🚀✋🏽 ", size)},
+      };
+      for (const auto &corpus : corpora) {
+        test::ok(simd::IsValidUtf8(bytesOf(corpus.text)), "The corpus is valid");
+        for (auto isa : supportedIsas()) {
+          auto result = test::benchmark(
+              std::string("validate ") + corpus.name + " with " + simd::IsaName(isa),
+              [&]() {
+                test::DoNotOptimize(simd::IsValidUtf8(bytesOf(corpus.text), isa));
+              });
+          printf("      %.2f GB/s\n", corpus.text.size() / result.median);
+        }
+      }
+    });
+    test::describe("ascii throughput", []() {
+      std::string text =
+          makeCorpus("The quick brown fox jumps over the lazy dog. ", 1 << 20);
+      auto bytes = bytesOf(text);
+      auto result = test::benchmark("is ascii one byte at a time", [&]() {
+        bool isAscii = true;
+        for (const uint8_t &byte : bytes) {
+          if (byte >> 7 != 0b0) {
+            isAscii = false;
+          }
+        }
+        test::DoNotOptimize(isAscii);
+      });
+      printf("      %.2f GB/s\n", text.size() / result.median);
+      for (auto isa : supportedIsas()) {
+        auto name = std::string("is ascii with ") + simd::IsaName(isa);
+        result = test::benchmark(name, [&]() {
+          test::DoNotOptimize(simd::AsciiPrefixLength(bytes, isa) == bytes.size());
+        });
+        printf("      %.2f GB/s\n", text.size() / result.median);
+      }
+
+      // About 97% of this text is ASCII.
+      std::string mostlyAscii =
+          makeCorpus("Mostly ascii text with a café in it. ", 1 << 20);
+      auto string = UTF8::TryCreate(mostlyAscii.c_str()).unwrap();
+      test::benchmark("iterate code points in mostly ascii text", [&]() {
+        auto iter = string.Iter();
+        uint32_t sum = 0;
+        while (auto codePoint = iter.Next()) {
+          sum += *codePoint;
+        }
+        test::DoNotOptimize(sum);
+      });
+    });
   });
 }
 
@@ -0,0 +1,909 @@
+#include "./utf8_simd.h"
+#include <algorithm>
+#include <bit>
+#include <cassert>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define UTF8_SIMD_X86 1
+#include <immintrin.h>
+#endif
+
+namespace features::utf8::simd {
+using namespace mozilla;
+
+const char *IsaName(Isa aIsa) {
+  switch (aIsa) {
+  case Isa::Scalar:
+    return "scalar";
+  case Isa::Ssse3:
+    return "ssse3";
+  case Isa::Avx2:
+    return "avx2";
+  }
+  return "unknown";
+}
+
+bool IsSupported(Isa aIsa) {
+  switch (aIsa) {
+  case Isa::Scalar:
+    return true;
+#ifdef UTF8_SIMD_X86
+  case Isa::Ssse3:
+    return __builtin_cpu_supports("ssse3");
+  case Isa::Avx2:
+    return __builtin_cpu_supports("avx2");
+#else
+  case Isa::Ssse3:
+  case Isa::Avx2:
+    return false;
+#endif
+  }
+  return false;
+}
+
+Isa BestIsa() {
+  static const Isa sIsa = []() {
+    if (IsSupported(Isa::Avx2)) {
+      return Isa::Avx2;
+    }
+    if (IsSupported(Isa::Ssse3)) {
+      return Isa::Ssse3;
+    }
+    return Isa::Scalar;
+  }();
+  return sIsa;
+}
+
+// Find the first byte with the high bit set, testing 8 bytes at a time.
+static size_t AsciiPrefixLengthScalar(const uint8_t *aData, size_t aLength) {
+  constexpr uint64_t HIGH_BITS = 0x8080808080808080;
+  size_t i = 0;
+  for (; i + sizeof(uint64_t) <= aLength; i += sizeof(uint64_t)) {
+    uint64_t word;
+    memcpy(&word, aData + i, sizeof(word));
+    if (uint64_t highBits = word & HIGH_BITS) {
+      if constexpr (std::endian::native == std::endian::little) {
+        return i + std::countr_zero(highBits) / 8;
+      } else {
+        return i + std::countl_zero(highBits) / 8;
+      }
+    }
+  }
+  while (i < aLength && aData[i] < 0x80) {
+    i++;
+  }
+  return i;
+}
+
+// Count the bytes that aren't continuation bytes, which start with 0b10, testing 8
+// bytes at a time.
+static size_t CountCodePointsScalar(const uint8_t *aData, size_t aLength) {
+  constexpr uint64_t HIGH_BITS = 0x8080808080808080;
+  size_t continuations = 0;
+  size_t i = 0;
+  for (; i + sizeof(uint64_t) <= aLength; i += sizeof(uint64_t)) {
+    uint64_t word;
+    memcpy(&word, aData + i, sizeof(word));
+    // Shifting moves the second highest bit of every byte into the highest bit.
+    continuations += std::popcount(word & ~(word << 1) & HIGH_BITS);
+  }
+  for (; i < aLength; i++) {
+    continuations += (aData[i] & 0xc0) == 0x80;
+  }
+  return aLength - continuations;
+}
+
+// Lowercase the ASCII letters in 8 bytes at once, leaving every other byte as is.
+static uint64_t AsciiToLowerWord(uint64_t aWord) {
+  constexpr uint64_t ONES = 0x0101010101010101;
+  constexpr uint64_t HIGH_BITS = 0x8080808080808080;
+  // Without the high bits the additions can't carry into the next byte. They set
+  // the high bit of a byte when it's at least 'A', or when it's past 'Z'.
+  uint64_t lowBits = aWord & ~HIGH_BITS;
+  uint64_t isAtLeastA = lowBits + (0x80 - 'A') * ONES;
+  uint64_t isPastZ = lowBits + (0x80 - 'Z' - 1) * ONES;
+  uint64_t isUpper = isAtLeastA & ~isPastZ & ~aWord & HIGH_BITS;
+  // Moving the high bit down by 2 is 0x20, the difference between the cases.
+  return aWord | (isUpper >> 2);
+}
+
+static uint8_t AsciiToLower(uint8_t aByte) {
+  return aByte >= 'A' && aByte <= 'Z' ? aByte | 0x20 : aByte;
+}
+
+static size_t CommonPrefixLengthIgnoringAsciiCaseScalar(const uint8_t *aLeft,
+                                                        const uint8_t *aRight,
+                                                        size_t aLength) {
+  size_t i = 0;
+  for (; i + sizeof(uint64_t) <= aLength; i += sizeof(uint64_t)) {
+    uint64_t left;
+    uint64_t right;
+    memcpy(&left, aLeft + i, sizeof(left));
+    memcpy(&right, aRight + i, sizeof(right));
+    if (uint64_t different = AsciiToLowerWord(left) ^ AsciiToLowerWord(right)) {
+      if constexpr (std::endian::native == std::endian::little) {
+        return i + std::countr_zero(different) / 8;
+      } else {
+        return i + std::countl_zero(different) / 8;
+      }
+    }
+  }
+  while (i < aLength && AsciiToLower(aLeft[i]) == AsciiToLower(aRight[i])) {
+    i++;
+  }
+  return i;
+}
+
+// | Code Points        | First     | Second    | Third     | Fourth    |
+// |--------------------|-----------|-----------|-----------|-----------|
+// | U+0000..U+007F     | 00..7F    |           |           |           |
+// | U+0080..U+07FF     | C2..DF    | 80..BF    |           |           |
+// | U+0800..U+0FFF     | E0        | A0..BF    | 80..BF    |           |
+// | U+1000..U+CFFF     | E1..EC    | 80..BF    | 80..BF    |           |
+// | U+D000..U+D7FF     | ED        | 80..9F    | 80..BF    |           |
+// | U+E000..U+FFFF     | EE..EF    | 80..BF    | 80..BF    |           |
+// | U+10000..U+3FFFF   | F0        | 90..BF    | 80..BF    | 80..BF    |
+// | U+40000..U+FFFFF   | F1..F3    | 80..BF    | 80..BF    | 80..BF    |
+// | U+100000..U+10FFFF | F4        | 80..8F    | 80..BF    | 80..BF    |
+//
+// https://www.rfc-editor.org/rfc/rfc3629#section-4
+//
+// Returns the length of the valid text, which stops at the start of the first
+// invalid sequence.
+static size_t ValidUtf8PrefixLengthScalar(const uint8_t *aData, size_t aLength) {
+  auto isContinuation = [](uint8_t aByte) { return (aByte & 0xc0) == 0x80; };
+
+  size_t i = 0;
+  while (i < aLength) {
+    uint8_t byte = aData[i];
+    if (byte < 0x80) {
+      // Most text is ASCII, so skip over the whole run.
+      i += AsciiPrefixLengthScalar(aData + i, aLength - i);
+      continue;
+    }
+
+    // The range that the second byte is allowed to be in, which is narrower than a
+    // continuation byte after some leading bytes.
+    uint8_t secondMin = 0x80;
+    uint8_t secondMax = 0xbf;
+    size_t length;
+    if (byte >= 0xc2 && byte <= 0xdf) {
+      length = 2;
+    } else if (byte >= 0xe0 && byte <= 0xef) {
+      length = 3;
+      if (byte == 0xe0) {
+        // Overlong.
+        secondMin = 0xa0;
+      } else if (byte == 0xed) {
+        // Surrogates.
+        secondMax = 0x9f;
+      }
+    } else if (byte >= 0xf0 && byte <= 0xf4) {
+      length = 4;
+      if (byte == 0xf0) {
+        // Overlong.
+        secondMin = 0x90;
+      } else if (byte == 0xf4) {
+        // Above U+10FFFF.
+        secondMax = 0x8f;
+      }
+    } else {
+      // Continuation bytes, the overlong C0 and C1, and F5 and above.
+      return i;
+    }
+
+    if (aLength - i < length) {
+      return i;
+    }
+    uint8_t second = aData[i + 1];
+    if (second < secondMin || second > secondMax) {
+      return i;
+    }
+    for (size_t j = 2; j < length; j++) {
+      if (!isContinuation(aData[i + j])) {
+        return i;
+      }
+    }
+    i += length;
+  }
+  return aLength;
+}
+
+static bool IsValidUtf8Scalar(const uint8_t *aData, size_t aLength) {
+  return ValidUtf8PrefixLengthScalar(aData, aLength) == aLength;
+}
+
+// Write a code point out as UTF-32, or as UTF-16 with a surrogate pair when it's
+// outside of the basic multilingual plane. Returns the number of code units.
+template <typename CharT>
+static size_t WriteCodePoint(char32_t aCodePoint, CharT *aDest) {
+  if constexpr (sizeof(CharT) == sizeof(char16_t)) {
+    if (aCodePoint >= 0x10000) {
+      aCodePoint -= 0x10000;
+      aDest[0] = static_cast<CharT>(0xd800 | (aCodePoint >> 10));
+      aDest[1] = static_cast<CharT>(0xdc00 | (aCodePoint & 0x3ff));
+      return 2;
+    }
+  }
+  aDest[0] = static_cast<CharT>(aCodePoint);
+  return 1;
+}
+
+template <typename CharT>
+static size_t TranscodeScalar(const uint8_t *aSource, size_t aLength, CharT *aDest) {
+  size_t i = 0;
+  size_t written = 0;
+  while (i < aLength) {
+    if (aSource[i] < 0x80) {
+      size_t end = i + AsciiPrefixLengthScalar(aSource + i, aLength - i);
+      for (; i < end; i++) {
+        aDest[written++] = aSource[i];
+      }
+      continue;
+    }
+    char32_t codePoint;
+    i += DecodeCodePoint(aSource + i, codePoint);
+    written += WriteCodePoint(codePoint, aDest + written);
+  }
+  return written;
+}
+
+// Encode the code point that starts at aSource[aIndex], and move past it.
+static inline size_t EncodeUtf16(const char16_t *aSource, size_t aLength, size_t &aIndex,
+                                 uint8_t *aDest) {
+  char32_t unit = aSource[aIndex++];
+  if (unit < 0x80) {
+    aDest[0] = static_cast<uint8_t>(unit);
+    return 1;
+  }
+  if (unit < 0x800) {
+    aDest[0] = static_cast<uint8_t>(0xc0 | (unit >> 6));
+    aDest[1] = static_cast<uint8_t>(0x80 | (unit & 0x3f));
+    return 2;
+  }
+  if (unit >= 0xd800 && unit <= 0xdfff) {
+    char32_t trail = aIndex < aLength ? aSource[aIndex] : 0;
+    if (unit <= 0xdbff && trail >= 0xdc00 && trail <= 0xdfff) {
+      aIndex++;
+      char32_t codePoint = 0x10000 + ((unit - 0xd800) << 10) + (trail - 0xdc00);
+      aDest[0] = static_cast<uint8_t>(0xf0 | (codePoint >> 18));
+      aDest[1] = static_cast<uint8_t>(0x80 | ((codePoint >> 12) & 0x3f));
+      aDest[2] = static_cast<uint8_t>(0x80 | ((codePoint >> 6) & 0x3f));
+      aDest[3] = static_cast<uint8_t>(0x80 | (codePoint & 0x3f));
+      return 4;
+    }
+    unit = 0xfffd;
+  }
+  aDest[0] = static_cast<uint8_t>(0xe0 | (unit >> 12));
+  aDest[1] = static_cast<uint8_t>(0x80 | ((unit >> 6) & 0x3f));
+  aDest[2] = static_cast<uint8_t>(0x80 | (unit & 0x3f));
+  return 3;
+}
+
+static size_t Utf16ToUtf8Scalar(const char16_t *aSource, size_t aLength,
+                                uint8_t *aDest) {
+  size_t i = 0;
+  size_t written = 0;
+  while (i < aLength) {
+    // Keep the ASCII out of the call, as it's most of the text.
+    if (aSource[i] < 0x80) {
+      aDest[written++] = static_cast<uint8_t>(aSource[i++]);
+      continue;
+    }
+    written += EncodeUtf16(aSource, aLength, i, aDest + written);
+  }
+  return written;
+}
+
+#ifdef UTF8_SIMD_X86
+
+// The vectorized validators look up every byte, along with the byte before it, in
+// three tables that are indexed by a nibble each. Every table entry is a set of
+// the errors that the nibble could be part of, and a pair of bytes is invalid when
+// all three lookups share an error. This is the "lookup" algorithm from:
+//
+// John Keiser, Daniel Lemire, "Validating UTF-8 In Less Than One Instruction Per
+// Byte", Software: Practice and Experience 51 (5), 2021.
+namespace lookup {
+
+// A leading byte is followed by another leading byte or ASCII.
+constexpr uint8_t TOO_SHORT = 1 << 0;
+// ASCII is followed by a continuation byte.
+constexpr uint8_t TOO_LONG = 1 << 1;
+// E0 80..9F, a 3 byte sequence that would fit in 2 bytes.
+constexpr uint8_t OVERLONG_3 = 1 << 2;
+// F4 90..BF, or F5 and above, which are larger than U+10FFFF.
+constexpr uint8_t TOO_LARGE = 1 << 3;
+// ED A0..BF, the UTF-16 surrogates.
+constexpr uint8_t SURROGATE = 1 << 4;
+// C0 and C1, a 2 byte sequence that would fit in ASCII.
+constexpr uint8_t OVERLONG_2 = 1 << 5;
+// F5 and above followed by 80..8F.
+constexpr uint8_t TOO_LARGE_1000 = 1 << 6;
+// F0 80..8F, a 4 byte sequence that would fit in 3 bytes.
+constexpr uint8_t OVERLONG_4 = 1 << 6;
+// Two continuation bytes in a row, which must be checked against the bytes before.
+constexpr uint8_t TWO_CONTS = 1 << 7;
+// These errors only depend on the high nibble of the first byte.
+constexpr uint8_t CARRY = TOO_SHORT | TOO_LONG | TWO_CONTS;
+
+// Indexed by the high nibble of the first byte.
+alignas(32) constexpr uint8_t BYTE_1_HIGH[32] = {
+    // 0_______ ASCII
+    TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+    // 10______ Continuation
+    TWO_CONTS, TWO_CONTS, TWO_CONTS, TWO_CONTS,
+    // 1100____ 2 byte lead
+    TOO_SHORT | OVERLONG_2,
+    // 1101____ 2 byte lead
+    TOO_SHORT,
+    // 1110____ 3 byte lead
+    TOO_SHORT | OVERLONG_3 | SURROGATE,
+    // 1111____ 4 byte lead
+    TOO_SHORT | TOO_LARGE | TOO_LARGE_1000 | OVERLONG_4,
+    // The table is repeated for both lanes of an AVX2 register.
+    TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+    TWO_CONTS, TWO_CONTS, TWO_CONTS, TWO_CONTS, TOO_SHORT | OVERLONG_2, TOO_SHORT,
+    TOO_SHORT | OVERLONG_3 | SURROGATE,
+    TOO_SHORT | TOO_LARGE | TOO_LARGE_1000 | OVERLONG_4};
+
+// Indexed by the low nibble of the first byte.
+alignas(32) constexpr uint8_t BYTE_1_LOW[32] = {
+    // ____0000
+    CARRY | OVERLONG_3 | OVERLONG_2 | OVERLONG_4,
+    // ____0001
+    CARRY | OVERLONG_2,
+    // ____001_
+    CARRY, CARRY,
+    // ____0100
+    CARRY | TOO_LARGE,
+    // ____0101 to ____1100
+    CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000,
+    // ____1101
+    CARRY | TOO_LARGE | TOO_LARGE_1000 | SURROGATE,
+    // ____111_
+    CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000,
+    // The table is repeated for both lanes of an AVX2 register.
+    CARRY | OVERLONG_3 | OVERLONG_2 | OVERLONG_4, CARRY | OVERLONG_2, CARRY, CARRY,
+    CARRY | TOO_LARGE, CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000 | SURROGATE,
+    CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000};
+
+// Indexed by the high nibble of the second byte.
+alignas(32) constexpr uint8_t BYTE_2_HIGH[32] = {
+    // 0_______ ASCII
+    TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+    TOO_SHORT,
+    // 1000____
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE_1000 | OVERLONG_4,
+    // 1001____
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE,
+    // 101_____
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+    // 11______ Leading bytes
+    TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+    // The table is repeated for both lanes of an AVX2 register.
+    TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+    TOO_SHORT,
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE_1000 | OVERLONG_4,
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE,
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE, TOO_SHORT, TOO_SHORT,
+    TOO_SHORT, TOO_SHORT};
+
+// The last bytes of a block that would start a sequence which runs past the end of
+// the block. Subtracting this with saturation is non-zero for those bytes.
+alignas(32) constexpr uint8_t INCOMPLETE[32] = {
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xf0 - 1, 0xe0 - 1, 0xc0 - 1};
+
+} // namespace lookup
+
+// Compile every function up to the matching UTF8_SIMD_TARGET_END for a target.
+#if defined(__clang__)
+#define UTF8_SIMD_TARGET_SSSE3                                                       \
+  _Pragma("clang attribute push(__attribute__((target(\"ssse3\"))), apply_to = function)")
+#define UTF8_SIMD_TARGET_AVX2                                                        \
+  _Pragma("clang attribute push(__attribute__((target(\"avx2\"))), apply_to = function)")
+#define UTF8_SIMD_TARGET_END _Pragma("clang attribute pop")
+#else
+#define UTF8_SIMD_TARGET_SSSE3                                                       \
+  _Pragma("GCC push_options") _Pragma("GCC target(\"ssse3\")")
+#define UTF8_SIMD_TARGET_AVX2 _Pragma("GCC push_options") _Pragma("GCC target(\"avx2\")")
+#define UTF8_SIMD_TARGET_END _Pragma("GCC pop_options")
+#endif
+
+UTF8_SIMD_TARGET_SSSE3
+namespace ssse3 {
+
+struct Ops {
+  using Vec = __m128i;
+  static constexpr size_t WIDTH = 16;
+
+  static Vec LoadUnaligned(const uint8_t *aData) {
+    return _mm_loadu_si128(reinterpret_cast<const __m128i *>(aData));
+  }
+  static Vec Zero() { return _mm_setzero_si128(); }
+  static Vec Splat(uint8_t aByte) { return _mm_set1_epi8(static_cast<char>(aByte)); }
+  static Vec And(Vec a, Vec b) { return _mm_and_si128(a, b); }
+  static Vec Or(Vec a, Vec b) { return _mm_or_si128(a, b); }
+  static Vec Xor(Vec a, Vec b) { return _mm_xor_si128(a, b); }
+  static Vec SubSaturate(Vec a, Vec b) { return _mm_subs_epu8(a, b); }
+  static Vec HighNibbles(Vec a) {
+    return _mm_and_si128(_mm_srli_epi16(a, 4), _mm_set1_epi8(0x0f));
+  }
+  static Vec LowNibbles(Vec a) { return _mm_and_si128(a, _mm_set1_epi8(0x0f)); }
+  // The tables are sized for AVX2, so only use the first lane.
+  static Vec Lookup(const uint8_t *aTable, Vec aIndices) {
+    return _mm_shuffle_epi8(_mm_load_si128(reinterpret_cast<const __m128i *>(aTable)),
+                            aIndices);
+  }
+  // The incomplete table has its interesting values at the very end.
+  static Vec Incomplete() {
+    return _mm_load_si128(reinterpret_cast<const __m128i *>(lookup::INCOMPLETE + 16));
+  }
+  // The input shifted by N bytes, with the end of the previous block shifted in.
+  template <int N> static Vec Prev(Vec aInput, Vec aPrevious) {
+    return _mm_alignr_epi8(aInput, aPrevious, 16 - N);
+  }
+  // The high bit of every byte.
+  static uint32_t MoveMask(Vec a) { return _mm_movemask_epi8(a); }
+  static Vec Sub(Vec a, Vec b) { return _mm_sub_epi8(a, b); }
+  // 0xff for continuation bytes, which are the only bytes below -64 when signed.
+  static Vec Continuations(Vec a) { return _mm_cmpgt_epi8(_mm_set1_epi8(-64), a); }
+  static size_t SumBytes(Vec a) {
+    // Each half of the sums is at most 8 * 255, which fits in 16 bits.
+    __m128i sums = _mm_sad_epu8(a, _mm_setzero_si128());
+    return _mm_extract_epi16(sums, 0) + _mm_extract_epi16(sums, 4);
+  }
+  static bool IsAscii(Vec a) { return _mm_movemask_epi8(a) == 0; }
+  static bool IsZero(Vec a) {
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(a, _mm_setzero_si128())) == 0xffff;
+  }
+  static uint32_t DifferentBytes(Vec a, Vec b) {
+    return ~_mm_movemask_epi8(_mm_cmpeq_epi8(a, b)) & 0xffff;
+  }
+  static Vec AsciiToLower(Vec a) {
+    // Move 'A' to 'Z' down to the bottom of the signed range, so that a single
+    // signed comparison finds them.
+    Vec shifted = _mm_add_epi8(a, _mm_set1_epi8(static_cast<char>(0x80 - 'A')));
+    Vec isUpper = _mm_cmpgt_epi8(_mm_set1_epi8(static_cast<char>(0x80 + 26)), shifted);
+    return _mm_or_si128(a, _mm_and_si128(isUpper, _mm_set1_epi8(0x20)));
+  }
+};
+
+#include "./utf8_simd_kernels.h"
+
+// Transcoding only has a 128 bit implementation, as widening the bytes doesn't
+// need more than SSE2, and the AVX2 lanes would need extra shuffling. The same goes
+// for narrowing them back down when encoding UTF-16.
+//
+// Store 8 code units to either UTF-16 or UTF-32.
+template <typename CharT> static void StoreCodeUnits(CharT *aDest, __m128i aUnits) {
+  if constexpr (sizeof(CharT) == sizeof(char16_t)) {
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(aDest), aUnits);
+  } else {
+    __m128i zero = _mm_setzero_si128();
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(aDest),
+                     _mm_unpacklo_epi16(aUnits, zero));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(aDest + 4),
+                     _mm_unpackhi_epi16(aUnits, zero));
+  }
+}
+
+template <typename CharT>
+static size_t Transcode(const uint8_t *aSource, size_t aLength, CharT *aDest) {
+  const __m128i zero = _mm_setzero_si128();
+  size_t i = 0;
+  size_t written = 0;
+  // The destination is at least as long as the source, and never gets ahead of it,
+  // so writing a whole vector of code units is always in bounds.
+  while (i + 16 <= aLength) {
+    __m128i input = Ops::LoadUnaligned(aSource + i);
+    uint32_t highBits = Ops::MoveMask(input);
+    size_t asciiLength = std::countr_zero(highBits | 0x10000);
+    if (asciiLength >= 8) {
+      // Widen the ASCII, and then only keep the part that is actually ASCII.
+      StoreCodeUnits(aDest + written, _mm_unpacklo_epi8(input, zero));
+      StoreCodeUnits(aDest + written + 8, _mm_unpackhi_epi8(input, zero));
+      i += asciiLength;
+      written += asciiLength;
+      continue;
+    }
+
+    // Check for a run of 2 byte sequences, which is common for Latin, Greek,
+    // Cyrillic, Hebrew and Arabic. Valid text that starts with a 2 byte lead must
+    // have a continuation next, so it's enough to count the leads at even bytes.
+    uint32_t leads = Ops::MoveMask(
+        _mm_cmpeq_epi8(_mm_and_si128(input, Ops::Splat(0xe0)), Ops::Splat(0xc0)));
+    size_t pairCount = std::countr_zero((~leads & 0x5555) | 0x10000) / 2;
+    if (pairCount >= 4) {
+      // As 16 bit integers, the lead is the low byte and the continuation is the
+      // high byte, so put their bits back together. Only keep the leading pairs.
+      __m128i lead = _mm_and_si128(input, _mm_set1_epi16(0x001f));
+      __m128i continuation =
+          _mm_and_si128(_mm_srli_epi16(input, 8), _mm_set1_epi16(0x003f));
+      StoreCodeUnits(aDest + written,
+                     _mm_or_si128(_mm_slli_epi16(lead, 6), continuation));
+      i += pairCount * 2;
+      written += pairCount;
+      continue;
+    }
+
+    // The runs are too short to be worth it, so decode the rest of this vector one
+    // code point at a time.
+    size_t end = i + 16;
+    do {
+      if (aSource[i] < 0x80) {
+        aDest[written++] = aSource[i++];
+        continue;
+      }
+      char32_t codePoint;
+      i += DecodeCodePoint(aSource + i, codePoint);
+      written += WriteCodePoint(codePoint, aDest + written);
+    } while (i < end);
+  }
+  return written + TranscodeScalar(aSource + i, aLength - i, aDest + written);
+}
+
+// The shuffles that squeeze 8 code units that are each encoded into a 16 bit lane,
+// as either one byte of ASCII or two bytes, down into just their bytes. They are
+// indexed by a mask of which of the units are ASCII.
+struct OneOrTwoByteShuffles {
+  alignas(16) uint8_t mShuffles[256][16];
+  uint8_t mLengths[256];
+};
+
+static constexpr OneOrTwoByteShuffles MakeOneOrTwoByteShuffles() {
+  OneOrTwoByteShuffles table{};
+  for (size_t mask = 0; mask < 256; mask++) {
+    size_t length = 0;
+    for (size_t unit = 0; unit < 8; unit++) {
+      table.mShuffles[mask][length++] = unit * 2;
+      if (!(mask & (1 << unit))) {
+        table.mShuffles[mask][length++] = unit * 2 + 1;
+      }
+    }
+    table.mLengths[mask] = length;
+    for (; length < 16; length++) {
+      table.mShuffles[mask][length] = 0x80;
+    }
+  }
+  return table;
+}
+
+static constexpr OneOrTwoByteShuffles ONE_OR_TWO_BYTE_SHUFFLES =
+    MakeOneOrTwoByteShuffles();
+
+// Encode 8 code units at a time when they are all below U+0800, or all take three
+// bytes, which is how most text is, with 16 units at a time for runs of ASCII.
+// Anything else is encoded one code point at a time, until the next 8 code units.
+static size_t Utf16ToUtf8(const char16_t *aSource, size_t aLength, uint8_t *aDest) {
+  const __m128i notAscii = _mm_set1_epi16(static_cast<short>(0xff80));
+  const __m128i highFive = _mm_set1_epi16(static_cast<short>(0xf800));
+  const __m128i low6 = _mm_set1_epi16(0x3f);
+  // Where the bytes of 8 three byte sequences come from. The first two bytes of
+  // every sequence are packed into one vector, and the third bytes into another.
+  const __m128i firstTwoBytes =
+      _mm_setr_epi8(0, 1, -1, 2, 3, -1, 4, 5, -1, 6, 7, -1, 8, 9, -1, 10);
+  const __m128i lastBytes =
+      _mm_setr_epi8(-1, -1, 0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1);
+  const __m128i firstTwoBytesEnd =
+      _mm_setr_epi8(11, -1, 12, 13, -1, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+  const __m128i lastBytesEnd =
+      _mm_setr_epi8(-1, 5, -1, -1, 6, -1, -1, 7, -1, -1, -1, -1, -1, -1, -1, -1);
+
+  size_t i = 0;
+  size_t written = 0;
+  while (i + 8 <= aLength) {
+    __m128i units = _mm_loadu_si128(reinterpret_cast<const __m128i *>(aSource + i));
+    if (i + 16 <= aLength) {
+      __m128i next = _mm_loadu_si128(reinterpret_cast<const __m128i *>(aSource + i + 8));
+      if (Ops::IsZero(_mm_and_si128(_mm_or_si128(units, next), notAscii))) {
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(aDest + written),
+                         _mm_packus_epi16(units, next));
+        i += 16;
+        written += 16;
+        continue;
+      }
+    }
+
+    __m128i highBits = _mm_and_si128(units, highFive);
+    uint32_t isAscii = Ops::MoveMask(_mm_cmpeq_epi16(_mm_and_si128(units, notAscii),
+                                                     _mm_setzero_si128()));
+    uint32_t isShort = Ops::MoveMask(_mm_cmpeq_epi16(highBits, _mm_setzero_si128()));
+    if (isAscii == 0xffff) {
+      _mm_storel_epi64(reinterpret_cast<__m128i *>(aDest + written),
+                       _mm_packus_epi16(units, units));
+      i += 8;
+      written += 8;
+      continue;
+    }
+    if (isShort == 0xffff) {
+      // Encode every unit as two bytes, where the lead is the low byte of the 16 bit
+      // lane, then put the ASCII back, and squeeze out the bytes that aren't needed.
+      __m128i lead = _mm_or_si128(_mm_srli_epi16(units, 6), _mm_set1_epi16(0xc0));
+      __m128i continuation = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(units, low6), 8),
+                                          _mm_set1_epi16(static_cast<short>(0x8000)));
+      __m128i asciiLanes =
+          _mm_cmpeq_epi16(_mm_and_si128(units, notAscii), _mm_setzero_si128());
+      __m128i encoded = _mm_or_si128(_mm_and_si128(asciiLanes, units),
+                                     _mm_andnot_si128(asciiLanes,
+                                                      _mm_or_si128(lead, continuation)));
+      uint32_t mask = Ops::MoveMask(_mm_packs_epi16(asciiLanes, _mm_setzero_si128()));
+      __m128i shuffle = _mm_load_si128(
+          reinterpret_cast<const __m128i *>(ONE_OR_TWO_BYTE_SHUFFLES.mShuffles[mask]));
+      _mm_storeu_si128(reinterpret_cast<__m128i *>(aDest + written),
+                       _mm_shuffle_epi8(encoded, shuffle));
+      i += 8;
+      written += ONE_OR_TWO_BYTE_SHUFFLES.mLengths[mask];
+      continue;
+    }
+    uint32_t isSurrogate = Ops::MoveMask(
+        _mm_cmpeq_epi16(highBits, _mm_set1_epi16(static_cast<short>(0xd800))));
+    if ((isShort | isSurrogate) == 0) {
+      // Three bytes each, which are put in order with two shuffles.
+      __m128i lead = _mm_or_si128(_mm_srli_epi16(units, 12), _mm_set1_epi16(0xe0));
+      __m128i second = _mm_or_si128(_mm_and_si128(_mm_srli_epi16(units, 6), low6),
+                                    _mm_set1_epi16(0x80));
+      __m128i third = _mm_or_si128(_mm_and_si128(units, low6), _mm_set1_epi16(0x80));
+      __m128i firstTwo = _mm_or_si128(lead, _mm_slli_epi16(second, 8));
+      __m128i last = _mm_packus_epi16(third, third);
+      _mm_storeu_si128(reinterpret_cast<__m128i *>(aDest + written),
+                       _mm_or_si128(_mm_shuffle_epi8(firstTwo, firstTwoBytes),
+                                    _mm_shuffle_epi8(last, lastBytes)));
+      _mm_storel_epi64(reinterpret_cast<__m128i *>(aDest + written + 16),
+                       _mm_or_si128(_mm_shuffle_epi8(firstTwo, firstTwoBytesEnd),
+                                    _mm_shuffle_epi8(last, lastBytesEnd)));
+      i += 8;
+      written += 24;
+      continue;
+    }
+
+    size_t end = i + 8;
+    do {
+      if (aSource[i] < 0x80) {
+        aDest[written++] = static_cast<uint8_t>(aSource[i++]);
+        continue;
+      }
+      written += EncodeUtf16(aSource, aLength, i, aDest + written);
+    } while (i < end);
+  }
+  return written + Utf16ToUtf8Scalar(aSource + i, aLength - i, aDest + written);
+}
+
+} // namespace ssse3
+UTF8_SIMD_TARGET_END
+
+UTF8_SIMD_TARGET_AVX2
+namespace avx2 {
+
+struct Ops {
+  using Vec = __m256i;
+  static constexpr size_t WIDTH = 32;
+
+  static Vec LoadUnaligned(const uint8_t *aData) {
+    return _mm256_loadu_si256(reinterpret_cast<const __m256i *>(aData));
+  }
+  static Vec Zero() { return _mm256_setzero_si256(); }
+  static Vec Splat(uint8_t aByte) { return _mm256_set1_epi8(static_cast<char>(aByte)); }
+  static Vec And(Vec a, Vec b) { return _mm256_and_si256(a, b); }
+  static Vec Or(Vec a, Vec b) { return _mm256_or_si256(a, b); }
+  static Vec Xor(Vec a, Vec b) { return _mm256_xor_si256(a, b); }
+  static Vec SubSaturate(Vec a, Vec b) { return _mm256_subs_epu8(a, b); }
+  static Vec HighNibbles(Vec a) {
+    return _mm256_and_si256(_mm256_srli_epi16(a, 4), _mm256_set1_epi8(0x0f));
+  }
+  static Vec LowNibbles(Vec a) { return _mm256_and_si256(a, _mm256_set1_epi8(0x0f)); }
+  // The shuffle works within each 128 bit lane, which is why the tables repeat.
+  static Vec Lookup(const uint8_t *aTable, Vec aIndices) {
+    return _mm256_shuffle_epi8(
+        _mm256_load_si256(reinterpret_cast<const __m256i *>(aTable)), aIndices);
+  }
+  static Vec Incomplete() {
+    return _mm256_load_si256(reinterpret_cast<const __m256i *>(lookup::INCOMPLETE));
+  }
+  // The alignr instruction also works within lanes, so first build the register
+  // that holds the high lane of the previous block and the low lane of the input.
+  template <int N> static Vec Prev(Vec aInput, Vec aPrevious) {
+    return _mm256_alignr_epi8(aInput, _mm256_permute2x128_si256(aPrevious, aInput, 0x21),
+                              16 - N);
+  }
+  static uint32_t MoveMask(Vec a) { return _mm256_movemask_epi8(a); }
+  static Vec Sub(Vec a, Vec b) { return _mm256_sub_epi8(a, b); }
+  static Vec Continuations(Vec a) { return _mm256_cmpgt_epi8(_mm256_set1_epi8(-64), a); }
+  static size_t SumBytes(Vec a) {
+    __m256i sums = _mm256_sad_epu8(a, _mm256_setzero_si256());
+    __m128i lanes =
+        _mm_add_epi64(_mm256_castsi256_si128(sums), _mm256_extracti128_si256(sums, 1));
+    return _mm_extract_epi16(lanes, 0) + _mm_extract_epi16(lanes, 4);
+  }
+  static bool IsAscii(Vec a) { return _mm256_movemask_epi8(a) == 0; }
+  static bool IsZero(Vec a) { return _mm256_testz_si256(a, a); }
+  static uint32_t DifferentBytes(Vec a, Vec b) {
+    return ~static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(a, b)));
+  }
+  static Vec AsciiToLower(Vec a) {
+    Vec shifted = _mm256_add_epi8(a, _mm256_set1_epi8(static_cast<char>(0x80 - 'A')));
+    Vec isUpper =
+        _mm256_cmpgt_epi8(_mm256_set1_epi8(static_cast<char>(0x80 + 26)), shifted);
+    return _mm256_or_si256(a, _mm256_and_si256(isUpper, _mm256_set1_epi8(0x20)));
+  }
+};
+
+#include "./utf8_simd_kernels.h"
+
+} // namespace avx2
+UTF8_SIMD_TARGET_END
+
+#endif // UTF8_SIMD_X86
+
+size_t AsciiPrefixLength(Span<const uint8_t> aData, Isa aIsa) {
+  assert(IsSupported(aIsa));
+  switch (aIsa) {
+#ifdef UTF8_SIMD_X86
+  case Isa::Avx2:
+    return avx2::AsciiPrefixLength(aData.data(), aData.size());
+  case Isa::Ssse3:
+    return ssse3::AsciiPrefixLength(aData.data(), aData.size());
+#else
+  case Isa::Avx2:
+  case Isa::Ssse3:
+#endif
+  case Isa::Scalar:
+    return AsciiPrefixLengthScalar(aData.data(), aData.size());
+  }
+  return 0;
+}
+
+size_t AsciiPrefixLength(Span<const uint8_t> aData) {
+  return AsciiPrefixLength(aData, BestIsa());
+}
+
+bool IsAscii(Span<const uint8_t> aData) {
+  return AsciiPrefixLength(aData) == aData.size();
+}
+
+bool IsValidUtf8(Span<const uint8_t> aData, Isa aIsa) {
+  assert(IsSupported(aIsa));
+  switch (aIsa) {
+#ifdef UTF8_SIMD_X86
+  case Isa::Avx2:
+    return avx2::IsValidUtf8(aData.data(), aData.size());
+  case Isa::Ssse3:
+    return ssse3::IsValidUtf8(aData.data(), aData.size());
+#else
+  case Isa::Avx2:
+  case Isa::Ssse3:
+#endif
+  case Isa::Scalar:
+    return IsValidUtf8Scalar(aData.data(), aData.size());
+  }
+  return false;
+}
+
+bool IsValidUtf8(Span<const uint8_t> aData) { return IsValidUtf8(aData, BestIsa()); }
+
+size_t CountCodePoints(Span<const uint8_t> aData, Isa aIsa) {
+  assert(IsSupported(aIsa));
+  switch (aIsa) {
+#ifdef UTF8_SIMD_X86
+  case Isa::Avx2:
+    return avx2::CountCodePoints(aData.data(), aData.size());
+  case Isa::Ssse3:
+    return ssse3::CountCodePoints(aData.data(), aData.size());
+#else
+  case Isa::Avx2:
+  case Isa::Ssse3:
+#endif
+  case Isa::Scalar:
+    return CountCodePointsScalar(aData.data(), aData.size());
+  }
+  return 0;
+}
+
+size_t CountCodePoints(Span<const uint8_t> aData) {
+  return CountCodePoints(aData, BestIsa());
+}
+
+size_t CommonPrefixLengthIgnoringAsciiCase(Span<const uint8_t> aLeft,
+                                           Span<const uint8_t> aRight, Isa aIsa) {
+  assert(IsSupported(aIsa));
+  size_t length = std::min(aLeft.Length(), aRight.Length());
+  switch (aIsa) {
+#ifdef UTF8_SIMD_X86
+  case Isa::Avx2:
+    return avx2::CommonPrefixLengthIgnoringAsciiCase(aLeft.data(), aRight.data(), length);
+  case Isa::Ssse3:
+    return ssse3::CommonPrefixLengthIgnoringAsciiCase(aLeft.data(), aRight.data(),
+                                                      length);
+#else
+  case Isa::Avx2:
+  case Isa::Ssse3:
+#endif
+  case Isa::Scalar:
+    return CommonPrefixLengthIgnoringAsciiCaseScalar(aLeft.data(), aRight.data(),
+                                                     length);
+  }
+  return 0;
+}
+
+size_t CommonPrefixLengthIgnoringAsciiCase(Span<const uint8_t> aLeft,
+                                           Span<const uint8_t> aRight) {
+  return CommonPrefixLengthIgnoringAsciiCase(aLeft, aRight, BestIsa());
+}
+
+bool EqualsIgnoringAsciiCase(Span<const uint8_t> aLeft, Span<const uint8_t> aRight) {
+  return aLeft.Length() == aRight.Length() &&
+         CommonPrefixLengthIgnoringAsciiCase(aLeft, aRight) == aLeft.Length();
+}
+
+bool StartsWithIgnoringAsciiCase(Span<const uint8_t> aText,
+                                 Span<const uint8_t> aPrefix) {
+  return aText.Length() >= aPrefix.Length() &&
+         CommonPrefixLengthIgnoringAsciiCase(aText, aPrefix) == aPrefix.Length();
+}
+
+size_t ValidUtf8PrefixLength(Span<const uint8_t> aData) {
+  // Errors are rare, so only find where the error is when there is one.
+  if (IsValidUtf8(aData)) {
+    return aData.Length();
+  }
+  return ValidUtf8PrefixLengthScalar(aData.Elements(), aData.Length());
+}
+
+size_t Utf8ToUtf32(Span<const uint8_t> aSource, Span<char32_t> aDest, Isa aIsa) {
+  assert(IsSupported(aIsa));
+  assert(aDest.Length() >= aSource.Length());
+#ifdef UTF8_SIMD_X86
+  if (aIsa != Isa::Scalar) {
+    return ssse3::Transcode(aSource.Elements(), aSource.Length(), aDest.Elements());
+  }
+#endif
+  return TranscodeScalar(aSource.Elements(), aSource.Length(), aDest.Elements());
+}
+
+size_t Utf8ToUtf32(Span<const uint8_t> aSource, Span<char32_t> aDest) {
+  return Utf8ToUtf32(aSource, aDest, BestIsa());
+}
+
+size_t Utf8ToUtf16(Span<const uint8_t> aSource, Span<char16_t> aDest, Isa aIsa) {
+  assert(IsSupported(aIsa));
+  assert(aDest.Length() >= aSource.Length());
+#ifdef UTF8_SIMD_X86
+  if (aIsa != Isa::Scalar) {
+    return ssse3::Transcode(aSource.Elements(), aSource.Length(), aDest.Elements());
+  }
+#endif
+  return TranscodeScalar(aSource.Elements(), aSource.Length(), aDest.Elements());
+}
+
+size_t Utf8ToUtf16(Span<const uint8_t> aSource, Span<char16_t> aDest) {
+  return Utf8ToUtf16(aSource, aDest, BestIsa());
+}
+
+size_t Utf16ToUtf8(Span<const char16_t> aSource, Span<uint8_t> aDest, Isa aIsa) {
+  assert(IsSupported(aIsa));
+  assert(aDest.Length() >= aSource.Length() * 3);
+#ifdef UTF8_SIMD_X86
+  if (aIsa != Isa::Scalar) {
+    return ssse3::Utf16ToUtf8(aSource.Elements(), aSource.Length(), aDest.Elements());
+  }
+#endif
+  return Utf16ToUtf8Scalar(aSource.Elements(), aSource.Length(), aDest.Elements());
+}
+
+size_t Utf16ToUtf8(Span<const char16_t> aSource, Span<uint8_t> aDest) {
+  return Utf16ToUtf8(aSource, aDest, BestIsa());
+}
+
+} // namespace features::utf8::simd
@@ -0,0 +1,108 @@
+#pragma once
+#include "mfbt/Span.h"
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * Vectorized kernels for working with UTF-8 text. Every kernel has a scalar
+ * implementation that is always correct, and the vectorized implementations are
+ * chosen at runtime based on what the CPU supports.
+ */
+namespace features::utf8::simd {
+
+// The instruction sets that the kernels can be implemented with.
+enum class Isa { Scalar, Ssse3, Avx2 };
+
+const char *IsaName(Isa aIsa);
+
+// Is this instruction set available on the current CPU?
+bool IsSupported(Isa aIsa);
+
+// The best instruction set on the current CPU, this is computed once.
+Isa BestIsa();
+
+// The number of bytes at the start that are ASCII. This tests 8 bytes at a time
+// without SIMD, and 16 or 32 bytes at a time with it.
+size_t AsciiPrefixLength(mozilla::Span<const uint8_t> aData);
+size_t AsciiPrefixLength(mozilla::Span<const uint8_t> aData, Isa aIsa);
+
+bool IsAscii(mozilla::Span<const uint8_t> aData);
+
+/**
+ * Validate that the bytes are well-formed UTF-8, as defined by RFC 3629. This
+ * rejects overlong encodings, the UTF-16 surrogates U+D800 to U+DFFF, code points
+ * above U+10FFFF, stray continuation bytes, and truncated sequences.
+ */
+bool IsValidUtf8(mozilla::Span<const uint8_t> aData);
+
+// Validate with a specific instruction set, which must be supported. This is
+// mostly useful to test and benchmark the implementations against each other.
+bool IsValidUtf8(mozilla::Span<const uint8_t> aData, Isa aIsa);
+
+// Count the code points in valid UTF-8, by counting the bytes that aren't
+// continuation bytes.
+size_t CountCodePoints(mozilla::Span<const uint8_t> aData);
+size_t CountCodePoints(mozilla::Span<const uint8_t> aData, Isa aIsa);
+
+// The number of bytes at the start that are the same once the ASCII letters are
+// lowercased. Only ASCII letters are folded, and every other byte must be equal,
+// which is safe on UTF-8 as an ASCII byte is never part of a longer sequence.
+size_t CommonPrefixLengthIgnoringAsciiCase(mozilla::Span<const uint8_t> aLeft,
+                                           mozilla::Span<const uint8_t> aRight);
+size_t CommonPrefixLengthIgnoringAsciiCase(mozilla::Span<const uint8_t> aLeft,
+                                           mozilla::Span<const uint8_t> aRight, Isa aIsa);
+
+bool EqualsIgnoringAsciiCase(mozilla::Span<const uint8_t> aLeft,
+                             mozilla::Span<const uint8_t> aRight);
+bool StartsWithIgnoringAsciiCase(mozilla::Span<const uint8_t> aText,
+                                 mozilla::Span<const uint8_t> aPrefix);
+
+// The length of the text up until the start of the first invalid sequence, which
+// is the length of the text when it's all valid.
+size_t ValidUtf8PrefixLength(mozilla::Span<const uint8_t> aData);
+
+// Decode a single code point from valid UTF-8, returning how many bytes it used.
+inline size_t DecodeCodePoint(const uint8_t *aData, char32_t &aCodePoint) {
+  uint8_t byte = aData[0];
+  if (byte < 0x80) {
+    aCodePoint = byte;
+    return 1;
+  }
+  if (byte < 0xe0) {
+    aCodePoint = (byte & 0x1f) << 6 | (aData[1] & 0x3f);
+    return 2;
+  }
+  if (byte < 0xf0) {
+    aCodePoint = (byte & 0x0f) << 12 | (aData[1] & 0x3f) << 6 | (aData[2] & 0x3f);
+    return 3;
+  }
+  aCodePoint = (byte & 0x07) << 18 | (aData[1] & 0x3f) << 12 | (aData[2] & 0x3f) << 6 |
+               (aData[3] & 0x3f);
+  return 4;
+}
+
+/**
+ * Decode valid UTF-8 into UTF-32 or UTF-16, with fast paths for runs of ASCII and
+ * of 2 byte sequences. The output never has more code units than the input has
+ * bytes, so aDest must be at least as long as aSource, which is the same contract
+ * as mozilla::UnsafeConvertValidUtf8toUtf16 in mfbt/Utf8.h. Returns the number of
+ * code units that were written.
+ */
+size_t Utf8ToUtf32(mozilla::Span<const uint8_t> aSource, mozilla::Span<char32_t> aDest);
+size_t Utf8ToUtf32(mozilla::Span<const uint8_t> aSource, mozilla::Span<char32_t> aDest,
+                   Isa aIsa);
+size_t Utf8ToUtf16(mozilla::Span<const uint8_t> aSource, mozilla::Span<char16_t> aDest);
+size_t Utf8ToUtf16(mozilla::Span<const uint8_t> aSource, mozilla::Span<char16_t> aDest,
+                   Isa aIsa);
+
+/**
+ * Encode UTF-16 as UTF-8, replacing any unpaired surrogates with U+FFFD. A code
+ * unit never takes more than 3 bytes, so aDest must be at least 3 times as long as
+ * aSource, which is the same contract as mozilla::ConvertUtf16toUtf8 in
+ * mfbt/Utf8.h. Returns the number of bytes that were written.
+ */
+size_t Utf16ToUtf8(mozilla::Span<const char16_t> aSource, mozilla::Span<uint8_t> aDest);
+size_t Utf16ToUtf8(mozilla::Span<const char16_t> aSource, mozilla::Span<uint8_t> aDest,
+                   Isa aIsa);
+
+} // namespace features::utf8::simd
@@ -0,0 +1,117 @@
+// The vectorized kernels, written once against the Ops of an instruction set.
+//
+// This file is included by utf8_simd.cpp once per instruction set, inside of a
+// namespace that defines the Ops, and inside of a region where every function is
+// compiled for that target. That's why there is no include guard. The target
+// attribute can't be passed through a template, so this is how the kernels are
+// shared between the instruction sets.
+
+using Vec = Ops::Vec;
+
+static size_t AsciiPrefixLength(const uint8_t *aData, size_t aLength) {
+  size_t i = 0;
+  for (; i + Ops::WIDTH <= aLength; i += Ops::WIDTH) {
+    if (uint32_t highBits = Ops::MoveMask(Ops::LoadUnaligned(aData + i))) {
+      return i + std::countr_zero(highBits);
+    }
+  }
+  return i + AsciiPrefixLengthScalar(aData + i, aLength - i);
+}
+
+static size_t CountCodePoints(const uint8_t *aData, size_t aLength) {
+  size_t continuations = 0;
+  size_t i = 0;
+  while (i + Ops::WIDTH <= aLength) {
+    // Count in every byte of a vector, which can hold up to 255 before it overflows,
+    // and then add the bytes up.
+    Vec counts = Ops::Zero();
+    for (size_t blocks = 0; blocks < 255 && i + Ops::WIDTH <= aLength; blocks++) {
+      // Subtracting the 0xff, which is -1, adds one.
+      counts = Ops::Sub(counts, Ops::Continuations(Ops::LoadUnaligned(aData + i)));
+      i += Ops::WIDTH;
+    }
+    continuations += Ops::SumBytes(counts);
+  }
+  return i - continuations + CountCodePointsScalar(aData + i, aLength - i);
+}
+
+static size_t CommonPrefixLengthIgnoringAsciiCase(const uint8_t *aLeft,
+                                                  const uint8_t *aRight, size_t aLength) {
+  size_t i = 0;
+  for (; i + Ops::WIDTH <= aLength; i += Ops::WIDTH) {
+    Vec left = Ops::AsciiToLower(Ops::LoadUnaligned(aLeft + i));
+    Vec right = Ops::AsciiToLower(Ops::LoadUnaligned(aRight + i));
+    if (uint32_t different = Ops::DifferentBytes(left, right)) {
+      return i + std::countr_zero(different);
+    }
+  }
+  return i +
+         CommonPrefixLengthIgnoringAsciiCaseScalar(aLeft + i, aRight + i, aLength - i);
+}
+
+/**
+ * The state of the validator as it's carried from one block to the next.
+ */
+struct LookupValidator {
+  Vec mError = Ops::Zero();
+  Vec mPreviousInput = Ops::Zero();
+  Vec mPreviousIncomplete = Ops::Zero();
+
+  void Block(Vec aInput) {
+    if (Ops::IsAscii(aInput)) {
+      // A block of ASCII is only an error when the block before it ended early.
+      mError = Ops::Or(mError, mPreviousIncomplete);
+      mPreviousIncomplete = Ops::Zero();
+      mPreviousInput = aInput;
+      return;
+    }
+    Vec prev1 = Ops::Prev<1>(aInput, mPreviousInput);
+    Vec specialCases = Ops::And(
+        Ops::And(Ops::Lookup(lookup::BYTE_1_HIGH, Ops::HighNibbles(prev1)),
+                 Ops::Lookup(lookup::BYTE_1_LOW, Ops::LowNibbles(prev1))),
+        Ops::Lookup(lookup::BYTE_2_HIGH, Ops::HighNibbles(aInput)));
+
+    // Two continuation bytes in a row are only valid when the byte is the third or
+    // fourth of a sequence, which is when the byte 2 or 3 before it is a 3 or 4 byte
+    // lead. Both of those subtractions only leave the high bit set for those leads.
+    Vec prev2 = Ops::Prev<2>(aInput, mPreviousInput);
+    Vec prev3 = Ops::Prev<3>(aInput, mPreviousInput);
+    Vec isThirdByte = Ops::SubSaturate(prev2, Ops::Splat(0xe0 - 0x80));
+    Vec isFourthByte = Ops::SubSaturate(prev3, Ops::Splat(0xf0 - 0x80));
+    Vec mustBeContinuation =
+        Ops::And(Ops::Or(isThirdByte, isFourthByte), Ops::Splat(0x80));
+
+    mError = Ops::Or(mError, Ops::Xor(mustBeContinuation, specialCases));
+    mPreviousIncomplete = Ops::SubSaturate(aInput, Ops::Incomplete());
+    mPreviousInput = aInput;
+  }
+
+  bool Validate(const uint8_t *aData, size_t aLength) {
+    size_t i = 0;
+    while (i + Ops::WIDTH <= aLength) {
+      Vec input = Ops::LoadUnaligned(aData + i);
+      if (Ops::IsAscii(input)) {
+        // Skip over the whole run of ASCII blocks. Any ASCII block works as the
+        // previous input for the next block, as it only matters that it's ASCII.
+        size_t run = AsciiPrefixLength(aData + i, aLength - i) / Ops::WIDTH * Ops::WIDTH;
+        Block(input);
+        i += run;
+        continue;
+      }
+      Block(input);
+      i += Ops::WIDTH;
+    }
+    if (i < aLength) {
+      // Pad the end with zeros, which are ASCII, so a truncated sequence at the end
+      // is caught as being too short.
+      uint8_t tail[Ops::WIDTH] = {};
+      memcpy(tail, aData + i, aLength - i);
+      Block(Ops::LoadUnaligned(tail));
+    }
+    return Ops::IsZero(Ops::Or(mError, mPreviousIncomplete));
+  }
+};
+
+static bool IsValidUtf8(const uint8_t *aData, size_t aLength) {
+  return LookupValidator{}.Validate(aData, aLength);
+}
@@ -1,4 +1,5 @@
 #include "../includes/mfbt/RefPtr.h"
+#include "features/icu_allocations.h"
 #include "memory/Allocator.h"
 #include "memory/stack.h"
 #include "mfbt/TestMaybe.h"
@@ -16,10 +17,12 @@ namespace features {
   namespace classes         { void run_tests(); }
   namespace const_test      { void run_tests(); }
   namespace icu             { void run_tests(); }
+  namespace icu_bench       { void run_tests(); }
   namespace icu_capi        { void run_tests(); }
   namespace iterators       { void run_tests(); }
   namespace lvalueReference { void run_tests(); }
   namespace misc            { void run_tests(); }
+  namespace parallel        { void run_tests(); }
   namespace pointers        { void run_tests(); }
   namespace rvalueReference { void run_tests(); }
   namespace smartPointers   { void run_tests(); }
@@ -30,14 +33,22 @@ namespace features {
 // clang-format on
 
 int main() {
+  // ICU only takes allocation functions before it is first used.
+  if (!features::IcuAllocationCounter::Install()) {
+    std::cout << "\n Could not install the ICU allocation counter.\n";
+    return 1;
+  }
+
   features::arrays::run_tests();
   features::classes::run_tests();
   features::const_test::run_tests();
   features::icu::run_tests();
+  features::icu_bench::run_tests();
   features::icu_capi::run_tests();
   features::iterators::run_tests();
   features::lvalueReference::run_tests();
   features::misc::run_tests();
+  features::parallel::run_tests();
   features::pointers::run_tests();
   features::rvalueReference::run_tests();
   features::smartPointers::run_tests();
@@ -64,5 +75,7 @@ int main() {
   } catch (std::string e) {
   }
 
+  test::writeBenchmarks();
+
   std::cout << "\n All tests passed!\n";
 }
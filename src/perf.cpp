@@ -0,0 +1,142 @@
+#include "perf.h"
+#include <cstdlib>
+
+#ifdef __linux__
+#include <cstring>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace test {
+
+#ifdef __linux__
+
+static int openCounter(uint32_t aType, uint64_t aConfig) {
+  perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = aType;
+  attr.config = aConfig;
+  attr.disabled = 1;
+  // Only count the benchmark itself. This is also required to open the counters
+  // when perf_event_paranoid is 2, which is the default.
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  // Also count any threads that the benchmark body spawns.
+  attr.inherit = 1;
+  attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+  return static_cast<int>(syscall(SYS_perf_event_open, &attr, /* pid */ 0,
+                                  /* cpu */ -1, /* group_fd */ -1, PERF_FLAG_FD_CLOEXEC));
+}
+
+PerfCounters::PerfCounters() {
+  mFds[Cycles] = openCounter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+  mFds[Instructions] = openCounter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+  mFds[CacheMisses] = openCounter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+  mFds[BranchMisses] = openCounter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES);
+  mFds[PageFaults] = openCounter(PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS);
+}
+
+PerfCounters::~PerfCounters() {
+  for (int fd : mFds) {
+    if (fd >= 0) {
+      close(fd);
+    }
+  }
+}
+
+void PerfCounters::Start() {
+  for (int fd : mFds) {
+    if (fd >= 0) {
+      ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+      ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+  }
+}
+
+void PerfCounters::Stop() {
+  for (int fd : mFds) {
+    if (fd >= 0) {
+      ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+    }
+  }
+}
+
+PerfCounters::Values PerfCounters::Read() const {
+  Values values;
+  for (size_t i = 0; i < Count; i++) {
+    // The layout that matches the read_format above.
+    struct {
+      uint64_t value;
+      uint64_t timeEnabled;
+      uint64_t timeRunning;
+    } data;
+    if (mFds[i] < 0 || read(mFds[i], &data, sizeof(data)) != sizeof(data)) {
+      continue;
+    }
+    if (data.timeRunning == 0) {
+      // The counter was never scheduled, so there is nothing to report.
+      if (data.timeEnabled != 0) {
+        continue;
+      }
+      values.counts[i] = mozilla::Some(uint64_t(0));
+    } else if (data.timeRunning < data.timeEnabled) {
+      values.counts[i] = mozilla::Some(static_cast<uint64_t>(
+          static_cast<double>(data.value) * data.timeEnabled / data.timeRunning));
+    } else {
+      values.counts[i] = mozilla::Some(data.value);
+    }
+  }
+  return values;
+}
+
+#else
+
+PerfCounters::PerfCounters() {
+  for (int &fd : mFds) {
+    fd = -1;
+  }
+}
+
+PerfCounters::~PerfCounters() {}
+void PerfCounters::Start() {}
+void PerfCounters::Stop() {}
+PerfCounters::Values PerfCounters::Read() const { return Values{}; }
+
+#endif
+
+bool PerfCounters::IsAvailable() const {
+  for (int fd : mFds) {
+    if (fd >= 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+const char *PerfCounters::Name(Counter aCounter) {
+  switch (aCounter) {
+  case Cycles:
+    return "cycles";
+  case Instructions:
+    return "instructions";
+  case CacheMisses:
+    return "cache_misses";
+  case BranchMisses:
+    return "branch_misses";
+  case PageFaults:
+    return "page_faults";
+  case Count:
+    break;
+  }
+  return "unknown";
+}
+
+bool PerfCounters::IsEnabled() {
+  const char *enabled = std::getenv("BENCH_COUNTERS");
+  return enabled && std::string(enabled) != "0";
+}
+
+} // namespace test
@@ -0,0 +1,53 @@
+#pragma once
+#include "mfbt/Maybe.h"
+#include <cstdint>
+#include <string>
+
+namespace test {
+
+/**
+ * Hardware performance counters, read through Linux's perf_event_open. These
+ * answer questions that wall time can't, like whether a loop is stalled on cache
+ * misses or on mispredicted branches.
+ *
+ * Each counter is opened on its own rather than as a group, so that when some of
+ * them are unavailable, which is common in containers and virtual machines, the
+ * rest still work. Page faults are a software event, and tend to be available
+ * even when the hardware counters are not. On other platforms every counter is
+ * unavailable.
+ */
+class PerfCounters {
+public:
+  enum Counter { Cycles, Instructions, CacheMisses, BranchMisses, PageFaults, Count };
+
+  struct Values {
+    // Nothing for any counter that couldn't be opened.
+    mozilla::Maybe<uint64_t> counts[Count];
+  };
+
+  PerfCounters();
+  ~PerfCounters();
+  PerfCounters(const PerfCounters &) = delete;
+  PerfCounters &operator=(const PerfCounters &) = delete;
+
+  // True when at least one of the counters could be opened.
+  bool IsAvailable() const;
+
+  // Resets and starts all of the counters for the calling thread.
+  void Start();
+  void Stop();
+
+  // The counts between Start and Stop. When the kernel had to multiplex the
+  // counters, the counts are scaled up by the fraction of time they ran.
+  Values Read() const;
+
+  static const char *Name(Counter);
+
+  // Counters are opt-in through the BENCH_COUNTERS environment variable.
+  static bool IsEnabled();
+
+private:
+  int mFds[Count];
+};
+
+} // namespace test
@@ -1,4 +1,8 @@
 #include "test.h"
+#include "mfbt/JSONWriter.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
 #include <iostream>
 
 namespace test {
@@ -33,6 +37,182 @@ void info(const std::string &message) {
   std::cout << GREEN << "    ✔ " << RESET << WHITE << message << RESET << "\n";
 }
 
+// Every result that has been reported, in order, for writeBenchmarks.
+static std::vector<BenchmarkResult> sBenchmarkResults;
+
+BenchmarkResult summarizeBenchmark(const std::string &name, size_t iterations,
+                                   std::vector<double> nsPerIteration) {
+  std::sort(nsPerIteration.begin(), nsPerIteration.end());
+  size_t count = nsPerIteration.size();
+  auto percentile = [&](double p) {
+    // Linearly interpolate between the closest ranks.
+    double rank = p * (count - 1);
+    size_t lower = static_cast<size_t>(rank);
+    size_t upper = std::min(lower + 1, count - 1);
+    return nsPerIteration[lower] +
+           (nsPerIteration[upper] - nsPerIteration[lower]) * (rank - lower);
+  };
+
+  double sum = 0;
+  for (double ns : nsPerIteration) {
+    sum += ns;
+  }
+  double mean = sum / count;
+  double squares = 0;
+  for (double ns : nsPerIteration) {
+    squares += (ns - mean) * (ns - mean);
+  }
+
+  return BenchmarkResult{name,
+                         iterations,
+                         count,
+                         mean,
+                         percentile(0.5),
+                         percentile(0.9),
+                         percentile(0.99),
+                         count > 1 ? std::sqrt(squares / (count - 1)) : 0,
+                         nsPerIteration.front(),
+                         nsPerIteration.back()};
+}
+
+void addBenchmarkCounters(BenchmarkResult &result, const PerfCounters::Values &values,
+                          size_t totalIterations) {
+  for (size_t i = 0; i < PerfCounters::Count; i++) {
+    if (values.counts[i]) {
+      result.counters[i] =
+          mozilla::Some(static_cast<double>(*values.counts[i]) / totalIterations);
+    }
+  }
+}
+
+// Picks a unit so that the printed number stays readable.
+static std::string formatNs(double ns) {
+  char buffer[32];
+  if (ns < 1e3) {
+    snprintf(buffer, sizeof(buffer), "%.2f ns", ns);
+  } else if (ns < 1e6) {
+    snprintf(buffer, sizeof(buffer), "%.2f µs", ns / 1e3);
+  } else {
+    snprintf(buffer, sizeof(buffer), "%.2f ms", ns / 1e6);
+  }
+  return buffer;
+}
+
+void reportBenchmark(const BenchmarkResult &result) {
+  std::cout << "    ℹ " << result.name << ": " << formatNs(result.median)
+            << " median, " << formatNs(result.p90) << " p90, " << formatNs(result.p99)
+            << " p99, ±" << formatNs(result.stddev) << " (" << result.samples << " × "
+            << result.iterations << " iterations)\n";
+
+  bool hasCounters = false;
+  std::string counters;
+  for (size_t i = 0; i < PerfCounters::Count; i++) {
+    auto counter = static_cast<PerfCounters::Counter>(i);
+    char buffer[64];
+    if (result.counters[i]) {
+      hasCounters = true;
+      snprintf(buffer, sizeof(buffer), "%s%s %.2f", counters.empty() ? "" : ", ",
+               PerfCounters::Name(counter), *result.counters[i]);
+    } else {
+      snprintf(buffer, sizeof(buffer), "%s%s n/a", counters.empty() ? "" : ", ",
+               PerfCounters::Name(counter));
+    }
+    counters += buffer;
+  }
+  auto &cycles = result.counters[PerfCounters::Cycles];
+  auto &instructions = result.counters[PerfCounters::Instructions];
+  if (cycles && instructions && *cycles > 0) {
+    char buffer[32];
+    snprintf(buffer, sizeof(buffer), ", IPC %.2f", *instructions / *cycles);
+    counters += buffer;
+  }
+  if (!hasCounters) {
+    counters.clear();
+  }
+  if (result.allocations) {
+    char buffer[64];
+    snprintf(buffer, sizeof(buffer), "%sallocations %.2f", counters.empty() ? "" : ", ",
+             *result.allocations);
+    counters += buffer;
+  }
+  if (!counters.empty()) {
+    std::cout << "      per iteration: " << counters << "\n";
+  }
+  if (!hasCounters && PerfCounters::IsEnabled()) {
+    static bool hasWarned = false;
+    if (!hasWarned) {
+      hasWarned = true;
+      std::cout << "      performance counters are unavailable, check "
+                   "/proc/sys/kernel/perf_event_paranoid\n";
+    }
+  }
+
+  sBenchmarkResults.push_back(result);
+}
+
+class FileWriteFunc final : public mozilla::JSONWriteFunc {
+public:
+  explicit FileWriteFunc(FILE *aFile) : mFile(aFile) {}
+  void Write(const mozilla::Span<const char> &aStr) override {
+    fwrite(aStr.data(), 1, aStr.size(), mFile);
+  }
+
+private:
+  FILE *mFile;
+};
+
+void writeBenchmarks() {
+  // Run with BENCH_JSON=path to write the results to a file, or BENCH_JSON=- to
+  // write them to stdout.
+  const char *path = std::getenv("BENCH_JSON");
+  if (!path || sBenchmarkResults.empty()) {
+    return;
+  }
+  bool isStdout = std::string_view(path) == "-";
+  FILE *file = isStdout ? stdout : fopen(path, "w");
+  if (!file) {
+    std::cout << RED << "Unable to open " << path << " to write the benchmarks" << RESET
+              << "\n";
+    return;
+  }
+
+  {
+    mozilla::JSONWriter writer(mozilla::MakeUnique<FileWriteFunc>(file));
+    writer.Start();
+    writer.StartArrayProperty("benchmarks");
+    for (const BenchmarkResult &result : sBenchmarkResults) {
+      writer.StartObjectElement(writer.SingleLineStyle);
+      writer.StringProperty("name", mozilla::MakeStringSpan(result.name.c_str()));
+      writer.IntProperty("iterations", result.iterations);
+      writer.IntProperty("samples", result.samples);
+      writer.DoubleProperty("mean_ns", result.mean);
+      writer.DoubleProperty("median_ns", result.median);
+      writer.DoubleProperty("p90_ns", result.p90);
+      writer.DoubleProperty("p99_ns", result.p99);
+      writer.DoubleProperty("stddev_ns", result.stddev);
+      writer.DoubleProperty("min_ns", result.min);
+      writer.DoubleProperty("max_ns", result.max);
+      for (size_t i = 0; i < PerfCounters::Count; i++) {
+        if (result.counters[i]) {
+          writer.DoubleProperty(mozilla::MakeStringSpan(PerfCounters::Name(
+                                    static_cast<PerfCounters::Counter>(i))),
+                                *result.counters[i]);
+        }
+      }
+      if (result.allocations) {
+        writer.DoubleProperty("allocations", *result.allocations);
+      }
+      writer.EndObject();
+    }
+    writer.EndArray();
+    writer.End();
+  }
+
+  if (!isStdout) {
+    fclose(file);
+  }
+}
+
 void run_tests() {
   test::suite("src::test", []() {
     test::describe("Assertions", []() {
@@ -41,6 +221,64 @@ void run_tests() {
       test::equal(true, true, "Equality does work");
       // test::equal(true, false, "Inequality throws");
     });
+
+    test::describe("Benchmark statistics", []() {
+      auto result = summarizeBenchmark("statistics", 10, {5, 1, 4, 2, 3});
+      test::equal(result.median, 3.0, "The median is the middle sample");
+      test::equal(result.mean, 3.0, "The mean");
+      test::equal(result.min, 1.0, "The min");
+      test::equal(result.max, 5.0, "The max");
+      test::ok(std::abs(result.p90 - 4.6) < 1e-9, "The p90 is interpolated between ranks");
+      test::ok(std::abs(result.stddev - std::sqrt(2.5)) < 1e-9, "The sample stddev");
+    });
+
+    test::describe("Benchmarks adapt their iteration count", []() {
+      BenchmarkOptions options;
+      options.samples = 3;
+      size_t runs = 0;
+      auto result = benchmark("counting", [&]() { DoNotOptimize(runs++); }, options);
+      test::ok(result.iterations > 1000, "A trivial body runs many iterations");
+      test::ok(runs > options.warmupRuns + result.iterations * options.samples,
+               "The body runs during the warmup, calibration and sampling");
+    });
+
+    test::describe("Benchmarks count allocations", []() {
+      static size_t sAllocations = 0;
+      BenchmarkOptions options;
+      options.samples = 3;
+      options.allocations = []() { return sAllocations; };
+      auto result = benchmark("allocating", [&]() { sAllocations += 2; }, options);
+      test::ok(result.allocations.isSome(), "The allocations are counted");
+      test::equal(*result.allocations, 2.0, "Per iteration");
+      options.allocations = nullptr;
+      result =
+          benchmark("not allocating", [&]() { DoNotOptimize(sAllocations); }, options);
+      test::ok(result.allocations.isNothing(), "Only when there is a counter");
+    });
+
+    test::describe("Performance counters", []() {
+      PerfCounters counters;
+      if (!counters.IsAvailable()) {
+        test::info("Performance counters are unavailable, skipping");
+        return;
+      }
+      volatile uint64_t sum = 0;
+      counters.Start();
+      for (uint64_t i = 0; i < 1000000; i++) {
+        sum = sum + i;
+      }
+      counters.Stop();
+      auto values = counters.Read();
+      if (values.counts[PerfCounters::Instructions]) {
+        test::ok(*values.counts[PerfCounters::Instructions] > 1000000,
+                 "Counted at least one instruction per iteration");
+      }
+      if (values.counts[PerfCounters::PageFaults]) {
+        test::ok(*values.counts[PerfCounters::PageFaults] < 1000,
+                 "The loop barely touches new memory");
+      }
+      test::info("The counters that are available can be read");
+    });
   });
 }
 
@@ -1,7 +1,10 @@
 #pragma once
+#include "perf.h"
+#include <chrono>
 #include <iostream>
 #include <string_view>
 #include <functional>
+#include <vector>
 
 namespace test {
 
@@ -63,4 +66,132 @@ void equal(A a, B b, const std::string &message = std::string{"A and B are equal
 // This macro shows off something that will not compile
 #define COMPILER_ERROR(...)
 
+/**
+ * Benchmarking
+ *
+ * A benchmark runs its body a few times untimed to warm up the caches and branch
+ * predictors, then picks an iteration count so that a single timed sample takes
+ * at least `minSampleTime`, which keeps fast bodies from being swamped by the
+ * resolution of the clock. The statistics are computed over the per-iteration
+ * time of every sample, and each result is printed, and also recorded so that
+ * `writeBenchmarks` can emit all of them as JSON at the end of the run.
+ *
+ * When BENCH_COUNTERS is set, the hardware performance counters are also read
+ * around the timed samples, and reported per iteration next to the timings. In the
+ * same way, a benchmark can pass a function that counts allocations, to report
+ * the allocations per iteration.
+ */
+
+// Forces the compiler to assume that the value is read, so that the computation
+// that produced it can't be optimized away.
+template <typename T> inline void DoNotOptimize(const T &value) {
+  asm volatile("" : : "r,m"(value) : "memory");
+}
+
+// Forces the compiler to assume that all memory is read and written, so that
+// stores from the body can't be elided or moved across the timer.
+inline void ClobberMemory() { asm volatile("" : : : "memory"); }
+
+struct BenchmarkOptions {
+  size_t warmupRuns = 3;
+  size_t samples = 20;
+  std::chrono::nanoseconds minSampleTime = std::chrono::milliseconds(2);
+  size_t maxIterations = 1 << 24;
+  bool counters = PerfCounters::IsEnabled();
+  // A running count of allocations, like IcuAllocationCounter::Count, that is
+  // read before and after the timed samples.
+  size_t (*allocations)() = nullptr;
+};
+
+struct BenchmarkResult {
+  std::string name;
+  size_t iterations;
+  size_t samples;
+  // All of the times are in nanoseconds per iteration.
+  double mean;
+  double median;
+  double p90;
+  double p99;
+  double stddev;
+  double min;
+  double max;
+  // The counters per iteration, when they were enabled and available.
+  mozilla::Maybe<double> counters[PerfCounters::Count];
+  // The allocations per iteration, when there was a function to count them.
+  mozilla::Maybe<double> allocations;
+};
+
+BenchmarkResult summarizeBenchmark(const std::string &name, size_t iterations,
+                                   std::vector<double> nsPerIteration);
+void addBenchmarkCounters(BenchmarkResult &, const PerfCounters::Values &,
+                          size_t totalIterations);
+void reportBenchmark(const BenchmarkResult &);
+void writeBenchmarks();
+
+template <typename F>
+BenchmarkResult benchmark(const std::string &name, F &&body,
+                          const BenchmarkOptions &options = BenchmarkOptions{}) {
+  using Clock = std::chrono::steady_clock;
+  auto runBatch = [&](size_t iterations) {
+    auto before = Clock::now();
+    for (size_t i = 0; i < iterations; i++) {
+      body();
+      ClobberMemory();
+    }
+    return std::chrono::nanoseconds(Clock::now() - before);
+  };
+
+  for (size_t i = 0; i < options.warmupRuns; i++) {
+    body();
+    ClobberMemory();
+  }
+
+  // Grow the iteration count until a batch takes long enough to measure.
+  size_t iterations = 1;
+  while (iterations < options.maxIterations) {
+    auto elapsed = runBatch(iterations);
+    if (elapsed >= options.minSampleTime) {
+      break;
+    }
+    size_t scaled = elapsed.count() > 0
+                        ? iterations * options.minSampleTime.count() * 5 /
+                              (elapsed.count() * 4)
+                        : iterations * 10;
+    iterations = std::min(options.maxIterations,
+                          std::max(iterations * 2, std::min(scaled, iterations * 10)));
+  }
+
+  mozilla::Maybe<PerfCounters> counters;
+  if (options.counters) {
+    counters.emplace();
+    counters->Start();
+  }
+
+  std::vector<double> nsPerIteration;
+  nsPerIteration.reserve(options.samples);
+  size_t allocationsBefore = options.allocations ? options.allocations() : 0;
+  for (size_t sample = 0; sample < options.samples; sample++) {
+    nsPerIteration.push_back(static_cast<double>(runBatch(iterations).count()) /
+                             iterations);
+  }
+  // Stop counting before anything else runs, so only the samples are counted.
+  if (counters) {
+    counters->Stop();
+  }
+
+  size_t allocationsAfter = options.allocations ? options.allocations() : 0;
+
+  BenchmarkResult result = summarizeBenchmark(name, iterations, std::move(nsPerIteration));
+  if (options.allocations) {
+    result.allocations = mozilla::Some(static_cast<double>(allocationsAfter -
+                                                           allocationsBefore) /
+                                       (iterations * options.samples));
+  }
+  if (counters) {
+    addBenchmarkCounters(result, counters->Read(), iterations * options.samples);
+  }
+  reportBenchmark(result);
+  return result;
+}
+
 } // namespace test
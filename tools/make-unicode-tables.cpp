@@ -0,0 +1,309 @@
+// Generate the Unicode property tables in src/features from ICU's data, so that the
+// tables match the Unicode version of the ICU that the tests compare against. Run
+// this with ./make-unicode-tables.sh rather than directly.
+//
+// Every table is a two stage trie. The code point's high bits index into a table
+// of blocks, and the low bits index into the block. Most blocks are the same, so
+// they are shared between the high bits.
+#include "unicode/uchar.h"
+#include "unicode/uscript.h"
+#include "unicode/uversion.h"
+#include <cstdint>
+#include <cstdlib>
+#include <cstdio>
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+
+// The grapheme cluster break categories, in the order that they are written out.
+static const char *CATEGORY_NAMES[] = {
+    "Other",  "CR",          "LF", "Control", "Extend", "ZWJ", "RegionalIndicator",
+    "Prepend", "SpacingMark", "L",  "V",       "T",      "LV",  "LVT",
+};
+
+// The Hangul syllables alternate between LV and LVT, which is computed instead of
+// stored so that their blocks can be shared.
+const UChar32 HANGUL_SYLLABLE_START = 0xac00;
+const UChar32 HANGUL_SYLLABLE_COUNT = 11172;
+
+// Only the first two planes and the tags and variation selectors in plane 14 have
+// anything but Other, so the rest are left out of the tables. The plane 14 block
+// is moved down to follow the first two planes.
+const UChar32 LOW_PLANES_END = 0x20000;
+const UChar32 PLANE_14_START = 0xe0000;
+const UChar32 PLANE_14_END = 0xe1000;
+
+static uint8_t category(UChar32 aCodePoint) {
+  if (aCodePoint >= HANGUL_SYLLABLE_START &&
+      aCodePoint < HANGUL_SYLLABLE_START + HANGUL_SYLLABLE_COUNT) {
+    return 13;
+  }
+  switch (u_getIntPropertyValue(aCodePoint, UCHAR_GRAPHEME_CLUSTER_BREAK)) {
+  case U_GCB_CR:
+    return 1;
+  case U_GCB_LF:
+    return 2;
+  case U_GCB_CONTROL:
+    return 3;
+  case U_GCB_EXTEND:
+    return 4;
+  case U_GCB_ZWJ:
+    return 5;
+  case U_GCB_REGIONAL_INDICATOR:
+    return 6;
+  case U_GCB_PREPEND:
+    return 7;
+  case U_GCB_SPACING_MARK:
+    return 8;
+  case U_GCB_L:
+    return 9;
+  case U_GCB_V:
+    return 10;
+  case U_GCB_T:
+    return 11;
+  case U_GCB_LV:
+    return 12;
+  case U_GCB_LVT:
+    return 13;
+  default:
+    return 0;
+  }
+}
+
+// ICU keeps Indic conjuncts together, ahead of the Indic_Conjunct_Break property
+// that Unicode 15.1 added for this. These are the scripts that ICU's rules use.
+static bool isConjunctScript(UChar32 aCodePoint) {
+  UErrorCode status = U_ZERO_ERROR;
+  switch (uscript_getScript(aCodePoint, &status)) {
+  case USCRIPT_BENGALI:
+  case USCRIPT_DEVANAGARI:
+  case USCRIPT_GUJARATI:
+  case USCRIPT_MALAYALAM:
+  case USCRIPT_ORIYA:
+  case USCRIPT_TELUGU:
+    return true;
+  default:
+    return false;
+  }
+}
+
+static int32_t properties(UChar32 aCodePoint) {
+  int32_t value = category(aCodePoint);
+  if (u_hasBinaryProperty(aCodePoint, UCHAR_EXTENDED_PICTOGRAPHIC)) {
+    value |= 0x80;
+  }
+  if (isConjunctScript(aCodePoint) &&
+      u_getIntPropertyValue(aCodePoint, UCHAR_INDIC_SYLLABIC_CATEGORY) ==
+          U_INSC_CONSONANT) {
+    value |= 0x40;
+  }
+  if (isConjunctScript(aCodePoint) && u_getCombiningClass(aCodePoint) == 9) {
+    value |= 0x20;
+  }
+  if ((value & 0xf) == 5 || ((value & 0xf) == 4 && u_getCombiningClass(aCodePoint))) {
+    value |= 0x10;
+  }
+  return value;
+}
+
+const size_t COLUMN_LIMIT = 90;
+
+// Print an array of numbers, wrapped to fit in the column limit.
+static void printArray(FILE *aFile, const char *aType, const char *aName,
+                       const std::vector<int32_t> &aValues) {
+  fprintf(aFile, "static const %s %s[%zu] = {", aType, aName, aValues.size());
+  size_t column = COLUMN_LIMIT;
+  for (int32_t value : aValues) {
+    std::string text = std::to_string(value) + ",";
+    if (column + 1 + text.size() > COLUMN_LIMIT) {
+      fprintf(aFile, "\n   ");
+      column = 3;
+    }
+    fprintf(aFile, " %s", text.c_str());
+    column += 1 + text.size();
+  }
+  fprintf(aFile, "\n};\n\n");
+}
+
+struct Trie {
+  std::vector<int32_t> stage1;
+  std::vector<int32_t> stage2;
+  size_t blockCount = 0;
+
+  bool isStage1Wide() const { return blockCount > 256; }
+  size_t bytes() const {
+    return stage1.size() * (isStage1Wide() ? 2 : 1) + stage2.size();
+  }
+
+  void print(FILE *aFile, const char *aPrefix) const {
+    std::string prefix = aPrefix;
+    printArray(aFile, isStage1Wide() ? "uint16_t" : "uint8_t",
+               (prefix + "_STAGE1").c_str(), stage1);
+    printArray(aFile, "uint8_t", (prefix + "_STAGE2").c_str(), stage2);
+  }
+};
+
+// Build a trie of the byte values of every index in [0, aEnd).
+static Trie buildTrie(UChar32 aShift, UChar32 aEnd,
+                      const std::function<int32_t(UChar32)> &aValueOf) {
+  const UChar32 blockSize = 1 << aShift;
+  Trie trie;
+  std::map<std::vector<int32_t>, int32_t> blockIndexes;
+  for (UChar32 blockStart = 0; blockStart < aEnd; blockStart += blockSize) {
+    std::vector<int32_t> block;
+    for (UChar32 index = blockStart; index < blockStart + blockSize; index++) {
+      block.push_back(aValueOf(index));
+    }
+    auto [entry, isNew] = blockIndexes.try_emplace(block, blockIndexes.size());
+    if (isNew) {
+      trie.stage2.insert(trie.stage2.end(), block.begin(), block.end());
+    }
+    trie.stage1.push_back(entry->second);
+  }
+  trie.blockCount = blockIndexes.size();
+  return trie;
+}
+
+static FILE *openHeader(const char *aPath) {
+  FILE *file = fopen(aPath, "w");
+  if (!file) {
+    perror("Unable to open the output");
+    exit(1);
+  }
+  fprintf(file,
+          "// Generated by make-unicode-tables.sh from ICU %s, which is Unicode %s.\n"
+          "// Do not edit this file by hand.\n"
+          "#pragma once\n"
+          "#include <stdint.h>\n\n"
+          "namespace features::utf8::tables {\n\n",
+          U_ICU_VERSION, U_UNICODE_VERSION);
+  return file;
+}
+
+static void closeHeader(FILE *aFile, const char *aPath, const Trie &aTrie,
+                        size_t aBytes) {
+  fprintf(aFile, "} // namespace features::utf8::tables\n");
+  fclose(aFile);
+  printf("Wrote %s with %zu blocks, %zu bytes\n", aPath, aTrie.blockCount, aBytes);
+}
+
+static void writeGraphemeTable(const char *aPath) {
+  for (UChar32 codePoint = LOW_PLANES_END; codePoint <= UCHAR_MAX_VALUE; codePoint++) {
+    if ((codePoint < PLANE_14_START || codePoint >= PLANE_14_END) &&
+        properties(codePoint) != 0) {
+      fprintf(stderr, "U+%04X is outside of the tables, but isn't Other.\n", codePoint);
+      exit(1);
+    }
+  }
+  const UChar32 shift = 6;
+  Trie trie = buildTrie(
+      shift, LOW_PLANES_END + (PLANE_14_END - PLANE_14_START), [](UChar32 aIndex) {
+        return properties(aIndex < LOW_PLANES_END
+                              ? aIndex
+                              : aIndex - LOW_PLANES_END + PLANE_14_START);
+      });
+
+  FILE *file = openHeader(aPath);
+  fprintf(file, "// The Grapheme_Cluster_Break property from UAX #29.\n"
+                "enum class GraphemeBreak : uint8_t {\n");
+  for (const char *name : CATEGORY_NAMES) {
+    fprintf(file, "  %s,\n", name);
+  }
+  fprintf(file,
+          "};\n\n"
+          "// Flags that are set on top of the category. The conjunct flags are what\n"
+          "// ICU uses to keep Indic conjuncts together, which Unicode 15.1 adds as\n"
+          "// GB9c.\n"
+          "constexpr uint8_t CATEGORY_MASK = 0x0f;\n"
+          "constexpr uint8_t EXTENDED_PICTOGRAPHIC = 0x80;\n"
+          "constexpr uint8_t CONJUNCT_CONSONANT = 0x40;\n"
+          "constexpr uint8_t CONJUNCT_LINKER = 0x20;\n"
+          "constexpr uint8_t CONJUNCT_EXTEND = 0x10;\n\n"
+          "// %zu bytes in total.\n"
+          "constexpr uint32_t GRAPHEME_SHIFT = %d;\n\n",
+          trie.bytes(), shift);
+  trie.print(file, "GRAPHEME");
+  fprintf(file,
+          "inline uint8_t GraphemeProperties(char32_t aCodePoint) {\n"
+          "  // The Hangul syllables alternate between LV and LVT.\n"
+          "  if (aCodePoint - 0x%x < %d) {\n"
+          "    return static_cast<uint8_t>((aCodePoint - 0x%x) %% 28 == 0\n"
+          "                                    ? GraphemeBreak::LV\n"
+          "                                    : GraphemeBreak::LVT);\n"
+          "  }\n"
+          "  // Only planes 0, 1 and the start of 14 are in the tables.\n"
+          "  if (aCodePoint >= 0x%x) {\n"
+          "    if (aCodePoint - 0x%x >= 0x%x) {\n"
+          "      return static_cast<uint8_t>(GraphemeBreak::Other);\n"
+          "    }\n"
+          "    aCodePoint = aCodePoint - 0x%x + 0x%x;\n"
+          "  }\n"
+          "  uint32_t block = GRAPHEME_STAGE1[aCodePoint >> GRAPHEME_SHIFT];\n"
+          "  return GRAPHEME_STAGE2[(block << GRAPHEME_SHIFT) |\n"
+          "                         (aCodePoint & ((1 << GRAPHEME_SHIFT) - 1))];\n"
+          "}\n\n",
+          HANGUL_SYLLABLE_START, HANGUL_SYLLABLE_COUNT, HANGUL_SYLLABLE_START,
+          LOW_PLANES_END, PLANE_14_START, PLANE_14_END - PLANE_14_START, PLANE_14_START,
+          LOW_PLANES_END);
+  closeHeader(file, aPath, trie, trie.bytes());
+}
+
+// The simple case folding maps every code point to a single code point. The trie
+// stores an index into a short list of the distances that code points move by.
+static void writeCaseFoldTable(const char *aPath) {
+  const UChar32 shift = 6;
+  std::map<int32_t, int32_t> deltaIndexes{{0, 0}};
+  std::vector<int32_t> deltas{0};
+  UChar32 end = 0;
+  for (UChar32 codePoint = 0; codePoint <= UCHAR_MAX_VALUE; codePoint++) {
+    int32_t delta = u_foldCase(codePoint, U_FOLD_CASE_DEFAULT) - codePoint;
+    if (delta != 0) {
+      end = codePoint + 1;
+      if (deltaIndexes.try_emplace(delta, deltas.size()).second) {
+        deltas.push_back(delta);
+      }
+    }
+  }
+  if (deltas.size() > 256) {
+    fprintf(stderr, "There are too many case folding deltas for a byte.\n");
+    exit(1);
+  }
+  end = (end + (1 << shift) - 1) >> shift << shift;
+  Trie trie = buildTrie(shift, end, [&](UChar32 aCodePoint) {
+    return deltaIndexes[u_foldCase(aCodePoint, U_FOLD_CASE_DEFAULT) - aCodePoint];
+  });
+
+  const size_t bytes = trie.bytes() + deltas.size() * sizeof(int32_t);
+  FILE *file = openHeader(aPath);
+  fprintf(file,
+          "// %zu bytes in total.\n"
+          "constexpr uint32_t CASE_FOLD_SHIFT = %d;\n"
+          "constexpr uint32_t CASE_FOLD_END = 0x%x;\n\n",
+          bytes, shift, end);
+  trie.print(file, "CASE_FOLD");
+  printArray(file, "int32_t", "CASE_FOLD_DELTAS", deltas);
+  fprintf(file,
+          "// The simple case folding from CaseFolding.txt, with the C and S mappings.\n"
+          "inline char32_t SimpleCaseFold(char32_t aCodePoint) {\n"
+          "  if (aCodePoint >= CASE_FOLD_END) {\n"
+          "    return aCodePoint;\n"
+          "  }\n"
+          "  uint32_t block = CASE_FOLD_STAGE1[aCodePoint >> CASE_FOLD_SHIFT];\n"
+          "  uint32_t mask = (1 << CASE_FOLD_SHIFT) - 1;\n"
+          "  uint8_t delta = CASE_FOLD_STAGE2[(block << CASE_FOLD_SHIFT) | "
+          "(aCodePoint & mask)];\n"
+          "  return aCodePoint + CASE_FOLD_DELTAS[delta];\n"
+          "}\n\n");
+  closeHeader(file, aPath, trie, bytes);
+}
+
+int main(int aArgc, const char **aArgv) {
+  if (aArgc != 3) {
+    fprintf(stderr, "Usage: %s <grapheme header> <case fold header>\n", aArgv[0]);
+    return 1;
+  }
+  writeGraphemeTable(aArgv[1]);
+  writeCaseFoldTable(aArgv[2]);
+  return 0;
+}